@@ -40,6 +40,37 @@ allows socksified DNS */
 /* Prototype and function header for poll function */
 #undef POLL_SIGNATURE
 
+/* Prototype and function header for pselect function, if found */
+#undef PSELECT_SIGNATURE
+
+/* Prototype and function header for ppoll function, if found */
+#undef PPOLL_SIGNATURE
+
+/* Prototypes and function headers for the epoll functions, if found */
+#undef EPOLL_CTL_SIGNATURE
+#undef EPOLL_WAIT_SIGNATURE
+#undef EPOLL_PWAIT_SIGNATURE
+
+/* Prototypes and function headers for the sendto and sendmsg */
+/* functions, if found                                        */
+#undef SENDTO_SIGNATURE
+#undef SENDMSG_SIGNATURE
+
+/* Prototypes and function headers for the read, readv, recv,  */
+/* recvfrom, recvmsg and recvmmsg functions, if found           */
+#undef READ_SIGNATURE
+#undef READV_SIGNATURE
+#undef RECV_SIGNATURE
+#undef RECVFROM_SIGNATURE
+#undef RECVMSG_SIGNATURE
+#undef RECVMMSG_SIGNATURE
+
+/* Prototypes and function headers for the C library's checked */
+/* __read_chk, __recv_chk and __recvfrom_chk, if found         */
+#undef READ_CHK_SIGNATURE
+#undef RECV_CHK_SIGNATURE
+#undef RECVFROM_CHK_SIGNATURE
+
 /* Prototype and function header for close function */
 #undef CLOSE_SIGNATURE
 
@@ -0,0 +1,58 @@
+/* broker.h - Messages exchanged between libtsocks and the tsocksd */
+/* broker, which hands out ready connections to SOCKS servers      */
+
+#ifndef _BROKER_H
+
+#define _BROKER_H 1
+
+#include <netinet/in.h>
+
+/* Where tsocksd listens unless told otherwise, libtsocks looks in */
+/* the same place unless BROKER_ENV names another socket           */
+#ifndef BROKER_SOCKET
+#define BROKER_SOCKET "/var/run/tsocksd.sock"
+#endif
+#define BROKER_ENV "TSOCKS_BROKER"
+
+#define BROKER_VERSION 1
+
+/* Seconds either side waits for the other, and the seconds libtsocks */
+/* leaves a broker it couldn't reach before trying it again           */
+#define BROKER_TIMEOUT 1
+#define BROKER_RETRY 10
+
+/* Connections tsocksd keeps for a server whose path has no pool size */
+#define BROKER_POOL 4
+
+/* Most pools tsocksd keeps, one for each server and set of */
+/* credentials it has been asked about                      */
+#define BROKER_MAXPOOLS 256
+
+/* Most pools tsocksd makes a minute for programs asking about new */
+/* credentials. It drops those pools once BROKER_FAILURES attempts */
+/* in a row to fill them have failed, or once nobody has asked for */
+/* them for BROKER_UNUSED seconds                                  */
+#define BROKER_NEWPOOLS 16
+#define BROKER_FAILURES 3
+#define BROKER_UNUSED 600
+
+/* Structure representing a request for a connection to a SOCKS server, */
+/* connected and (for version 5) authenticated with the given username  */
+/* and password. Both are empty for version 4 and when there's no       */
+/* password, the server must then accept no authentication              */
+struct brokerrequest {
+  int version;                   /* BROKER_VERSION */
+  int type;                      /* SOCKS version of the server */
+  struct sockaddr_in serveraddr; /* The server */
+  char user[256];
+  char pass[256];
+};
+
+/* Structure representing the reply, if status is 0 the connection's */
+/* descriptor comes with it, otherwise status is an errno value      */
+struct brokerreply {
+  int version; /* BROKER_VERSION */
+  int status;
+};
+
+#endif
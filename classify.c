@@ -0,0 +1,353 @@
+/*
+
+   classify.c    - Batch classification of destinations using flattened
+                   rule tables and SSE2/AVX2 kernels where available
+
+*/
+
+#include <arpa/inet.h>
+#include <config.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "parser.h"
+#include "route.h"
+#include "classify.h"
+#include "common.h"
+
+/* Structure used to collect rules before they're sorted and split */
+/* into the classifier's arrays                                     */
+struct classrow {
+  uint32_t net;
+  uint32_t mask;
+  uint32_t plen; /* 33 for irregular netmasks */
+  uint32_t lo;
+  uint32_t hi;
+  uint32_t path;
+  uint32_t rule;
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static int match_scalar(struct classifier *c, uint32_t ip, uint32_t port,
+                        int anyport);
+#ifdef HAVE_X86_KERNELS
+static int cpu_kernel(void);
+static int match_sse2(struct classifier *c, uint32_t ip, uint32_t port,
+                      int anyport);
+static int match_avx2(struct classifier *c, uint32_t ip, uint32_t port,
+                      int anyport);
+#endif
+static void add_row(struct classrow *row, uint32_t net, uint32_t mask,
+                    uint32_t plen, struct routeent *ent);
+static int compare_rows(const void *, const void *);
+
+/* Classify a batch of addresses, filling in verdicts (ROUTE_LOCAL,    */
+/* ROUTE_PATH or ROUTE_DEFAULT) and, for ROUTE_PATH, the path number.  */
+/* The answers are exactly those route_lookup() would give, as with    */
+/* route_lookup() anyport makes every port range match. Any of the     */
+/* output arrays may be NULL. Returns the number of addresses handled  */
+int classify_batch(struct parsedfile *config, struct in_addr *addrs,
+                   unsigned int *ports, int count, int anyport,
+                   int *verdicts, uint32_t *paths, uint32_t *rules) {
+  struct routeindex *index = config->index;
+  static struct classifier trie = {.name = "trie"};
+  struct classifier *c, *built = NULL;
+  uint32_t path = ROUTE_NONE, rule = ROUTE_NORULE;
+  int i, match, verdict;
+
+  /* Threads that race to build the classifier all use the first  */
+  /* one published and throw theirs away. If there isn't memory to */
+  /* build one this batch just walks the trie                      */
+  if ((c = __atomic_load_n(&(index->classifier), __ATOMIC_ACQUIRE)) == NULL) {
+    if ((c = build_classifier(index)) == NULL)
+      c = &trie;
+    else if (!__atomic_compare_exchange_n(&(index->classifier), &built, c, 0,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE)) {
+      free_classifier(c);
+      c = built;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (c->kernel == NULL) {
+      verdict = route_lookup(index, &(addrs[i]), ports[i], anyport, &path,
+                             &rule);
+    } else {
+      match = c->kernel(c, ntohl(addrs[i].s_addr), ports[i], anyport);
+      if (match < 0) {
+        verdict = ROUTE_DEFAULT;
+        path = ROUTE_NONE;
+        rule = ROUTE_NORULE;
+      } else {
+        path = c->path[match];
+        rule = c->rule[match];
+        verdict = (path == ROUTE_NONE ? ROUTE_LOCAL : ROUTE_PATH);
+      }
+      if (index->nfiles)
+        verdict = route_files(index, ntohl(addrs[i].s_addr), verdict, &path,
+                              &rule);
+    }
+    if (verdicts)
+      verdicts[i] = verdict;
+    if (paths)
+      paths[i] = (verdict == ROUTE_PATH ? path : ROUTE_NONE);
+    if (rules)
+      rules[i] = rule;
+  }
+
+  return (count);
+}
+
+/* Flatten the rules in a routing index and pick the best kernel this */
+/* CPU can run for them                                               */
+struct classifier *build_classifier(struct routeindex *index) {
+  struct classifier *c;
+  struct routenode *node;
+  struct routeent localent;
+  struct classrow *rows;
+  uint32_t nrules = 0, nrows, n, i;
+  uint32_t **arrays[6];
+  uint32_t mask;
+
+  if ((c = calloc(1, sizeof(*c))) == NULL)
+    return (NULL);
+
+  /* Generated matchers and very large configurations keep using */
+  /* route_lookup() for each address                              */
+  if (index->compiled == NULL) {
+    for (n = 0; n < index->nnodes; n++)
+      nrules += index->nodes[n].nents + (index->nodes[n].local ? 1 : 0);
+    nrules += index->nirreg;
+  }
+  if ((index->compiled != NULL) || (nrules > CLASSIFY_MAXRULES)) {
+    c->name = "trie";
+    show_msg(MSGDEBUG, "Classifying batches with the routing trie\n");
+    return (c);
+  }
+
+  c->nrules = (nrules + CLASSIFY_BLOCK - 1) & ~(CLASSIFY_BLOCK - 1);
+  if (c->nrules == 0)
+    c->nrules = CLASSIFY_BLOCK;
+  arrays[0] = &(c->net);
+  arrays[1] = &(c->mask);
+  arrays[2] = &(c->lo);
+  arrays[3] = &(c->hi);
+  arrays[4] = &(c->path);
+  arrays[5] = &(c->rule);
+  for (i = 0; i < 6; i++) {
+    if (posix_memalign((void **)arrays[i], 32, c->nrules * sizeof(uint32_t))) {
+      free_classifier(c);
+      return (NULL);
+    }
+  }
+  if ((rows = malloc(c->nrules * sizeof(*rows))) == NULL) {
+    free_classifier(c);
+    return (NULL);
+  }
+
+  /* Gather every rule, then order them the way route_lookup() would */
+  /* prefer them: by path with local networks last, then trie rules  */
+  /* from shortest prefix to longest, then the irregular networks    */
+  nrows = 0;
+  for (n = 0; n < index->nnodes; n++) {
+    node = &(index->nodes[n]);
+    mask = (node->plen ? (0xffffffffU << (32 - node->plen)) : 0);
+    for (i = 0; i < node->nents; i++)
+      add_row(&(rows[nrows++]), node->prefix, mask, node->plen,
+              &(index->ents[node->firstent + i]));
+    if (node->local) {
+      memset(&localent, 0x0, sizeof(localent));
+      localent.path = ROUTE_NONE;
+      localent.rule = node->local - 1;
+      add_row(&(rows[nrows++]), node->prefix, mask, node->plen, &localent);
+    }
+  }
+  for (i = 0; i < index->nirreg; i++)
+    add_row(&(rows[nrows++]), index->irreg[i].net, index->irreg[i].mask, 33,
+            &(index->irreg[i].ent));
+  qsort(rows, nrows, sizeof(*rows), compare_rows);
+
+  /* Pad with rules which can never match (no address masked with 0 */
+  /* equals 1)                                                       */
+  for (; nrows < c->nrules; nrows++) {
+    memset(&(rows[nrows]), 0x0, sizeof(*rows));
+    rows[nrows].net = 1;
+    rows[nrows].lo = 1;
+    rows[nrows].path = ROUTE_NONE;
+  }
+
+  for (i = 0; i < c->nrules; i++) {
+    c->net[i] = rows[i].net;
+    c->mask[i] = rows[i].mask;
+    c->lo[i] = rows[i].lo;
+    c->hi[i] = rows[i].hi;
+    c->path[i] = rows[i].path;
+    c->rule[i] = rows[i].rule;
+  }
+  free(rows);
+
+  c->name = "scalar";
+  c->kernel = match_scalar;
+#ifdef HAVE_X86_KERNELS
+  switch (cpu_kernel()) {
+  case 2:
+    c->name = "avx2";
+    c->kernel = match_avx2;
+    break;
+  case 1:
+    c->name = "sse2";
+    c->kernel = match_sse2;
+    break;
+  }
+#endif
+
+  show_msg(MSGDEBUG, "Classifying batches with the %s kernel over %d rules\n",
+           c->name, nrules);
+
+  return (c);
+}
+
+void free_classifier(struct classifier *c) {
+
+  if (c == NULL)
+    return;
+
+  free(c->net);
+  free(c->mask);
+  free(c->lo);
+  free(c->hi);
+  free(c->path);
+  free(c->rule);
+  free(c);
+}
+
+static void add_row(struct classrow *row, uint32_t net, uint32_t mask,
+                    uint32_t plen, struct routeent *ent) {
+
+  row->net = net & mask;
+  row->mask = mask;
+  row->plen = plen;
+  /* A start port of 0 means any port */
+  row->lo = (ent->startport ? ent->startport : 0);
+  row->hi = (ent->startport ? ent->endport : 65535);
+  row->path = ent->path;
+  row->rule = ent->rule;
+}
+
+static int compare_rows(const void *a, const void *b) {
+  const struct classrow *ra = a, *rb = b;
+
+  if (ra->path != rb->path)
+    return ((ra->path < rb->path) ? -1 : 1);
+  if (ra->plen != rb->plen)
+    return ((ra->plen < rb->plen) ? -1 : 1);
+  if (ra->rule != rb->rule)
+    return ((ra->rule < rb->rule) ? -1 : 1);
+
+  return (0);
+}
+
+static int match_scalar(struct classifier *c, uint32_t ip, uint32_t port,
+                        int anyport) {
+  uint32_t i;
+
+  for (i = 0; i < c->nrules; i++) {
+    if (((ip & c->mask[i]) == c->net[i]) &&
+        (anyport || ((c->lo[i] <= port) && (port <= c->hi[i]))))
+      return (i);
+  }
+
+  return (-1);
+}
+
+#ifdef HAVE_X86_KERNELS
+/* Work out which kernel the CPU can run, 2 for AVX2, 1 for SSE2 and 0 */
+/* for neither. This asks cpuid directly rather than using             */
+/* __builtin_cpu_supports() since libtsocks isn't linked with libgcc   */
+static int cpu_kernel(void) {
+  unsigned int eax, ebx, ecx, edx;
+  int kernel = 0;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return (0);
+  if (edx & bit_SSE2)
+    kernel = 1;
+
+  /* AVX2 also needs the OS to save the YMM registers for us */
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    return (kernel);
+  __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  if ((eax & 0x6) != 0x6)
+    return (kernel);
+  if (__get_cpuid_max(0, NULL) < 7)
+    return (kernel);
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  if (ebx & bit_AVX2)
+    kernel = 2;
+
+  return (kernel);
+}
+
+/* Four rules per instruction, two registers per step */
+__attribute__((target("sse2"))) static int
+match_sse2(struct classifier *c, uint32_t ip, uint32_t port, int anyport) {
+  __m128i vip = _mm_set1_epi32(ip);
+  __m128i vport = _mm_set1_epi32(port);
+  __m128i vany = _mm_set1_epi32(anyport ? -1 : 0);
+  __m128i hit[2], bad;
+  uint32_t i, j, bits;
+
+  for (i = 0; i < c->nrules; i += CLASSIFY_BLOCK) {
+    for (j = 0; j < 2; j++) {
+      hit[j] = _mm_cmpeq_epi32(
+          _mm_and_si128(vip, _mm_load_si128((__m128i *)&(c->mask[i + j * 4]))),
+          _mm_load_si128((__m128i *)&(c->net[i + j * 4])));
+      bad = _mm_or_si128(
+          _mm_cmpgt_epi32(_mm_load_si128((__m128i *)&(c->lo[i + j * 4])),
+                          vport),
+          _mm_cmpgt_epi32(vport,
+                          _mm_load_si128((__m128i *)&(c->hi[i + j * 4]))));
+      hit[j] = _mm_andnot_si128(_mm_andnot_si128(vany, bad), hit[j]);
+    }
+    bits = _mm_movemask_ps(_mm_castsi128_ps(hit[0])) |
+           (_mm_movemask_ps(_mm_castsi128_ps(hit[1])) << 4);
+    if (bits)
+      return (i + __builtin_ctz(bits));
+  }
+
+  return (-1);
+}
+
+/* Eight rules per instruction */
+__attribute__((target("avx2"))) static int
+match_avx2(struct classifier *c, uint32_t ip, uint32_t port, int anyport) {
+  __m256i vip = _mm256_set1_epi32(ip);
+  __m256i vport = _mm256_set1_epi32(port);
+  __m256i vany = _mm256_set1_epi32(anyport ? -1 : 0);
+  __m256i hit, bad;
+  uint32_t i, bits;
+
+  for (i = 0; i < c->nrules; i += CLASSIFY_BLOCK) {
+    hit = _mm256_cmpeq_epi32(
+        _mm256_and_si256(vip, _mm256_load_si256((__m256i *)&(c->mask[i]))),
+        _mm256_load_si256((__m256i *)&(c->net[i])));
+    bad = _mm256_or_si256(
+        _mm256_cmpgt_epi32(_mm256_load_si256((__m256i *)&(c->lo[i])), vport),
+        _mm256_cmpgt_epi32(vport, _mm256_load_si256((__m256i *)&(c->hi[i]))));
+    hit = _mm256_andnot_si256(_mm256_andnot_si256(vany, bad), hit);
+    bits = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+    if (bits)
+      return (i + __builtin_ctz(bits));
+  }
+
+  return (-1);
+}
+#endif
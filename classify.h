@@ -0,0 +1,39 @@
+/* classify.h - Structures and functions for classifying batches of */
+/* destinations against flattened tables of the configured networks */
+
+#ifndef _CLASSIFY_H
+
+#define _CLASSIFY_H 1
+
+#include <stdint.h>
+
+/* Number of rules tested per step of the vector kernels, the tables */
+/* are padded to a multiple of this with rules that never match      */
+#define CLASSIFY_BLOCK 8
+
+/* Beyond this many rules a linear scan, however wide, loses to the */
+/* trie so classify_batch() just walks the trie for each address    */
+#define CLASSIFY_MAXRULES 256
+
+/* Structure representing the rules of a routing index flattened into */
+/* structure of arrays form. Rules are ordered by path with the local */
+/* networks last, so the first rule to match an address decides it    */
+struct classifier {
+  uint32_t nrules;  /* Number of rules including padding */
+  uint32_t *net;    /* Network (host byte order, already masked) */
+  uint32_t *mask;   /* Netmask (host byte order) */
+  uint32_t *lo;     /* Lowest port matched */
+  uint32_t *hi;     /* Highest port matched */
+  uint32_t *path;   /* Path number, or ROUTE_NONE for a local network */
+  uint32_t *rule;   /* Rule number */
+  const char *name; /* Name of the kernel in use */
+  int (*kernel)(struct classifier *, uint32_t ip, uint32_t port,
+                int anyport); /* Returns the first matching rule or -1, */
+                              /* NULL if lookups go through the trie     */
+};
+
+/* Functions provided by classify module */
+struct classifier *build_classifier(struct routeindex *);
+void free_classifier(struct classifier *);
+
+#endif
@@ -7,18 +7,47 @@
 #include <arpa/inet.h>
 #include <config.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "parser.h"
+#include "route.h"
 #include "common.h"
 
 /* Global configuration variables */
 #define MAXLINE BUFSIZ /* Max length of conf line  */
+#define ARENA_ALIGN 16 /* Alignment of arena allocations */
+#define ARENA_CHUNK 1024 /* Size of the first chunk in each pool */
+#define ARENA_HEADER                                                           \
+  ((sizeof(struct arenachunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
 static struct serverent *currentcontext = NULL;
 
+/* Images can be handed to child processes in a sealed memfd, the */
+/* constants are missing from older headers so supply them here    */
+#ifdef SYS_memfd_create
+#define HAVE_MEMFD 1
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+#define IMAGE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#endif
+
 static int handle_line(struct parsedfile *, char *, int);
 static int check_server(struct serverent *);
 static int tokenize(char *, int, char *[]);
@@ -29,9 +58,25 @@ static int handle_server(struct parsedfile *, int, char *);
 static int handle_type(struct parsedfile *config, int, char *);
 static int handle_port(struct parsedfile *config, int, char *);
 static int handle_local(struct parsedfile *, int, char *);
+static int handle_file(struct parsedfile *, int, char *, int);
 static int handle_defuser(struct parsedfile *, int, char *);
 static int handle_defpass(struct parsedfile *, int, char *);
-static int make_netent(char *value, struct netent **ent);
+static int handle_option(struct parsedfile *, int, char *, char *, int);
+static int handle_number(struct parsedfile *, int, char *, char *, int *,
+                         int);
+static int handle_refill(struct parsedfile *, int, char *);
+static int make_netent(char *value, struct netent *ent);
+static void *arena_alloc(struct arenachunk **pool, size_t size,
+                         size_t align);
+static char *arena_strdup(struct parsedfile *config, char *value);
+static struct netent *arena_netent(struct parsedfile *config,
+                                   struct netent *ent);
+static int read_config_image(char *, struct stat *, struct parsedfile *);
+static int map_config_image(int, char *, struct stat *, struct parsedfile *);
+static int check_config_image(struct imageheader *, size_t);
+static void emit_config_image(FILE *, struct stat *, struct parsedfile *);
+static uint32_t image_string(char **, uint32_t *, uint32_t *, char *);
+static uint32_t image_align(uint32_t);
 
 int read_config(char *filename, struct parsedfile *config) {
   FILE *conf;
@@ -87,9 +132,582 @@ int read_config(char *filename, struct parsedfile *config) {
     }
   }
 
+  /* Compile the networks into the index used for lookups */
+  config->index = build_route_index(config);
+
+  return (rc);
+}
+
+/* Load the configuration for libtsocks. If validateconf has written */
+/* a compiled image of the file (and the file hasn't changed since)  */
+/* the image is mapped and shared instead of parsing the text again */
+int load_config(char *filename, struct parsedfile *config) {
+  char imagename[MAXLINE];
+  struct stat source;
+
+  if (filename == NULL)
+    filename = CONF_FILE;
+
+  if (strlen(filename) + sizeof(IMAGE_SUFFIX) <= sizeof(imagename)) {
+    strcpy(imagename, filename);
+    strcat(imagename, IMAGE_SUFFIX);
+    if (stat(filename, &source) != 0)
+      memset(&source, 0x0, sizeof(source));
+    if (read_config_image(imagename, &source, config) == 0)
+      return (0);
+  }
+
+  return (read_config(filename, config));
+}
+
+/* Load the configuration from a compiled image in a sealed memfd */
+/* handed down by tsocksrun. The image is only trusted if it can  */
+/* no longer be changed, and like an image file it is ignored if  */
+/* the text file has been changed since it was built              */
+int load_config_fd(int fd, char *filename, struct parsedfile *config) {
+#ifdef HAVE_MEMFD
+  struct stat source;
+  int seals;
+
+  if (filename == NULL)
+    filename = CONF_FILE;
+
+  if (((seals = fcntl(fd, F_GET_SEALS)) == -1) ||
+      ((seals & IMAGE_SEALS) != IMAGE_SEALS)) {
+    show_msg(MSGERR, "Configuration descriptor %d isn't a sealed memfd, "
+                     "ignoring it\n", fd);
+    return (1);
+  }
+
+  if (stat(filename, &source) != 0)
+    memset(&source, 0x0, sizeof(source));
+
+  return (map_config_image(fd, "<memfd>", &source, config));
+#else
+  return (1);
+#endif
+}
+
+/* Release everything a parsed configuration holds, leaving the */
+/* structure itself to the caller                               */
+void free_config(struct parsedfile *config) {
+  struct arenachunk **pools[3], *chunk, *next;
+  int i;
+
+  /* Configurations compiled into libtsocks-static are static */
+  if ((config->index != NULL) && (config->index->compiled != NULL))
+    return;
+
+  free_route_index(config->index);
+  if (config->image != NULL)
+    munmap(config->image, config->imagesize);
+
+  pools[0] = &(config->arena.servers);
+  pools[1] = &(config->arena.nets);
+  pools[2] = &(config->arena.strings);
+  for (i = 0; i < 3; i++) {
+    for (chunk = *pools[i]; chunk != NULL; chunk = next) {
+      next = chunk->next;
+      free(chunk);
+    }
+  }
+
+  memset(config, 0x0, sizeof(*config));
+}
+
+/* Allocate zeroed storage from one of a configuration's pools with */
+/* the given alignment (a power of two no larger than ARENA_ALIGN). */
+/* Each new chunk is twice the size of the last so a pool only ever */
+/* holds a few chunks however large the configuration               */
+static void *arena_alloc(struct arenachunk **pool, size_t size,
+                         size_t align) {
+  struct arenachunk *chunk = *pool;
+  size_t chunksize;
+  void *mem;
+
+  if (chunk != NULL)
+    chunk->used = (chunk->used + align - 1) & ~(align - 1);
+
+  if ((chunk == NULL) || (chunk->used > chunk->size) ||
+      (chunk->size - chunk->used < size)) {
+    chunksize = (chunk ? chunk->size * 2 : ARENA_CHUNK);
+    if (chunksize < size)
+      chunksize = size;
+    if ((chunk = malloc(ARENA_HEADER + chunksize)) == NULL) {
+      /* If we couldn't malloc some storage, leave */
+      exit(1);
+    }
+    chunk->next = *pool;
+    chunk->used = 0;
+    chunk->size = chunksize;
+    *pool = chunk;
+  }
+
+  mem = (char *)chunk + ARENA_HEADER + chunk->used;
+  chunk->used += size;
+  memset(mem, 0x0, size);
+
+  return (mem);
+}
+
+static char *arena_strdup(struct parsedfile *config, char *value) {
+  char *copy;
+
+  copy = arena_alloc(&(config->arena.strings), strlen(value) + 1, 1);
+  strcpy(copy, value);
+
+  return (copy);
+}
+
+/* Move a network parsed by make_netent() into the arena */
+static struct netent *arena_netent(struct parsedfile *config,
+                                   struct netent *ent) {
+  struct netent *newent;
+
+  newent = arena_alloc(&(config->arena.nets), sizeof(*newent), ARENA_ALIGN);
+  memcpy(newent, ent, sizeof(*newent));
+  show_msg(MSGDEBUG, "New network entry for %s going to 0x%08x\n",
+           inet_ntoa(newent->localip), newent);
+
+  return (newent);
+}
+
+/* Map a compiled configuration image, returns 0 on success or 1 if */
+/* the image doesn't exist, is stale or can't be used                */
+static int read_config_image(char *imagename, struct stat *source,
+                             struct parsedfile *config) {
+  int fd, rc;
+
+  if ((fd = open(imagename, O_RDONLY)) == -1)
+    return (1);
+  rc = map_config_image(fd, imagename, source, config);
+  close(fd);
+
+  return (rc);
+}
+
+/* Map a compiled configuration image from an open descriptor, the */
+/* descriptor can be closed again once this returns                */
+static int map_config_image(int fd, char *imagename, struct stat *source,
+                            struct parsedfile *config) {
+  struct imageheader *hdr;
+  struct imageserver *isrv;
+  struct imagefile *ifile;
+  struct serverent *servers, *server;
+  struct routeindex *index;
+  char *strings;
+  struct stat st;
+  void *image;
+  uint32_t i;
+
+  if ((fstat(fd, &st) != 0) || (st.st_size < sizeof(struct imageheader)))
+    return (1);
+
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED)
+    return (1);
+
+  hdr = (struct imageheader *)image;
+  if (check_config_image(hdr, st.st_size)) {
+    show_msg(MSGERR,
+             "Configuration image %s is corrupt or from a different "
+             "version of tsocks, ignoring it\n",
+             imagename);
+    munmap(image, st.st_size);
+    return (1);
+  }
+
+  /* If the text file has been changed since the image was built */
+  /* it takes precedence                                         */
+  if (source->st_mtime &&
+      ((hdr->srcmtime != (uint32_t)source->st_mtime) ||
+       (hdr->srcmtimens != (uint32_t)source->st_mtim.tv_nsec) ||
+       (hdr->srcsize != (uint32_t)source->st_size))) {
+    show_msg(MSGDEBUG,
+             "Configuration image %s is older than the "
+             "configuration file, ignoring it\n",
+             imagename);
+    munmap(image, st.st_size);
+    return (1);
+  }
+
+  /* Only the server table needs to be private, everything else */
+  /* is used directly from the shared mapping                   */
+  memset(config, 0x0, sizeof(*config));
+  if (((index = calloc(1, sizeof(*index))) == NULL) ||
+      ((index->paths = malloc((hdr->npaths + 1) * sizeof(*index->paths))) ==
+       NULL))
+    exit(1);
+  servers = arena_alloc(&(config->arena.servers),
+                        hdr->npaths * sizeof(*servers), ARENA_ALIGN);
+
+  strings = (char *)image + hdr->strings;
+  isrv = (struct imageserver *)((char *)image + hdr->servers);
+  for (i = 0; i <= hdr->npaths; i++) {
+    server = (i == hdr->npaths ? &(config->defaultserver) : &(servers[i]));
+    server->lineno = isrv[i].lineno;
+    server->port = isrv[i].port;
+    server->type = isrv[i].type;
+    server->address =
+        (isrv[i].address == IMAGE_NOSTRING ? NULL : strings + isrv[i].address);
+    server->defuser =
+        (isrv[i].defuser == IMAGE_NOSTRING ? NULL : strings + isrv[i].defuser);
+    server->defpass =
+        (isrv[i].defpass == IMAGE_NOSTRING ? NULL : strings + isrv[i].defpass);
+    server->flags = isrv[i].flags;
+    server->poolsize = isrv[i].poolsize;
+    server->poolidle = isrv[i].poolidle;
+    server->failover = (isrv[i].failover == IMAGE_NOSTRING
+                            ? NULL
+                            : strings + isrv[i].failover);
+    server->failoverdelay = isrv[i].failoverdelay;
+    if (i < hdr->npaths) {
+      server->next = (i + 1 < hdr->npaths ? &(servers[i + 1]) : NULL);
+      index->paths[i] = server;
+    }
+  }
+  if (hdr->npaths)
+    config->paths = servers;
+
+  index->mapped = 1;
+  index->npaths = hdr->npaths;
+  index->nrules = hdr->nrules;
+  index->nnodes = hdr->nnodes;
+  index->nents = hdr->nents;
+  index->nirreg = hdr->nirreg;
+  index->nodes = (struct routenode *)((char *)image + hdr->nodes);
+  index->ents = (struct routeent *)((char *)image + hdr->ents);
+  index->irreg = (struct routeirreg *)((char *)image + hdr->irreg);
+
+  /* Prefix files are loaded per process, so their table is private */
+  if (hdr->nfiles) {
+    if ((index->files = calloc(hdr->nfiles, sizeof(*index->files))) == NULL)
+      exit(1);
+    ifile = (struct imagefile *)((char *)image + hdr->files);
+    for (i = 0; i < hdr->nfiles; i++) {
+      index->files[i].filename = strings + ifile[i].filename;
+      index->files[i].path = ifile[i].path;
+    }
+    index->nfiles = hdr->nfiles;
+  }
+
+  config->index = index;
+  config->image = image;
+  config->imagesize = st.st_size;
+
+  show_msg(MSGDEBUG, "Mapped configuration image %s (%d paths, %d rules)\n",
+           imagename, hdr->npaths, hdr->nrules);
+
+  return (0);
+}
+
+/* Make sure every offset and index in an image stays inside it, */
+/* returns 0 if the image is sound                               */
+static int check_config_image(struct imageheader *hdr, size_t size) {
+  struct routenode *nodes;
+  struct routeent *ents;
+  struct routeirreg *irreg;
+  struct imageserver *isrv;
+  struct imagefile *ifile;
+  char *strings;
+  uint32_t i;
+
+  if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) ||
+      (hdr->version != IMAGE_VERSION) ||
+      (hdr->byteorder != IMAGE_BYTEORDER) || (hdr->size != size))
+    return (1);
+
+#define SECTION_OK(off, count, type)                                           \
+  (!((off) % sizeof(uint32_t)) && ((off) <= size) &&                           \
+   ((uint64_t)(count) * sizeof(type) <= size - (off)))
+
+  if (!SECTION_OK(hdr->servers, (uint64_t)hdr->npaths + 1,
+                  struct imageserver) ||
+      !SECTION_OK(hdr->nodes, hdr->nnodes, struct routenode) ||
+      !SECTION_OK(hdr->ents, hdr->nents, struct routeent) ||
+      !SECTION_OK(hdr->irreg, hdr->nirreg, struct routeirreg) ||
+      !SECTION_OK(hdr->files, hdr->nfiles, struct imagefile) ||
+      !SECTION_OK(hdr->strings, hdr->stringsize, char) ||
+      (hdr->nnodes == 0))
+    return (1);
+
+#undef SECTION_OK
+
+  /* Every string must be terminated inside the string section */
+  strings = (char *)hdr + hdr->strings;
+  if (hdr->stringsize && strings[hdr->stringsize - 1])
+    return (1);
+  isrv = (struct imageserver *)((char *)hdr + hdr->servers);
+  for (i = 0; i <= hdr->npaths; i++) {
+    if (((isrv[i].address != IMAGE_NOSTRING) &&
+         (isrv[i].address >= hdr->stringsize)) ||
+        ((isrv[i].defuser != IMAGE_NOSTRING) &&
+         (isrv[i].defuser >= hdr->stringsize)) ||
+        ((isrv[i].defpass != IMAGE_NOSTRING) &&
+         (isrv[i].defpass >= hdr->stringsize)) ||
+        ((isrv[i].failover != IMAGE_NOSTRING) &&
+         (isrv[i].failover >= hdr->stringsize)))
+      return (1);
+  }
+
+  nodes = (struct routenode *)((char *)hdr + hdr->nodes);
+  for (i = 0; i < hdr->nnodes; i++) {
+    if ((nodes[i].plen > 32) || (nodes[i].child[0] >= hdr->nnodes) ||
+        (nodes[i].child[1] >= hdr->nnodes) ||
+        (nodes[i].firstent > hdr->nents) ||
+        (nodes[i].nents > hdr->nents - nodes[i].firstent) ||
+        (nodes[i].local > hdr->nrules))
+      return (1);
+    /* Children must be deeper than their parent or lookups */
+    /* could loop forever                                   */
+    if ((nodes[i].child[0] &&
+         (nodes[nodes[i].child[0]].plen <= nodes[i].plen)) ||
+        (nodes[i].child[1] &&
+         (nodes[nodes[i].child[1]].plen <= nodes[i].plen)))
+      return (1);
+  }
+
+  ents = (struct routeent *)((char *)hdr + hdr->ents);
+  for (i = 0; i < hdr->nents; i++) {
+    if ((ents[i].path >= hdr->npaths) || (ents[i].rule >= hdr->nrules))
+      return (1);
+  }
+
+  irreg = (struct routeirreg *)((char *)hdr + hdr->irreg);
+  for (i = 0; i < hdr->nirreg; i++) {
+    if (((irreg[i].ent.path >= hdr->npaths) &&
+         (irreg[i].ent.path != ROUTE_NONE)) ||
+        (irreg[i].ent.rule >= hdr->nrules))
+      return (1);
+  }
+
+  /* Files must be in path order for route_files() */
+  ifile = (struct imagefile *)((char *)hdr + hdr->files);
+  for (i = 0; i < hdr->nfiles; i++) {
+    if (((ifile[i].path >= hdr->npaths) && (ifile[i].path != ROUTE_NONE)) ||
+        (i && (ifile[i].path < ifile[i - 1].path)) ||
+        (ifile[i].filename >= hdr->stringsize))
+      return (1);
+  }
+
+  return (0);
+}
+
+/* Write a compiled image of a parsed configuration file. The image */
+/* is written to a temporary file and renamed into place so that    */
+/* processes with the old image mapped are unaffected. The image    */
+/* gets the same permissions as the configuration file              */
+int write_config_image(char *imagename, char *filename,
+                       struct parsedfile *config) {
+  struct stat source;
+  char tmpname[MAXLINE];
+  FILE *out;
+  int fd, rc = 0;
+
+  if (stat(filename, &source) != 0) {
+    show_msg(MSGERR, "Could not stat configuration file %s (%s)\n", filename,
+             strerror(errno));
+    return (1);
+  }
+
+  if (strlen(imagename) + 5 > sizeof(tmpname)) {
+    show_msg(MSGERR, "Image file name %s is too long\n", imagename);
+    return (1);
+  }
+  strcpy(tmpname, imagename);
+  strcat(tmpname, ".tmp");
+
+  /* A temporary file left by an earlier run is never reused, it */
+  /* could have anybody's permissions                            */
+  unlink(tmpname);
+  if (((fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL,
+                  source.st_mode & 0777)) == -1) ||
+      (fchmod(fd, source.st_mode & 0777) != 0) ||
+      ((out = fdopen(fd, "w")) == NULL)) {
+    show_msg(MSGERR, "Could not open %s for writing (%s)\n", tmpname,
+             strerror(errno));
+    if (fd != -1) {
+      close(fd);
+      unlink(tmpname);
+    }
+    return (1);
+  }
+
+  emit_config_image(out, &source, config);
+
+  if (ferror(out) | fclose(out)) {
+    show_msg(MSGERR, "Error writing configuration image %s (%s)\n", tmpname,
+             strerror(errno));
+    unlink(tmpname);
+    rc = 1;
+  } else if (rename(tmpname, imagename) != 0) {
+    show_msg(MSGERR, "Could not rename %s to %s (%s)\n", tmpname, imagename,
+             strerror(errno));
+    unlink(tmpname);
+    rc = 1;
+  }
+
   return (rc);
 }
 
+/* Write a compiled image of a parsed configuration file into a sealed */
+/* memfd, returns the descriptor or -1. The seals mean whoever the     */
+/* descriptor is handed to can rely on the image never changing        */
+int write_config_memfd(char *filename, struct parsedfile *config) {
+#ifdef HAVE_MEMFD
+  struct stat source;
+  FILE *out;
+  int fd, copy;
+
+  if (filename == NULL)
+    filename = CONF_FILE;
+  if (stat(filename, &source) != 0)
+    memset(&source, 0x0, sizeof(source));
+
+  if ((fd = syscall(SYS_memfd_create, "tsocks.conf", MFD_ALLOW_SEALING)) ==
+      -1) {
+    show_msg(MSGERR, "Could not create memfd for configuration (%s)\n",
+             strerror(errno));
+    return (-1);
+  }
+
+  if (((copy = dup(fd)) == -1) || ((out = fdopen(copy, "w")) == NULL)) {
+    if (copy != -1)
+      close(copy);
+    close(fd);
+    return (-1);
+  }
+  emit_config_image(out, &source, config);
+  if ((ferror(out) | fclose(out)) ||
+      (fcntl(fd, F_ADD_SEALS, IMAGE_SEALS | F_SEAL_SEAL) == -1)) {
+    show_msg(MSGERR, "Error writing configuration image to memfd (%s)\n",
+             strerror(errno));
+    close(fd);
+    return (-1);
+  }
+
+  return (fd);
+#else
+  show_msg(MSGERR, "Configuration images can't be passed in memory on "
+                   "this system\n");
+  return (-1);
+#endif
+}
+
+/* Lay out and write the image itself */
+static void emit_config_image(FILE *out, struct stat *source,
+                              struct parsedfile *config) {
+  struct imageheader hdr;
+  struct imageserver *isrv = NULL;
+  struct imagefile *ifile = NULL;
+  struct routeindex *index = config->index;
+  struct serverent *server;
+  char *strings = NULL;
+  uint32_t stringsize = 0, stringspace = 0;
+  char pad[8];
+  uint32_t i, off;
+
+  if ((isrv = calloc(index->npaths + 1, sizeof(*isrv))) == NULL)
+    exit(1);
+  for (i = 0; i <= index->npaths; i++) {
+    server = (i == index->npaths ? &(config->defaultserver) : index->paths[i]);
+    isrv[i].lineno = server->lineno;
+    isrv[i].port = server->port;
+    isrv[i].type = server->type;
+    isrv[i].address =
+        image_string(&strings, &stringsize, &stringspace, server->address);
+    isrv[i].defuser =
+        image_string(&strings, &stringsize, &stringspace, server->defuser);
+    isrv[i].defpass =
+        image_string(&strings, &stringsize, &stringspace, server->defpass);
+    isrv[i].flags = server->flags;
+    isrv[i].poolsize = server->poolsize;
+    isrv[i].poolidle = server->poolidle;
+    isrv[i].failover =
+        image_string(&strings, &stringsize, &stringspace, server->failover);
+    isrv[i].failoverdelay = server->failoverdelay;
+  }
+  if ((ifile = calloc(index->nfiles + 1, sizeof(*ifile))) == NULL)
+    exit(1);
+  for (i = 0; i < index->nfiles; i++) {
+    ifile[i].path = index->files[i].path;
+    ifile[i].filename = image_string(&strings, &stringsize, &stringspace,
+                                     index->files[i].filename);
+  }
+
+  /* Lay the sections out one after another */
+  memset(&hdr, 0x0, sizeof(hdr));
+  memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+  hdr.version = IMAGE_VERSION;
+  hdr.byteorder = IMAGE_BYTEORDER;
+  hdr.srcmtime = source->st_mtime;
+  hdr.srcmtimens = source->st_mtim.tv_nsec;
+  hdr.srcsize = source->st_size;
+  hdr.npaths = index->npaths;
+  hdr.nrules = index->nrules;
+  hdr.nnodes = index->nnodes;
+  hdr.nents = index->nents;
+  hdr.nirreg = index->nirreg;
+  hdr.nfiles = index->nfiles;
+  off = image_align(sizeof(hdr));
+  hdr.servers = off;
+  off = image_align(off + (index->npaths + 1) * sizeof(*isrv));
+  hdr.nodes = off;
+  off = image_align(off + index->nnodes * sizeof(*index->nodes));
+  hdr.ents = off;
+  off = image_align(off + index->nents * sizeof(*index->ents));
+  hdr.irreg = off;
+  off = image_align(off + index->nirreg * sizeof(*index->irreg));
+  hdr.files = off;
+  off = image_align(off + index->nfiles * sizeof(*ifile));
+  hdr.strings = off;
+  hdr.stringsize = stringsize;
+  hdr.size = off + stringsize;
+
+  memset(pad, 0x0, sizeof(pad));
+#define WRITE_SECTION(off, data, len)                                          \
+  (fwrite(pad, 1, (off)-ftell(out), out), fwrite((data), 1, (len), out))
+
+  fwrite(&hdr, sizeof(hdr), 1, out);
+  WRITE_SECTION(hdr.servers, isrv, (index->npaths + 1) * sizeof(*isrv));
+  WRITE_SECTION(hdr.nodes, index->nodes, index->nnodes * sizeof(*index->nodes));
+  WRITE_SECTION(hdr.ents, index->ents, index->nents * sizeof(*index->ents));
+  WRITE_SECTION(hdr.irreg, index->irreg,
+                index->nirreg * sizeof(*index->irreg));
+  WRITE_SECTION(hdr.files, ifile, index->nfiles * sizeof(*ifile));
+  WRITE_SECTION(hdr.strings, strings, stringsize);
+
+#undef WRITE_SECTION
+
+  free(isrv);
+  free(ifile);
+  free(strings);
+}
+
+/* Append a string to an image's string section, returning its offset */
+static uint32_t image_string(char **strings, uint32_t *size, uint32_t *space,
+                             char *value) {
+  uint32_t len, off;
+
+  if (value == NULL)
+    return (IMAGE_NOSTRING);
+
+  len = strlen(value) + 1;
+  while (*size + len > *space) {
+    *space = (*space ? *space * 2 : 256);
+    if ((*strings = realloc(*strings, *space)) == NULL)
+      exit(1);
+  }
+
+  off = *size;
+  memcpy(*strings + off, value, len);
+  *size += len;
+
+  return (off);
+}
+
+static uint32_t image_align(uint32_t off) { return ((off + 7) & ~7U); }
+
 /* Check server entries (and establish defaults) */
 static int check_server(struct serverent *server) {
 
@@ -150,8 +768,31 @@ static int handle_line(struct parsedfile *config, char *line, int lineno) {
         handle_defuser(config, lineno, words[2]);
       } else if (!strcmp(words[0], "default_pass")) {
         handle_defpass(config, lineno, words[2]);
+      } else if (!strcmp(words[0], "pipeline")) {
+        handle_option(config, lineno, words[0], words[2], SERVER_PIPELINE);
+      } else if (!strcmp(words[0], "fastopen")) {
+        handle_option(config, lineno, words[0], words[2], SERVER_FASTOPEN);
+      } else if (!strcmp(words[0], "optimistic")) {
+        handle_option(config, lineno, words[0], words[2], SERVER_OPTIMISTIC);
+      } else if (!strcmp(words[0], "broker")) {
+        handle_option(config, lineno, words[0], words[2], SERVER_BROKER);
+      } else if (!strcmp(words[0], "pool")) {
+        handle_number(config, lineno, words[0], words[2],
+                      &(currentcontext->poolsize), POOL_MAX);
+      } else if (!strcmp(words[0], "pool_idle")) {
+        handle_number(config, lineno, words[0], words[2],
+                      &(currentcontext->poolidle), INT_MAX);
+      } else if (!strcmp(words[0], "failover_delay")) {
+        handle_number(config, lineno, words[0], words[2],
+                      &(currentcontext->failoverdelay), FAILOVER_MAXDELAY);
+      } else if (!strcmp(words[0], "pool_refill")) {
+        handle_refill(config, lineno, words[2]);
       } else if (!strcmp(words[0], "local")) {
         handle_local(config, lineno, words[2]);
+      } else if (!strcmp(words[0], "reaches_file")) {
+        handle_file(config, lineno, words[2], 0);
+      } else if (!strcmp(words[0], "local_file")) {
+        handle_file(config, lineno, words[2], 1);
       } else {
         show_msg(MSGERR,
                  "Invalid pair type (%s) specified "
@@ -211,16 +852,14 @@ static int handle_path(struct parsedfile *config, int lineno, int nowords,
   } else {
     /* Open up a new serverent, put it on the list   */
     /* then set the current context                  */
-    if ((newserver = (struct serverent *)malloc(sizeof(struct serverent))) ==
-        NULL)
-      exit(-1);
+    newserver = arena_alloc(&(config->arena.servers), sizeof(*newserver),
+                            ARENA_ALIGN);
 
     /* Initialize the structure */
     show_msg(MSGDEBUG,
              "New server structure from line %d in configuration file going "
              "to 0x%08x\n",
              lineno, newserver);
-    memset(newserver, 0x0, sizeof(*newserver));
     newserver->next = config->paths;
     newserver->lineno = lineno;
     config->paths = newserver;
@@ -252,7 +891,7 @@ static int handle_endpath(struct parsedfile *config, int lineno, int nowords,
 
 static int handle_reaches(struct parsedfile *config, int lineno, char *value) {
   int rc;
-  struct netent *ent;
+  struct netent ent, *newent;
 
   rc = make_netent(value, &ent);
   switch (rc) {
@@ -282,11 +921,11 @@ static int handle_reaches(struct parsedfile *config, int lineno, char *value) {
     return (0);
     break;
   case 4:
-    show_msg(MSGERR, "IP (%s) & ", inet_ntoa(ent->localip));
+    show_msg(MSGERR, "IP (%s) & ", inet_ntoa(ent.localip));
     show_msg(MSGERR,
              "SUBNET (%s) != IP on line %d in "
              "configuration file, ignored\n",
-             inet_ntoa(ent->localnet), lineno);
+             inet_ntoa(ent.localnet), lineno);
     return (0);
     break;
   case 5:
@@ -316,34 +955,31 @@ static int handle_reaches(struct parsedfile *config, int lineno, char *value) {
   }
 
   /* The entry is valid so add it to linked list */
-  ent->next = currentcontext->reachnets;
-  currentcontext->reachnets = ent;
+  newent = arena_netent(config, &ent);
+  newent->next = currentcontext->reachnets;
+  currentcontext->reachnets = newent;
 
   return (0);
 }
 
 static int handle_server(struct parsedfile *config, int lineno, char *value) {
-  char *ip;
+  char *ip, *list;
 
   ip = strsplit(NULL, &value, " ");
 
   /* We don't verify this ip/hostname at this stage, */
   /* its resolved immediately before use in tsocks.c */
   if (currentcontext->address == NULL)
-    currentcontext->address = strdup(ip);
+    currentcontext->address = arena_strdup(config, ip);
+  else if (currentcontext->failover == NULL)
+    currentcontext->failover = arena_strdup(config, ip);
   else {
-    if (currentcontext == &(config->defaultserver))
-      show_msg(MSGERR,
-               "Only one default SOCKS server "
-               "may be specified at line %d in "
-               "configuration file\n",
-               lineno);
-    else
-      show_msg(MSGERR,
-               "Only one SOCKS server may be specified "
-               "per path on line %d in configuration "
-               "file. (Path begins on line %d)\n",
-               lineno, currentcontext->lineno);
+    /* Servers after the first are tried in the order given if */
+    /* the ones before them are slow or down                   */
+    list = arena_alloc(&(config->arena.strings),
+                       strlen(currentcontext->failover) + strlen(ip) + 2, 1);
+    sprintf(list, "%s %s", currentcontext->failover, ip);
+    currentcontext->failover = list;
   }
 
   return (0);
@@ -397,7 +1033,7 @@ static int handle_defuser(struct parsedfile *config, int lineno, char *value) {
                "file. (Path begins on line %d)\n",
                lineno, currentcontext->lineno);
   } else {
-    currentcontext->defuser = strdup(value);
+    currentcontext->defuser = arena_strdup(config, value);
   }
 
   return (0);
@@ -419,12 +1055,68 @@ static int handle_defpass(struct parsedfile *config, int lineno, char *value) {
                "file. (Path begins on line %d)\n",
                lineno, currentcontext->lineno);
   } else {
-    currentcontext->defpass = strdup(value);
+    currentcontext->defpass = arena_strdup(config, value);
   }
 
   return (0);
 }
 
+/* Turn a per path option on or off, the value must be yes or no */
+static int handle_option(struct parsedfile *config, int lineno, char *name,
+                         char *value, int flag) {
+
+  if (!strcmp(value, "yes"))
+    currentcontext->flags |= flag;
+  else if (!strcmp(value, "no"))
+    currentcontext->flags &= ~flag;
+  else
+    show_msg(MSGERR,
+             "Invalid value (%s) for %s on line %d in "
+             "configuration file, only yes or no may be "
+             "specified\n",
+             value, name, lineno);
+
+  return (0);
+}
+
+/* Set a per path number, which must be between 0 and max */
+static int handle_number(struct parsedfile *config, int lineno, char *name,
+                         char *value, int *number, int max) {
+  char *end;
+  long n;
+
+  errno = 0;
+  n = strtol(value, &end, 10);
+  if ((errno != 0) || (*end != '\0') || (n < 0) || (n > max))
+    show_msg(MSGERR,
+             "Invalid value (%s) for %s on line %d in "
+             "configuration file, it must be a number from "
+             "0 to %d\n",
+             value, name, lineno, max);
+  else
+    *number = n;
+
+  return (0);
+}
+
+/* Choose whether pooled sockets that expire are replaced ('always') */
+/* or only those taken by connections ('used')                        */
+static int handle_refill(struct parsedfile *config, int lineno, char *value) {
+
+  if (!strcmp(value, "always"))
+    currentcontext->flags |= SERVER_POOLALWAYS;
+  else if (!strcmp(value, "used"))
+    currentcontext->flags &= ~SERVER_POOLALWAYS;
+  else
+    show_msg(MSGERR,
+             "Invalid value (%s) for pool_refill on line %d in "
+             "configuration file, only always or used may be "
+             "specified\n",
+             value, lineno);
+
+  return (0);
+}
+
 static int handle_type(struct parsedfile *config, int lineno, char *value) {
 
   if (currentcontext->type != 0) {
@@ -460,7 +1152,7 @@ static int handle_type(struct parsedfile *config, int lineno, char *value) {
 
 static int handle_local(struct parsedfile *config, int lineno, char *value) {
   int rc;
-  struct netent *ent;
+  struct netent ent, *newent;
 
   if (currentcontext != &(config->defaultserver)) {
     show_msg(MSGERR,
@@ -498,11 +1190,11 @@ static int handle_local(struct parsedfile *config, int lineno, char *value) {
     return (0);
     break;
   case 4:
-    show_msg(MSGERR, "IP (%s) & ", inet_ntoa(ent->localip));
+    show_msg(MSGERR, "IP (%s) & ", inet_ntoa(ent.localip));
     show_msg(MSGERR,
              "SUBNET (%s) != IP on line %d in "
              "configuration file, ignored\n",
-             inet_ntoa(ent->localnet), lineno);
+             inet_ntoa(ent.localnet), lineno);
     return (0);
   case 5:
   case 6:
@@ -516,7 +1208,7 @@ static int handle_local(struct parsedfile *config, int lineno, char *value) {
     break;
   }
 
-  if (ent->startport || ent->endport) {
+  if (ent.startport || ent.endport) {
     show_msg(MSGERR,
              "Port specification is "
              "not allowed in local network specification "
@@ -526,15 +1218,51 @@ static int handle_local(struct parsedfile *config, int lineno, char *value) {
   }
 
   /* The entry is valid so add it to linked list */
-  ent->next = config->localnets;
-  (config->localnets) = ent;
+  newent = arena_netent(config, &ent);
+  newent->next = config->localnets;
+  (config->localnets) = newent;
+
+  return (0);
+}
+
+/* Handle reaches_file (in a path) and local_file (outside paths) */
+/* directives. The files are only named here, the routing index    */
+/* reads them the first time they're needed                        */
+static int handle_file(struct parsedfile *config, int lineno, char *value,
+                       int local) {
+  struct fileent *file, **list;
+
+  if (local && (currentcontext != &(config->defaultserver))) {
+    show_msg(MSGERR,
+             "Local network files cannot be specified in path "
+             "block at line %d in configuration file. "
+             "(Path block started at line %d)\n",
+             lineno, currentcontext->lineno);
+    return (0);
+  } else if (!local && (currentcontext == &(config->defaultserver))) {
+    show_msg(MSGERR,
+             "Reaches files can only be specified in a path "
+             "block, line %d in configuration file\n",
+             lineno);
+    return (0);
+  }
+
+  file = arena_alloc(&(config->arena.nets), sizeof(*file), ARENA_ALIGN);
+  file->lineno = lineno;
+  file->filename = arena_strdup(config, value);
+
+  /* Keep the files in the order they were given */
+  list = (local ? &(config->localfiles) : &(currentcontext->reachfiles));
+  while (*list != NULL)
+    list = &((*list)->next);
+  *list = file;
 
   return (0);
 }
 
 /* Construct a netent given a string like                             */
 /* "198.126.0.1[:portno[-portno]]/255.255.255.0"                      */
-int make_netent(char *value, struct netent **ent) {
+static int make_netent(char *value, struct netent *ent) {
   char *ip;
   char *subnet;
   char *startport = NULL;
@@ -565,127 +1293,76 @@ int make_netent(char *value, struct netent **ent) {
     return (1);
   }
 
-  /* Allocate the new entry */
-  if ((*ent = (struct netent *)malloc(sizeof(struct netent))) == NULL) {
-    /* If we couldn't malloc some storage, leave */
-    exit(1);
-  }
-
-  show_msg(MSGDEBUG, "New network entry for %s/%s going to 0x%08x\n", ip,
-           subnet, *ent);
+  /* The entry is filled in on the caller's stack and only moved */
+  /* into the configuration's arena if it turns out to be valid   */
+  memset(ent, 0x0, sizeof(*ent));
 
   if (!startport)
-    (*ent)->startport = 0;
+    ent->startport = 0;
   if (!endport)
-    (*ent)->endport = 0;
+    ent->endport = 0;
 
 #ifdef HAVE_INET_ADDR
-  if (((*ent)->localip.s_addr = inet_addr(ip)) == -1) {
+  if ((ent->localip.s_addr = inet_addr(ip)) == -1) {
 #elif defined(HAVE_INET_ATON)
-  if (!(inet_aton(ip, &((*ent)->localip)))) {
+  if (!(inet_aton(ip, &(ent->localip)))) {
 #endif
     /* Badly constructed IP */
-    free(*ent);
     return (2);
   }
 #ifdef HAVE_INET_ADDR
-  else if (((*ent)->localnet.s_addr = inet_addr(subnet)) == -1) {
+  else if ((ent->localnet.s_addr = inet_addr(subnet)) == -1) {
 #elif defined(HAVE_INET_ATON)
-  else if (!(inet_aton(subnet, &((*ent)->localnet)))) {
+  else if (!(inet_aton(subnet, &(ent->localnet)))) {
 #endif
     /* Badly constructed subnet */
-    free(*ent);
     return (3);
-  } else if (((*ent)->localip.s_addr & (*ent)->localnet.s_addr) !=
-             (*ent)->localip.s_addr) {
+  } else if ((ent->localip.s_addr & ent->localnet.s_addr) !=
+             ent->localip.s_addr) {
     /* Subnet and Ip != Ip */
-    free(*ent);
     return (4);
   } else if (startport &&
-             (!((*ent)->startport = strtol(startport, &badchar, 10)) ||
-              (*badchar != 0) || ((*ent)->startport > 65535))) {
+             (!(ent->startport = strtol(startport, &badchar, 10)) ||
+              (*badchar != 0) || (ent->startport > 65535))) {
     /* Bad start port */
-    free(*ent);
     return (5);
-  } else if (endport && (!((*ent)->endport = strtol(endport, &badchar, 10)) ||
-                         (*badchar != 0) || ((*ent)->endport > 65535))) {
+  } else if (endport && (!(ent->endport = strtol(endport, &badchar, 10)) ||
+                         (*badchar != 0) || (ent->endport > 65535))) {
     /* Bad end port */
-    free(*ent);
     return (6);
-  } else if (((*ent)->startport > (*ent)->endport) &&
+  } else if ((ent->startport > ent->endport) &&
              !(startport && !endport)) {
     /* End port is less than start port */
-    free(*ent);
     return (7);
   }
 
   if (startport && !endport)
-    (*ent)->endport = (*ent)->startport;
+    ent->endport = ent->startport;
 
   return (0);
 }
 
+/* Any network reachable via a path isn't local, even if it is also */
+/* listed as a local network                                        */
 int is_local(struct parsedfile *config, struct in_addr *testip,
              unsigned int port) {
-  struct netent *ent;
-  struct serverent *sent;
-
-  for (sent = (config->paths); sent != NULL; sent = sent->next) {
-    ent = sent->reachnets;
-    while (ent != NULL) {
-      if ((testip->s_addr & ent->localnet.s_addr) ==
-              (ent->localip.s_addr & ent->localnet.s_addr) &&
-          (!port || !ent->startport ||
-           ((ent->startport <= port) && (ent->endport >= port)))) {
-        return 1;
-      }
 
-      ent = ent->next;
-    }
-  }
-
-  for (ent = (config->localnets); ent != NULL; ent = ent->next) {
-    if ((testip->s_addr & ent->localnet.s_addr) ==
-        (ent->localip.s_addr & ent->localnet.s_addr)) {
-      return (0);
-    }
-  }
-
-  return (1);
+  return (route_lookup(config->index, testip, port, !port, NULL, NULL) !=
+          ROUTE_LOCAL);
 }
 
 /* Find the appropriate server to reach an ip */
 int pick_server(struct parsedfile *config, struct serverent **ent,
                 struct in_addr *ip, unsigned int port) {
-  struct netent *net;
-  char ipbuf[64];
+  uint32_t path;
 
   show_msg(MSGDEBUG, "Picking appropriate server for %s\n", inet_ntoa(*ip));
-  *ent = (config->paths);
-  while (*ent != NULL) {
-    /* Go through all the servers looking for one */
-    /* with a path to this network                */
-    show_msg(MSGDEBUG, "Checking SOCKS server %s\n",
-             ((*ent)->address ? (*ent)->address : "(No Address)"));
-    net = (*ent)->reachnets;
-    while (net != NULL) {
-      strcpy(ipbuf, inet_ntoa(net->localip));
-      show_msg(MSGDEBUG, "Server can reach %s/%s\n", ipbuf,
-               inet_ntoa(net->localnet));
-      if (((ip->s_addr & net->localnet.s_addr) ==
-           (net->localip.s_addr & net->localnet.s_addr)) &&
-          (!net->startport ||
-           ((net->startport <= port) && (net->endport >= port)))) {
-        show_msg(MSGDEBUG, "This server can reach target\n");
-        /* Found the net, return */
-        return (0);
-      }
-      net = net->next;
-    }
-    (*ent) = (*ent)->next;
-  }
-
-  *ent = &(config->defaultserver);
+  if (route_lookup(config->index, ip, port, 0, &path, NULL) == ROUTE_PATH) {
+    *ent = config->index->paths[path];
+    show_msg(MSGDEBUG, "Path from line %d can reach target\n",
+             (*ent)->lineno);
+  } else
+    *ent = &(config->defaultserver);
 
   return (0);
 }
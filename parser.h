@@ -5,20 +5,46 @@
 
 #define _PARSER_H 1
 
+#include <stdint.h>
+#include <sys/types.h>
+
 /* Structure definitions */
 
 /* Structure representing one server specified in the config */
 struct serverent {
-  int lineno;               /* Line number in conf file this path started on */
-  char *address;            /* Address/hostname of server */
-  int port;                 /* Port number of server */
-  int type;                 /* Type of server (4/5) */
-  char *defuser;            /* Default username for this socks server */
-  char *defpass;            /* Default password for this socks server */
-  struct netent *reachnets; /* Linked list of nets from this server */
-  struct serverent *next;   /* Pointer to next server entry */
+  int lineno;                 /* Line number in conf file this path started on */
+  char *address;              /* Address/hostname of server */
+  int port;                   /* Port number of server */
+  int type;                   /* Type of server (4/5) */
+  char *defuser;              /* Default username for this socks server */
+  char *defpass;              /* Default password for this socks server */
+  int flags;                  /* SERVER_ options turned on for the path */
+  int poolsize;               /* Idle connections to keep to the server */
+  int poolidle;               /* Seconds they're kept, 0 for POOL_IDLE */
+  char *failover;             /* Further servers, separated by spaces */
+  int failoverdelay;          /* Milliseconds before the next is tried, */
+                              /* 0 for FAILOVER_DELAY                   */
+  struct netent *reachnets;   /* Linked list of nets from this server */
+  struct fileent *reachfiles; /* Linked list of prefix files of nets */
+  struct serverent *next;     /* Pointer to next server entry */
 };
 
+/* Options turned on per path with "<option> = yes" */
+#define SERVER_PIPELINE (1 << 0) /* Send the SOCKS V5 requests in one go */
+#define SERVER_FASTOPEN (1 << 1) /* Send the first request in the SYN */
+#define SERVER_OPTIMISTIC (1 << 2) /* Don't wait for the connect reply */
+#define SERVER_POOLALWAYS (1 << 3) /* Replace pooled sockets that expire */
+#define SERVER_BROKER (1 << 4) /* Ask the tsocksd broker for connections */
+
+/* Limits on the pool of idle connections kept for a path */
+#define POOL_MAX 64  /* Most sockets in one pool */
+#define POOL_IDLE 60 /* Default seconds a socket is kept */
+
+/* Milliseconds a path's server is given before its next server is */
+/* tried as well, unless failover_delay says otherwise             */
+#define FAILOVER_DELAY 250
+#define FAILOVER_MAXDELAY 60000
+
 /* Structure representing a network */
 struct netent {
   struct in_addr localip;  /* Base IP of the network */
@@ -28,18 +54,123 @@ struct netent {
   struct netent *next;     /* Pointer to next network entry */
 };
 
+/* Structure representing one block of storage in a configuration's */
+/* arena, the storage itself follows the header                      */
+struct arenachunk {
+  struct arenachunk *next; /* Previous (smaller) chunk in the pool */
+  size_t used;             /* Bytes handed out so far */
+  size_t size;             /* Bytes of storage in the chunk */
+};
+
+/* Structure holding all the storage for one parsed file. Serverents, */
+/* netents and strings each come from their own pool so that entries  */
+/* of the same kind sit next to each other, and the whole thing is    */
+/* released by freeing a handful of chunks                            */
+struct configarena {
+  struct arenachunk *servers;
+  struct arenachunk *nets;
+  struct arenachunk *strings;
+};
+
+/* Structure representing a file of prefixes named in the config */
+struct fileent {
+  int lineno;           /* Line number of the directive */
+  char *filename;       /* Name of the prefix file */
+  struct fileent *next; /* Pointer to next file entry */
+};
+
 /* Structure representing a complete parsed file */
 struct parsedfile {
   struct netent *localnets;
+  struct fileent *localfiles;
   struct serverent defaultserver;
   struct serverent *paths;
+  struct routeindex *index; /* Compiled index of the networks above */
+  void *image;              /* Mapped config image (if loaded from one) */
+  size_t imagesize;         /* Size of the mapping */
+  struct configarena arena; /* Storage for everything above */
+  int refcount;             /* References held by libtsocks, the */
+                            /* current config holds one and each */
+                            /* request proxied under it another  */
+  unsigned int generation;  /* Counts the configurations libtsocks */
+                            /* has loaded, for its route cache      */
+};
+
+/* Compiled configuration images are written next to the text file */
+/* with this suffix (e.g /etc/tsocks.conf.img) by validateconf      */
+#define IMAGE_SUFFIX ".img"
+#define IMAGE_MAGIC "TSOCKSIM"
+#define IMAGE_VERSION 6
+#define IMAGE_BYTEORDER 0x01020304
+#define IMAGE_NOSTRING 0xffffffffU
+
+/* tsocksrun passes the image it compiled to the programs it runs */
+/* as a memfd whose descriptor number is in this variable         */
+#define IMAGE_FD_ENV "TSOCKS_CONF_FD"
+
+/* Structure at the start of a compiled configuration image, all */
+/* other sections are found by their offset from the start of    */
+/* the image so it can be mapped anywhere                        */
+struct imageheader {
+  char magic[8];       /* IMAGE_MAGIC */
+  uint32_t version;    /* IMAGE_VERSION */
+  uint32_t byteorder;  /* IMAGE_BYTEORDER in the writer's byte order */
+  uint32_t size;       /* Total size of the image */
+  uint32_t srcmtime;   /* Modification time of the text file, */
+  uint32_t srcmtimens; /* its nanoseconds and its size, if any */
+  uint32_t srcsize;    /* differ the image is stale and the     */
+                       /* text file is used                     */
+  uint32_t npaths;     /* Number of paths (the default server */
+                       /* follows them in the server table)   */
+  uint32_t nrules;
+  uint32_t nnodes;
+  uint32_t nents;
+  uint32_t nirreg;
+  uint32_t nfiles;
+  uint32_t servers;    /* Offsets of the sections */
+  uint32_t nodes;
+  uint32_t ents;
+  uint32_t irreg;
+  uint32_t files;
+  uint32_t strings;
+  uint32_t stringsize;
+};
+
+/* Structure representing one server in a configuration image */
+struct imageserver {
+  uint32_t lineno;
+  uint32_t port;
+  uint32_t type;
+  uint32_t address; /* Offsets into the string section, or */
+  uint32_t defuser; /* IMAGE_NOSTRING                       */
+  uint32_t defpass;
+  uint32_t flags;
+  uint32_t poolsize;
+  uint32_t poolidle;
+  uint32_t failover; /* Offset into the string section too */
+  uint32_t failoverdelay;
+};
+
+/* Structure representing one prefix file in a configuration image, */
+/* only the name is stored, the file is read when it's first needed  */
+struct imagefile {
+  uint32_t path;     /* Path number, or ROUTE_NONE for local_file */
+  uint32_t filename; /* Offset into the string section */
 };
 
 /* Functions provided by parser module */
 int read_config(char *, struct parsedfile *);
+int load_config(char *, struct parsedfile *);
+int load_config_fd(int, char *, struct parsedfile *);
+int write_config_image(char *, char *, struct parsedfile *);
+int write_config_memfd(char *, struct parsedfile *);
+void free_config(struct parsedfile *);
 int is_local(struct parsedfile *, struct in_addr *, unsigned int port);
 int pick_server(struct parsedfile *, struct serverent **, struct in_addr *,
                 unsigned int port);
+int classify_batch(struct parsedfile *, struct in_addr *, unsigned int *ports,
+                   int count, int anyport, int *verdicts, uint32_t *paths,
+                   uint32_t *rules);
 char *strsplit(char *separator, char **text, const char *search);
 
 #endif
@@ -0,0 +1,688 @@
+/*
+
+   route.c    - Compiled routing index for the networks in tsocks.conf
+
+*/
+
+#include <arpa/inet.h>
+#include <config.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "parser.h"
+#include "route.h"
+#include "classify.h"
+#include "common.h"
+
+/* Structure used to collect path entries while the trie is built, */
+/* they're sorted by node and moved into the index once we're done */
+struct pendingent {
+  uint32_t node;
+  struct routeent ent;
+};
+
+/* Structure holding the state of an index under construction */
+struct builder {
+  struct routeindex *index;
+  uint32_t nodespace;
+  uint32_t irregspace;
+  uint32_t filespace;
+  struct pendingent *pending;
+  uint32_t npending;
+  uint32_t pendingspace;
+};
+
+#define PORTMATCH(ent, port, anyport)                                          \
+  ((anyport) || !(ent)->startport ||                                           \
+   (((ent)->startport <= (port)) && ((ent)->endport >= (port))))
+
+static void *grow_array(void *array, uint32_t *space, uint32_t used,
+                        size_t size);
+static uint32_t prefix_mask(uint32_t plen);
+static int prefix_length(uint32_t mask, uint32_t *plen);
+static uint32_t common_bits(uint32_t a, uint32_t b);
+static uint32_t new_node(struct builder *b, uint32_t prefix, uint32_t plen);
+static uint32_t insert_prefix(struct builder *b, uint32_t prefix,
+                              uint32_t plen);
+static void add_rule(struct builder *b, struct netent *net, uint32_t path,
+                     uint32_t rule);
+static int compare_pending(const void *, const void *);
+static int compare_irreg(const void *, const void *);
+static void add_file(struct builder *b, struct fileent *file, uint32_t path);
+static int trie_lookup(struct routeindex *index, uint32_t ip,
+                       unsigned int port, int anyport, uint32_t *path,
+                       uint32_t *rule);
+static int prefix_match(struct prefixfile *file, uint32_t ip);
+static void load_prefixfile(struct prefixfile *file);
+static const char *parse_quad(const char *p, const char *end, uint32_t *addr);
+static int parse_prefix(const char *p, const char *end, uint32_t *net,
+                        uint32_t *mask);
+static int compare_ranges(const void *, const void *);
+
+/* Build the routing index for a parsed configuration. Each path's    */
+/* reaches statements and the local networks are placed into a path   */
+/* compressed binary trie keyed on the network prefix, so a lookup    */
+/* visits at most 33 nodes however many rules the configuration has   */
+struct routeindex *build_route_index(struct parsedfile *config) {
+  struct builder b;
+  struct routeindex *index;
+  struct serverent *server;
+  struct netent *net;
+  struct fileent *file;
+  uint32_t path, rule, i;
+
+  memset(&b, 0x0, sizeof(b));
+  if ((index = calloc(1, sizeof(*index))) == NULL)
+    exit(1);
+  b.index = index;
+
+  /* Number the paths and rules so they can be referred to compactly */
+  for (server = config->paths; server != NULL; server = server->next) {
+    index->npaths++;
+    for (net = server->reachnets; net != NULL; net = net->next)
+      index->nrules++;
+  }
+  for (net = config->localnets; net != NULL; net = net->next)
+    index->nrules++;
+
+  if (((index->paths = malloc((index->npaths + 1) * sizeof(*index->paths))) ==
+       NULL) ||
+      ((index->rules = malloc((index->nrules + 1) * sizeof(*index->rules))) ==
+       NULL))
+    exit(1);
+
+  /* The root always exists and matches every address */
+  new_node(&b, 0, 0);
+
+  path = 0;
+  rule = 0;
+  for (server = config->paths; server != NULL; server = server->next) {
+    index->paths[path] = server;
+    for (net = server->reachnets; net != NULL; net = net->next) {
+      index->rules[rule] = net;
+      add_rule(&b, net, path, rule);
+      rule++;
+    }
+    path++;
+  }
+  for (net = config->localnets; net != NULL; net = net->next) {
+    index->rules[rule] = net;
+    add_rule(&b, net, ROUTE_NONE, rule);
+    rule++;
+  }
+
+  /* Prefix files are only named here, they're read when first needed */
+  path = 0;
+  for (server = config->paths; server != NULL; server = server->next) {
+    for (file = server->reachfiles; file != NULL; file = file->next)
+      add_file(&b, file, path);
+    path++;
+  }
+  for (file = config->localfiles; file != NULL; file = file->next)
+    add_file(&b, file, ROUTE_NONE);
+
+  /* Now gather the path entries for each node together, lowest */
+  /* numbered path first so lookups can stop at the first match  */
+  qsort(b.pending, b.npending, sizeof(*b.pending), compare_pending);
+  if ((index->ents = malloc((b.npending + 1) * sizeof(*index->ents))) == NULL)
+    exit(1);
+  for (i = 0; i < b.npending; i++) {
+    if ((i == 0) || (b.pending[i].node != b.pending[i - 1].node))
+      index->nodes[b.pending[i].node].firstent = i;
+    index->nodes[b.pending[i].node].nents++;
+    index->ents[i] = b.pending[i].ent;
+  }
+  index->nents = b.npending;
+  free(b.pending);
+
+  qsort(index->irreg, index->nirreg, sizeof(*index->irreg), compare_irreg);
+
+  show_msg(MSGDEBUG,
+           "Built routing index with %d nodes for %d rules "
+           "(%d with irregular netmasks) and %d prefix files on %d paths\n",
+           index->nnodes, index->nrules, index->nirreg, index->nfiles,
+           index->npaths);
+
+  return (index);
+}
+
+void free_route_index(struct routeindex *index) {
+  uint32_t i;
+
+  /* Compiled in indexes are static */
+  if ((index == NULL) || (index->compiled != NULL))
+    return;
+
+  for (i = 0; i < index->nfiles; i++)
+    free(index->files[i].ranges);
+  free(index->files);
+
+  if (!index->mapped) {
+    free(index->nodes);
+    free(index->ents);
+    free(index->irreg);
+  }
+  free_classifier(index->classifier);
+  free(index->paths);
+  free(index->rules);
+  free(index);
+}
+
+/* Classify an address and port. Returns ROUTE_PATH (and sets *path   */
+/* to the lowest numbered path with a matching reaches statement),     */
+/* ROUTE_LOCAL if no path matches but a local network does, otherwise  */
+/* ROUTE_DEFAULT. If anyport is set port ranges are treated as always  */
+/* matching. *rule is set to the rule responsible for the verdict, or */
+/* ROUTE_NORULE for ROUTE_DEFAULT                                      */
+int route_lookup(struct routeindex *index, struct in_addr *addr,
+                 unsigned int port, int anyport, uint32_t *path,
+                 uint32_t *rule) {
+  uint32_t bestpath = ROUTE_NONE;
+  uint32_t bestrule = 0;
+  int verdict;
+
+  if (index->compiled)
+    verdict = index->compiled(addr, port, anyport, &bestpath, &bestrule);
+  else
+    verdict = trie_lookup(index, ntohl(addr->s_addr), port, anyport,
+                          &bestpath, &bestrule);
+
+  if (index->nfiles)
+    verdict = route_files(index, ntohl(addr->s_addr), verdict, &bestpath,
+                          &bestrule);
+
+  if ((verdict == ROUTE_PATH) && path)
+    *path = bestpath;
+  if (rule)
+    *rule = (verdict == ROUTE_DEFAULT ? ROUTE_NORULE : bestrule);
+
+  return (verdict);
+}
+
+/* Refine the verdict for an address (ip in host byte order) from the */
+/* inline rules with the prefix files. A path's reaches_file beats    */
+/* the reaches of every later path, but inline local networks are     */
+/* never overridden by a file, so connections to local networks don't */
+/* cause any file to be read. local_file is consulted last, and only  */
+/* if nothing else matched. *path and *rule are updated to match      */
+int route_files(struct routeindex *index, uint32_t ip, int verdict,
+                uint32_t *path, uint32_t *rule) {
+  struct prefixfile *file;
+  uint32_t limit, i;
+
+  if (verdict == ROUTE_LOCAL)
+    return (verdict);
+
+  limit = (verdict == ROUTE_PATH ? *path : ROUTE_NONE);
+  for (i = 0; i < index->nfiles; i++) {
+    file = &(index->files[i]);
+    if (file->path >= limit)
+      break;
+    if (prefix_match(file, ip)) {
+      *path = file->path;
+      *rule = index->nrules + i;
+      return (ROUTE_PATH);
+    }
+  }
+
+  if (verdict == ROUTE_PATH)
+    return (verdict);
+
+  for (; i < index->nfiles; i++) {
+    file = &(index->files[i]);
+    if ((file->path == ROUTE_NONE) && prefix_match(file, ip)) {
+      *rule = index->nrules + i;
+      return (ROUTE_LOCAL);
+    }
+  }
+
+  return (verdict);
+}
+
+/* Look an address (in host byte order) up in the trie and irregular */
+/* networks, see route_lookup()                                      */
+static int trie_lookup(struct routeindex *index, uint32_t ip,
+                       unsigned int port, int anyport, uint32_t *path,
+                       uint32_t *rule) {
+  uint32_t best = ROUTE_NONE;
+  uint32_t bestrule = 0;
+  uint32_t local = 0;
+  uint32_t child, i;
+  struct routenode *node;
+  struct routeent *ent, *end;
+  struct routeirreg *irreg;
+
+  node = index->nodes;
+  for (;;) {
+    if ((ip ^ node->prefix) & prefix_mask(node->plen))
+      break;
+
+    if (!local)
+      local = node->local;
+
+    /* Entries are sorted by path so the first match is the best */
+    end = &(index->ents[node->firstent + node->nents]);
+    for (ent = &(index->ents[node->firstent]);
+         (ent < end) && (ent->path < best); ent++) {
+      if (PORTMATCH(ent, port, anyport)) {
+        best = ent->path;
+        bestrule = ent->rule;
+        break;
+      }
+    }
+
+    if (node->plen == 32)
+      break;
+    if ((child = node->child[(ip >> (31 - node->plen)) & 1]) == 0)
+      break;
+    node = &(index->nodes[child]);
+  }
+
+  for (i = 0; i < index->nirreg; i++) {
+    irreg = &(index->irreg[i]);
+    if ((irreg->ent.path >= best) && (local || (best != ROUTE_NONE)))
+      break;
+    if ((ip & irreg->mask) != irreg->net)
+      continue;
+    if (irreg->ent.path == ROUTE_NONE) {
+      if (!local)
+        local = irreg->ent.rule + 1;
+    } else if (PORTMATCH(&(irreg->ent), port, anyport)) {
+      best = irreg->ent.path;
+      bestrule = irreg->ent.rule;
+    }
+  }
+
+  if (best != ROUTE_NONE) {
+    *path = best;
+    *rule = bestrule;
+    return (ROUTE_PATH);
+  } else if (local) {
+    *rule = local - 1;
+    return (ROUTE_LOCAL);
+  }
+
+  return (ROUTE_DEFAULT);
+}
+
+/* Make sure there is room for one more element in a growable array */
+static void *grow_array(void *array, uint32_t *space, uint32_t used,
+                        size_t size) {
+
+  if (used < *space)
+    return (array);
+
+  *space = (*space ? *space * 2 : 64);
+  if ((array = realloc(array, *space * size)) == NULL) {
+    /* If we couldn't malloc some storage, leave */
+    exit(1);
+  }
+
+  return (array);
+}
+
+static uint32_t prefix_mask(uint32_t plen) {
+  return (plen ? (0xffffffffU << (32 - plen)) : 0);
+}
+
+/* Work out the prefix length of a netmask, returns 0 if the mask */
+/* isn't made up of contiguous leading ones                       */
+static int prefix_length(uint32_t mask, uint32_t *plen) {
+
+  if ((mask | (mask - 1)) != 0xffffffffU)
+    return (0);
+
+  for (*plen = 0; (*plen < 32) && (mask & (1U << (31 - *plen))); (*plen)++)
+    /* Empty Loop */;
+
+  return (1);
+}
+
+/* Count the leading bits two addresses have in common */
+static uint32_t common_bits(uint32_t a, uint32_t b) {
+  uint32_t diff = a ^ b;
+  uint32_t n;
+
+  for (n = 0; (n < 32) && !(diff & (1U << (31 - n))); n++)
+    /* Empty Loop */;
+
+  return (n);
+}
+
+static uint32_t new_node(struct builder *b, uint32_t prefix, uint32_t plen) {
+  struct routeindex *index = b->index;
+  struct routenode *node;
+
+  index->nodes = grow_array(index->nodes, &(b->nodespace), index->nnodes,
+                            sizeof(*index->nodes));
+  node = &(index->nodes[index->nnodes]);
+  memset(node, 0x0, sizeof(*node));
+  node->prefix = prefix;
+  node->plen = plen;
+
+  return (index->nnodes++);
+}
+
+/* Find the node for a prefix, creating it (and splitting any    */
+/* compressed edge it falls in the middle of) if it doesn't exist */
+static uint32_t insert_prefix(struct builder *b, uint32_t prefix,
+                              uint32_t plen) {
+  uint32_t node = 0, child, bit, common, mid;
+  struct routenode *nodes;
+
+  for (;;) {
+    nodes = b->index->nodes;
+    if (nodes[node].plen == plen)
+      return (node);
+
+    bit = (prefix >> (31 - nodes[node].plen)) & 1;
+    if ((child = nodes[node].child[bit]) == 0) {
+      child = new_node(b, prefix, plen);
+      b->index->nodes[node].child[bit] = child;
+      return (child);
+    }
+
+    /* See how much of the child's prefix we share */
+    common = common_bits(nodes[child].prefix, prefix);
+    if (common > nodes[child].plen)
+      common = nodes[child].plen;
+    if (common > plen)
+      common = plen;
+
+    if (common == nodes[child].plen) {
+      node = child;
+      continue;
+    }
+
+    /* We diverge part way along the edge to the child, so put */
+    /* a new node in at the point where we part ways           */
+    mid = new_node(b, prefix & prefix_mask(common), common);
+    nodes = b->index->nodes;
+    nodes[mid].child[(nodes[child].prefix >> (31 - common)) & 1] = child;
+    nodes[node].child[bit] = mid;
+    if (common == plen)
+      return (mid);
+    node = mid;
+  }
+}
+
+static void add_rule(struct builder *b, struct netent *net, uint32_t path,
+                     uint32_t rule) {
+  struct routeindex *index = b->index;
+  struct routeirreg *irreg;
+  struct pendingent *pending;
+  uint32_t mask, plen, node;
+
+  mask = ntohl(net->localnet.s_addr);
+
+  if (!prefix_length(mask, &plen)) {
+    index->irreg = grow_array(index->irreg, &(b->irregspace), index->nirreg,
+                              sizeof(*index->irreg));
+    irreg = &(index->irreg[index->nirreg++]);
+    irreg->net = ntohl(net->localip.s_addr) & mask;
+    irreg->mask = mask;
+    irreg->ent.path = path;
+    irreg->ent.rule = rule;
+    irreg->ent.startport = net->startport;
+    irreg->ent.endport = net->endport;
+    return;
+  }
+
+  node = insert_prefix(b, ntohl(net->localip.s_addr) & mask, plen);
+
+  if (path == ROUTE_NONE) {
+    if (!index->nodes[node].local)
+      index->nodes[node].local = rule + 1;
+    return;
+  }
+
+  b->pending = grow_array(b->pending, &(b->pendingspace), b->npending,
+                          sizeof(*b->pending));
+  pending = &(b->pending[b->npending++]);
+  pending->node = node;
+  pending->ent.path = path;
+  pending->ent.rule = rule;
+  pending->ent.startport = net->startport;
+  pending->ent.endport = net->endport;
+}
+
+static int compare_pending(const void *a, const void *b) {
+  const struct pendingent *pa = a, *pb = b;
+
+  if (pa->node != pb->node)
+    return ((pa->node < pb->node) ? -1 : 1);
+  if (pa->ent.path != pb->ent.path)
+    return ((pa->ent.path < pb->ent.path) ? -1 : 1);
+  if (pa->ent.rule != pb->ent.rule)
+    return ((pa->ent.rule < pb->ent.rule) ? -1 : 1);
+
+  return (0);
+}
+
+static int compare_irreg(const void *a, const void *b) {
+  const struct routeirreg *ia = a, *ib = b;
+
+  if (ia->ent.path != ib->ent.path)
+    return ((ia->ent.path < ib->ent.path) ? -1 : 1);
+  if (ia->ent.rule != ib->ent.rule)
+    return ((ia->ent.rule < ib->ent.rule) ? -1 : 1);
+
+  return (0);
+}
+
+static void add_file(struct builder *b, struct fileent *fileent,
+                     uint32_t path) {
+  struct routeindex *index = b->index;
+  struct prefixfile *file;
+
+  index->files = grow_array(index->files, &(b->filespace), index->nfiles,
+                            sizeof(*index->files));
+  file = &(index->files[index->nfiles++]);
+  memset(file, 0x0, sizeof(*file));
+  file->filename = fileent->filename;
+  file->path = path;
+  file->state = PREFIXFILE_UNLOADED;
+}
+
+/* See if an address (in host byte order) is in a prefix file, reading */
+/* the file if this is the first time it has been needed               */
+static int prefix_match(struct prefixfile *file, uint32_t ip) {
+  uint32_t lo, hi, mid;
+  int state;
+
+  /* The first thread to need the file reads it, any others wait */
+  state = __atomic_load_n(&(file->state), __ATOMIC_ACQUIRE);
+  if (state == PREFIXFILE_UNLOADED) {
+    if (__atomic_compare_exchange_n(&(file->state), &state,
+                                    PREFIXFILE_LOADING, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_ACQUIRE))
+      load_prefixfile(file);
+  }
+  while (__atomic_load_n(&(file->state), __ATOMIC_ACQUIRE) ==
+         PREFIXFILE_LOADING)
+    sched_yield();
+
+  /* Find the last range starting at or below the address */
+  lo = 0;
+  hi = file->nranges;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (file->ranges[mid].start <= ip)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return ((lo > 0) && (ip <= file->ranges[lo - 1].end));
+}
+
+/* Read a prefix file. Each line holds one network as a.b.c.d/bits,  */
+/* a.b.c.d/netmask or a lone address, and '#' starts a comment. The  */
+/* file is mapped and parsed in place, then the ranges are sorted    */
+/* and merged so lookups are a binary search. A file which can't be  */
+/* read is treated as empty                                          */
+static void load_prefixfile(struct prefixfile *file) {
+  struct prefixrange *ranges = NULL;
+  uint32_t nranges = 0, space = 0, lineno = 1, bad = 0, net, mask, i, merged;
+  const char *map, *p, *end, *line;
+  struct stat st;
+  int fd;
+
+  if ((fd = open(file->filename, O_RDONLY)) == -1) {
+    show_msg(MSGERR, "Could not open prefix file %s, ignoring it\n",
+             file->filename);
+    __atomic_store_n(&(file->state), PREFIXFILE_FAILED, __ATOMIC_RELEASE);
+    return;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    __atomic_store_n(&(file->state), PREFIXFILE_FAILED, __ATOMIC_RELEASE);
+    return;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    __atomic_store_n(&(file->state), PREFIXFILE_LOADED, __ATOMIC_RELEASE);
+    return;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    show_msg(MSGERR, "Could not map prefix file %s, ignoring it\n",
+             file->filename);
+    __atomic_store_n(&(file->state), PREFIXFILE_FAILED, __ATOMIC_RELEASE);
+    return;
+  }
+
+  for (p = map, end = map + st.st_size; p < end; p++, lineno++) {
+    line = p;
+    while ((p < end) && (*p != '\n'))
+      p++;
+
+    switch (parse_prefix(line, p, &net, &mask)) {
+    case 0:
+      ranges = grow_array(ranges, &space, nranges, sizeof(*ranges));
+      ranges[nranges].start = net;
+      ranges[nranges].end = net | ~mask;
+      nranges++;
+      break;
+    case 1:
+      /* Blank or comment */
+      break;
+    default:
+      if (bad++ < 10)
+        show_msg(MSGERR,
+                 "Invalid network on line %d of prefix file %s, "
+                 "ignored\n",
+                 lineno, file->filename);
+      break;
+    }
+  }
+  munmap((void *)map, st.st_size);
+
+  /* Sort the ranges then merge any which overlap or touch */
+  qsort(ranges, nranges, sizeof(*ranges), compare_ranges);
+  for (i = 0, merged = 0; i < nranges; i++) {
+    if (merged && ((ranges[i].start <= ranges[merged - 1].end) ||
+                   (ranges[i].start - 1 == ranges[merged - 1].end))) {
+      if (ranges[i].end > ranges[merged - 1].end)
+        ranges[merged - 1].end = ranges[i].end;
+    } else
+      ranges[merged++] = ranges[i];
+  }
+  file->nranges = merged;
+  file->ranges = ranges;
+  __atomic_store_n(&(file->state), PREFIXFILE_LOADED, __ATOMIC_RELEASE);
+
+  show_msg(MSGDEBUG,
+           "Loaded %d networks (%d ranges) from prefix file %s, "
+           "%d lines were invalid\n",
+           nranges, file->nranges, file->filename, bad);
+}
+
+/* Parse a dotted quad, returning a pointer past it or NULL */
+static const char *parse_quad(const char *p, const char *end,
+                              uint32_t *addr) {
+  uint32_t octet, digits, i;
+
+  *addr = 0;
+  for (i = 0; i < 4; i++) {
+    if (i) {
+      if ((p == end) || (*p != '.'))
+        return (NULL);
+      p++;
+    }
+    for (octet = 0, digits = 0; (p < end) && (*p >= '0') && (*p <= '9');
+         p++, digits++)
+      octet = octet * 10 + (*p - '0');
+    if ((digits == 0) || (digits > 3) || (octet > 255))
+      return (NULL);
+    *addr = (*addr << 8) | octet;
+  }
+
+  return (p);
+}
+
+/* Parse one line of a prefix file (p up to end), returning 0 with the */
+/* network and mask in host byte order, 1 for a blank line or comment  */
+/* and 2 if the line isn't valid                                       */
+static int parse_prefix(const char *p, const char *end, uint32_t *net,
+                        uint32_t *mask) {
+  const char *q;
+  uint32_t bits;
+
+  while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+    p++;
+  if ((p == end) || (*p == '#'))
+    return (1);
+
+  if ((p = parse_quad(p, end, net)) == NULL)
+    return (2);
+
+  *mask = 0xffffffffU;
+  if ((p < end) && (*p == '/')) {
+    p++;
+    for (q = p; (q < end) && (*q >= '0') && (*q <= '9'); q++)
+      /* Empty Loop */;
+    if ((q < end) && (*q == '.')) {
+      if (((p = parse_quad(p, end, mask)) == NULL) ||
+          ((*mask | (*mask - 1)) != 0xffffffffU))
+        return (2);
+    } else {
+      if ((q == p) || (q - p > 2))
+        return (2);
+      for (bits = 0; p < q; p++)
+        bits = bits * 10 + (*p - '0');
+      if (bits > 32)
+        return (2);
+      *mask = prefix_mask(bits);
+    }
+  }
+
+  /* Only blanks or a comment may follow the network */
+  while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+    p++;
+  if ((p < end) && (*p != '#'))
+    return (2);
+
+  /* The network must not have host bits set, as with reaches */
+  if (*net & ~*mask)
+    return (2);
+
+  return (0);
+}
+
+static int compare_ranges(const void *a, const void *b) {
+  const struct prefixrange *ra = a, *rb = b;
+
+  if (ra->start != rb->start)
+    return ((ra->start < rb->start) ? -1 : 1);
+
+  return (0);
+}
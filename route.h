@@ -0,0 +1,109 @@
+/* route.h - Structures and functions for the compiled routing index */
+/* used to classify destinations against tsocks.conf                 */
+
+#ifndef _ROUTE_H
+
+#define _ROUTE_H 1
+
+#include <stdint.h>
+
+/* Verdicts returned by route_lookup() */
+#define ROUTE_LOCAL 0   /* Destination is on a local network */
+#define ROUTE_PATH 1    /* Destination is reached via a path */
+#define ROUTE_DEFAULT 2 /* Destination needs the default server */
+
+/* Path number which sorts after every real path */
+#define ROUTE_NONE 0xffffffffU
+
+/* Rule number reported for ROUTE_DEFAULT, no rule decided it */
+#define ROUTE_NORULE 0xffffffffU
+
+/* Structure representing one node of the path compressed binary trie, */
+/* all addresses in the index are in host byte order                   */
+struct routenode {
+  uint32_t prefix;   /* Network prefix this node represents */
+  uint32_t plen;     /* Number of significant bits in prefix */
+  uint32_t child[2]; /* Subtrees for the next bit (0 = none) */
+  uint32_t firstent; /* First path entry for exactly this prefix */
+  uint32_t nents;    /* Number of path entries for this prefix */
+  uint32_t local;    /* Rule number + 1 of a local network with this */
+                     /* prefix, or 0 if there isn't one              */
+};
+
+/* Structure representing one reaches statement attached to a node */
+struct routeent {
+  uint32_t path;      /* Number of the path (position in paths list) */
+  uint32_t rule;      /* Rule number of the netent */
+  uint32_t startport; /* Range of ports for the network, */
+  uint32_t endport;   /* startport is 0 for any port     */
+};
+
+/* Structure representing a network whose netmask isn't a contiguous */
+/* prefix, these can't live in the trie and are checked one by one   */
+struct routeirreg {
+  uint32_t net;
+  uint32_t mask;
+  struct routeent ent; /* ent.path is ROUTE_NONE for local networks */
+};
+
+/* Structure representing one range of addresses from a prefix file */
+struct prefixrange {
+  uint32_t start;
+  uint32_t end;
+};
+
+/* States of a prefix file */
+#define PREFIXFILE_UNLOADED 0
+#define PREFIXFILE_LOADED 1
+#define PREFIXFILE_FAILED 2
+#define PREFIXFILE_LOADING 3 /* Another thread is reading it */
+
+/* Structure representing a file of prefixes named by a reaches_file */
+/* or local_file directive. The file isn't read until the first time */
+/* a lookup needs it                                                 */
+struct prefixfile {
+  char *filename;
+  uint32_t path;              /* Path number, ROUTE_NONE for local_file */
+  int state;                  /* PREFIXFILE_UNLOADED, _LOADED, _FAILED */
+                              /* or _LOADING, changed atomically     */
+  uint32_t nranges;
+  struct prefixrange *ranges; /* Sorted, with overlaps merged */
+};
+
+/* Structure representing a complete compiled index */
+struct routeindex {
+  uint32_t nnodes;
+  uint32_t nents;
+  uint32_t nirreg;
+  uint32_t npaths;
+  uint32_t nrules;
+  struct routenode *nodes;  /* nodes[0] is always the root */
+  struct routeent *ents;    /* Entries sorted by node then path */
+  struct routeirreg *irreg; /* Irregular networks, sorted by path */
+  struct serverent **paths; /* Path number to serverent */
+  struct netent **rules;    /* Rule number to netent (NULL if mapped) */
+  uint32_t nfiles;
+  struct prefixfile *files; /* Prefix files in path order, local_file */
+                            /* last. File i reports rule nrules + i   */
+  int mapped;               /* Nodes, ents and irreg live in a mapped */
+                            /* configuration image                    */
+  int (*compiled)(struct in_addr *, unsigned int, int, uint32_t *,
+                  uint32_t *); /* Matcher generated from the config   */
+                               /* (libtsocks-static only), if set the */
+                               /* index has no nodes of its own       */
+  struct classifier *classifier; /* Flattened rules for classify_batch(), */
+                                 /* built the first time it's needed      */
+};
+
+/* Functions provided by route module */
+struct routeindex *build_route_index(struct parsedfile *);
+void free_route_index(struct routeindex *);
+int route_lookup(struct routeindex *, struct in_addr *, unsigned int port,
+                 int anyport, uint32_t *path, uint32_t *rule);
+int route_files(struct routeindex *, uint32_t ip, int verdict, uint32_t *path,
+                uint32_t *rule);
+
+/* Functions provided by configurations compiled to C by validateconf */
+int load_static_config(struct parsedfile *);
+
+#endif
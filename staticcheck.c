@@ -0,0 +1,148 @@
+/*
+
+    STATICCHECK - Part of the tsocks package
+                  This utility checks that the matcher generated by
+                  validateconf for libtsocks-static gives the same
+                  answers as the interpreted configuration file
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Global configuration variables */
+char *progname = "staticcheck"; /* Name for error msgs      */
+
+/* Header Files */
+#include <arpa/inet.h>
+#include <common.h>
+#include <config.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "parser.h"
+#include "route.h"
+
+int check_address(struct parsedfile *, struct parsedfile *, uint32_t,
+                  unsigned int);
+
+int main(int argc, char *argv[]) {
+  char *usage = "Usage: <conf file> [samples]";
+  struct parsedfile interpreted, compiled;
+  struct routeindex *index;
+  struct routenode *node;
+  struct routeent *ent;
+  unsigned long samples = 1000000, i;
+  int failures = 0;
+  uint32_t n, j, ip, span;
+
+  if ((argc < 2) || (argc > 3)) {
+    show_msg(MSGERR, "Invalid number of arguments\n");
+    show_msg(MSGERR, "%s\n", usage);
+    exit(1);
+  }
+  if (argc == 3)
+    samples = strtoul(argv[2], NULL, 10);
+
+  if (read_config(argv[1], &interpreted) != 0)
+    exit(1);
+  load_static_config(&compiled);
+
+  index = interpreted.index;
+  if ((index->npaths != compiled.index->npaths) ||
+      (index->nrules != compiled.index->nrules) ||
+      (index->nfiles != compiled.index->nfiles)) {
+    show_msg(MSGERR,
+             "Compiled configuration does not match %s, "
+             "regenerate it with validateconf -g\n",
+             argv[1]);
+    exit(1);
+  }
+
+  /* First the edges of every prefix and port range, they are where */
+  /* a broken matcher is most likely to go wrong                    */
+  for (n = 0; n < index->nnodes; n++) {
+    node = &(index->nodes[n]);
+    span = (node->plen ? (0xffffffffU >> node->plen) : 0xffffffffU);
+    for (j = 0; j <= node->nents; j++) {
+      ent = (j < node->nents ? &(index->ents[node->firstent + j]) : NULL);
+      ip = node->prefix;
+      failures += check_address(&interpreted, &compiled, ip - 1, 0);
+      failures += check_address(&interpreted, &compiled, ip, 0);
+      failures += check_address(&interpreted, &compiled, ip + span, 0);
+      failures += check_address(&interpreted, &compiled, ip + span + 1, 0);
+      if (ent && ent->startport) {
+        failures +=
+            check_address(&interpreted, &compiled, ip, ent->startport - 1);
+        failures += check_address(&interpreted, &compiled, ip, ent->startport);
+        failures += check_address(&interpreted, &compiled, ip, ent->endport);
+        failures +=
+            check_address(&interpreted, &compiled, ip, ent->endport + 1);
+      }
+    }
+  }
+
+  /* Then a large random sample, half spread over the whole address */
+  /* space and half inside the configured networks                   */
+  srand(samples);
+  for (i = 0; i < samples; i++) {
+    ip = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    if (i & 1) {
+      node = &(index->nodes[rand() % index->nnodes]);
+      span = (node->plen ? (0xffffffffU >> node->plen) : 0xffffffffU);
+      ip = node->prefix | (ip & span);
+    }
+    failures += check_address(&interpreted, &compiled, ip, rand() % 65536);
+  }
+
+  if (failures) {
+    show_msg(MSGERR, "%d addresses classified differently by the compiled "
+                     "configuration\n",
+             failures);
+    exit(1);
+  }
+
+  printf("Compiled configuration matches %s\n", argv[1]);
+
+  return (0);
+}
+
+/* Classify one address with both configurations, returns 1 if they */
+/* disagree                                                          */
+int check_address(struct parsedfile *interpreted, struct parsedfile *compiled,
+                  uint32_t ip, unsigned int port) {
+  struct in_addr addr;
+  uint32_t ipath = 0, irule = 0, cpath = 0, crule = 0;
+  int iverdict, cverdict, anyport;
+
+  addr.s_addr = htonl(ip);
+  for (anyport = 0; anyport < 2; anyport++) {
+    iverdict = route_lookup(interpreted->index, &addr, port, anyport, &ipath,
+                            &irule);
+    cverdict = route_lookup(compiled->index, &addr, port, anyport, &cpath,
+                            &crule);
+    if ((iverdict != cverdict) || (ipath != cpath) || (irule != crule)) {
+      show_msg(MSGERR,
+               "Mismatch for %s port %u: interpreted %d (path %u rule %u), "
+               "compiled %d (path %u rule %u)\n",
+               inet_ntoa(addr), port, iverdict, ipath, irule, cverdict,
+               cpath, crule);
+      return (1);
+    }
+  }
+
+  return (0);
+}
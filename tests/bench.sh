@@ -0,0 +1,45 @@
+#!/bin/sh
+# Run the benchmarks under tsocks against stub SOCKS servers. The poll()
+# benchmark needs negotiations that never finish, so its stub waits ten
+# minutes before each reply, the stress test's stub doesn't wait at all.
+# Usage: bench.sh /path/to/libtsocks.so
+
+LIB=$1
+DELAY=600000
+DURATION=3
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/tsocksbench.XXXXXX` || exit 1
+set -- `tests/socksstub -d $DELAY` `tests/socksstub`
+if [ -z "$4" ]; then
+  [ -n "$1" ] && kill $1
+  rm -rf $DIR
+  exit 1
+fi
+STUBS="$1 $3"
+trap 'kill $STUBS; rm -rf $DIR' 0
+
+cat > $DIR/tsocks.conf <<EOF
+local = 127.0.0.0/255.0.0.0
+server = 127.0.0.1
+server_port = $2
+server_type = 5
+EOF
+sed "s/^server_port = .*/server_port = $4/" $DIR/tsocks.conf > \
+  $DIR/stress.conf
+
+echo "poll() without tsocks"
+tests/pollbench || exit 1
+for requests in 16 256 1024; do
+  echo "poll() under tsocks with $requests negotiations under way"
+  TSOCKS_CONF_FILE=$DIR/tsocks.conf LD_PRELOAD=$LIB \
+    tests/pollbench $requests || exit 1
+done
+
+echo "Connections through tsocks from more and more threads"
+for threads in 1 2 4 8 16 32; do
+  TSOCKS_CONF_FILE=$DIR/stress.conf LD_PRELOAD=$LIB \
+    tests/stress $threads $DURATION || exit 1
+done
+echo "The same, reloading the configuration while they run"
+TSOCKS_CONF_FILE=$DIR/stress.conf LD_PRELOAD=$LIB \
+  tests/stress -r $DIR/stress.conf 32 $DURATION || exit 1
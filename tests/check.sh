@@ -0,0 +1,76 @@
+#!/bin/sh
+# Run the checks under tsocks against a stub SOCKS server which waits
+# before each reply, so every connection takes the path where the
+# library has to wait for the server. They're run with the plain
+# configuration, again with each path option that changes how
+# connections are made, and with a dead server to fail over from. Then
+# run the stress test from many threads against a stub which doesn't
+# wait, reloading the configuration under them.
+# Usage: check.sh /path/to/libtsocks.so
+
+LIB=$1
+DELAY=50
+THREADS=16
+DURATION=3
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/tsockscheck.XXXXXX` || exit 1
+set -- `tests/socksstub -d $DELAY` `tests/socksstub`
+if [ -z "$4" ]; then
+  [ -n "$1" ] && kill $1
+  rm -rf $DIR
+  exit 1
+fi
+STUBS="$1 $3"
+trap 'kill $STUBS; rm -rf $DIR' 0
+
+cat > $DIR/tsocks.conf <<EOF
+local = 127.0.0.0/255.0.0.0
+server = 127.0.0.1
+server_port = $2
+server_type = 5
+EOF
+sed "s/^server_port = .*/server_port = $4/" $DIR/tsocks.conf > \
+  $DIR/stress.conf
+echo "server = 127.0.0.2" | cat - $DIR/tsocks.conf > $DIR/failover.conf
+
+# Run every way of waiting against the outcomes given, with the
+# configuration named plus the lines given in the option. The options
+# outcome is a made connection which must keep the socket options set
+# before connecting
+run_checks() {
+  echo "$2" | tr '|' '\n' | cat $DIR/$1 - > $DIR/check.conf
+  echo "Checking $1 with ${2:-nothing added}"
+  shift 2
+  for mode in blocking select poll epoll epollet epollfirst; do
+    for outcome in "$@"; do
+      case $outcome in
+      options) args="-o $mode made" ;;
+      *) args="$mode $outcome" ;;
+      esac
+      TSOCKS_CONF_FILE=$DIR/check.conf TSOCKS_DEBUG_FILE=$DIR/tsocks.log \
+        LD_PRELOAD=$LIB tests/checkconnect $args || failed=1
+    done
+  done
+}
+
+failed=0
+run_checks tsocks.conf "" made refused reset options
+# Pooled connections take over the application's socket
+run_checks tsocks.conf "pool = 4" made refused reset options
+run_checks tsocks.conf "pipeline = yes" made refused reset options
+run_checks tsocks.conf "fastopen = yes" made refused reset options
+# Optimistic connections are made before the server replies, a refusal
+# is only seen by the first read
+run_checks tsocks.conf "optimistic = yes" made readreset
+# Nothing listens on the first server, every connection fails over to
+# the second on a socket of its own
+run_checks failover.conf "" made refused reset options
+
+TSOCKS_CONF_FILE=$DIR/stress.conf TSOCKS_DEBUG_FILE=$DIR/tsocks.log \
+  LD_PRELOAD=$LIB tests/stress -r $DIR/stress.conf $THREADS $DURATION ||
+  failed=1
+
+if [ $failed -ne 0 ] && [ -f $DIR/tsocks.log ]; then
+  cat $DIR/tsocks.log
+fi
+exit $failed
@@ -0,0 +1,392 @@
+/*
+
+    CHECKCONNECT - Part of the tsocks package
+                   Makes connections through socksstub under tsocks
+                   and checks they end the way they should, waiting for
+                   them the way a program would with a blocking
+                   connect(), select(), poll() or epoll. Like nginx,
+                   epollfirst registers sockets before connecting them.
+                   On optimistic paths a refused connection is made,
+                   and the refusal is the first read's ECONNRESET.
+                   With -o socket options are set before connecting,
+                   and a made connection must still have them
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Header Files */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "stubports.h"
+
+#define MAXCHECKS 64
+#define CHECK_TIMEOUT 10 /* Seconds before a check is given up on */
+#define CHECK_KEEPIDLE 123 /* Keepalive idle time set with -o       */
+
+/* Ways of waiting for a connection */
+#define WAIT_BLOCKING 0
+#define WAIT_SELECT 1
+#define WAIT_POLL 2
+#define WAIT_EPOLL 3
+#define WAIT_EPOLLET 4
+#define WAIT_EPOLLFIRST 5
+
+/* Structure representing one connection being checked, err is */
+/* EINPROGRESS until it's settled, then 0 if it was made        */
+struct check {
+  int sockid;
+  int err;
+};
+
+/* Global configuration variables */
+static char *modes[] = {"blocking", "select",     "poll", "epoll",
+                        "epollet",  "epollfirst", NULL};
+static char *outcomes[] = {"made", "refused", "reset", "readreset", NULL};
+static int outcomeports[] = {STUB_ECHOPORT, STUB_REFUSEPORT, STUB_RESETPORT,
+                             STUB_REFUSEPORT};
+static struct sockaddr_in dest;
+static int setoptions = 0;
+
+/* Private Function Prototypes */
+static void usage(char *progname);
+static int lookup(char **names, char *name);
+static void start_check(struct check *check, int n, int mode, int epfd);
+static void watch_check(struct check *check, int n, int mode, int epfd);
+static int connect_status(struct check *check);
+static int wait_checks(struct check *checks, int count, int mode, int epfd);
+static int ready_sockets(struct check *checks, int count, int mode, int epfd,
+                         int *ready);
+static int finish_check(struct check *check, int outcome, int n);
+static int finish_readreset(struct check *check, int n);
+static void set_options(int sockid);
+static int check_options(struct check *check, int n);
+
+int main(int argc, char *argv[]) {
+  struct check checks[MAXCHECKS];
+  int mode, outcome, count = 4, failed = 0, epfd = -1, opt, i;
+
+  while ((opt = getopt(argc, argv, "o")) != -1) {
+    switch (opt) {
+    case 'o':
+      setoptions = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if ((argc < 3) || (argc > 4) || ((mode = lookup(modes, argv[1])) == -1) ||
+      ((outcome = lookup(outcomes, argv[2])) == -1))
+    usage(argv[0]);
+  if ((argc == 4) && (((count = atoi(argv[3])) < 1) || (count > MAXCHECKS)))
+    usage(argv[0]);
+
+  /* A check that hangs fails */
+  alarm(CHECK_TIMEOUT);
+
+  memset(&dest, 0x0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(outcomeports[outcome]);
+  inet_aton(STUB_DESTINATION, &(dest.sin_addr));
+
+  if ((mode >= WAIT_EPOLL) && ((epfd = epoll_create(MAXCHECKS)) == -1)) {
+    perror("epoll_create");
+    exit(2);
+  }
+
+  /* Blocking connections are made one at a time, the others are */
+  /* all started then waited for together                        */
+  for (i = 0; i < count; i++) {
+    start_check(&(checks[i]), i, mode, epfd);
+    if (mode == WAIT_BLOCKING)
+      failed |= finish_check(&(checks[i]), outcome, i);
+  }
+  if (mode != WAIT_BLOCKING) {
+    failed |= wait_checks(checks, count, mode, epfd);
+    for (i = 0; i < count; i++)
+      failed |= finish_check(&(checks[i]), outcome, i);
+  }
+
+  printf("%-10s %-9s %s\n", modes[mode], outcomes[outcome],
+         (failed ? "FAILED" : "ok"));
+
+  return (failed);
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+          "Usage: %s [-o] blocking|select|poll|epoll|epollet|epollfirst "
+          "made|refused|reset|readreset [connections]\n",
+          progname);
+  exit(2);
+}
+
+static int lookup(char **names, char *name) {
+  int i;
+
+  for (i = 0; names[i]; i++) {
+    if (!strcmp(names[i], name))
+      return (i);
+  }
+
+  return (-1);
+}
+
+static void start_check(struct check *check, int n, int mode, int epfd) {
+  if ((check->sockid = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    exit(2);
+  }
+  if (setoptions)
+    set_options(check->sockid);
+  if (mode != WAIT_BLOCKING)
+    fcntl(check->sockid, F_SETFL, O_NONBLOCK);
+  if (mode == WAIT_EPOLLFIRST)
+    watch_check(check, n, mode, epfd);
+
+  if (connect(check->sockid, (struct sockaddr *)&dest, sizeof(dest)) == 0)
+    check->err = 0;
+  else
+    check->err = errno;
+
+  if ((mode == WAIT_EPOLL) || (mode == WAIT_EPOLLET))
+    watch_check(check, n, mode, epfd);
+}
+
+static void watch_check(struct check *check, int n, int mode, int epfd) {
+  struct epoll_event event;
+
+  event.events = EPOLLOUT | (mode == WAIT_EPOLLET ? EPOLLET : 0);
+  event.data.u32 = n;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, check->sockid, &event) != 0) {
+    perror("epoll_ctl");
+    exit(2);
+  }
+}
+
+/* Ask about a non blocking connection in progress by connecting again */
+static int connect_status(struct check *check) {
+  if ((connect(check->sockid, (struct sockaddr *)&dest, sizeof(dest)) ==
+       0) ||
+      (errno == EISCONN))
+    return (0);
+  if (errno == EALREADY)
+    return (EINPROGRESS);
+
+  return (errno);
+}
+
+/* Wait for every connection to settle. The socket must only be    */
+/* reported writable once it has, tsocks keeps the negotiation with */
+/* the SOCKS server to itself                                      */
+static int wait_checks(struct check *checks, int count, int mode, int epfd) {
+  int ready[MAXCHECKS];
+  int pending, nready, i;
+
+  for (;;) {
+    for (pending = 0, i = 0; i < count; i++)
+      pending += (checks[i].err == EINPROGRESS);
+    if (!pending)
+      break;
+
+    nready = ready_sockets(checks, count, mode, epfd, ready);
+    for (i = 0; i < nready; i++) {
+      if (checks[ready[i]].err != EINPROGRESS)
+        continue;
+      if ((checks[ready[i]].err = connect_status(&(checks[ready[i]]))) ==
+          EINPROGRESS) {
+        printf("Connection %d was reported ready while still being made\n",
+               ready[i]);
+        return (1);
+      }
+    }
+  }
+
+  return (0);
+}
+
+/* Wait for some of the connections still being made to be writable, */
+/* filling in which and returning how many                           */
+static int ready_sockets(struct check *checks, int count, int mode, int epfd,
+                         int *ready) {
+  struct epoll_event events[MAXCHECKS];
+  struct pollfd ufds[MAXCHECKS];
+  fd_set writefds;
+  int nready = 0, maxfd = -1, i, rc;
+
+  switch (mode) {
+  case WAIT_SELECT:
+    FD_ZERO(&writefds);
+    for (i = 0; i < count; i++) {
+      if (checks[i].err == EINPROGRESS) {
+        FD_SET(checks[i].sockid, &writefds);
+        if (checks[i].sockid > maxfd)
+          maxfd = checks[i].sockid;
+      }
+    }
+    if ((rc = select(maxfd + 1, NULL, &writefds, NULL, NULL)) == -1)
+      break;
+    for (i = 0; i < count; i++) {
+      if ((checks[i].err == EINPROGRESS) &&
+          FD_ISSET(checks[i].sockid, &writefds))
+        ready[nready++] = i;
+    }
+    break;
+  case WAIT_POLL:
+    for (i = 0; i < count; i++) {
+      ufds[i].fd = (checks[i].err == EINPROGRESS ? checks[i].sockid : -1);
+      ufds[i].events = POLLOUT;
+      ufds[i].revents = 0;
+    }
+    if ((rc = poll(ufds, count, -1)) == -1)
+      break;
+    for (i = 0; i < count; i++) {
+      if (ufds[i].revents)
+        ready[nready++] = i;
+    }
+    break;
+  default:
+    if ((rc = epoll_wait(epfd, events, MAXCHECKS, -1)) == -1)
+      break;
+    for (i = 0; i < rc; i++)
+      ready[nready++] = events[i].data.u32;
+    break;
+  }
+
+  if ((rc == -1) && (errno != EINTR)) {
+    perror(modes[mode]);
+    exit(2);
+  }
+
+  return (nready);
+}
+
+/* Check a settled connection ended as it should, a made one must */
+/* echo what's sent on it and a readreset one must fail the first */
+/* read with ECONNRESET                                           */
+static int finish_check(struct check *check, int outcome, int n) {
+  char sent[32], received[32];
+  int expected, len, got = 0, rc;
+
+  if (outcome == 3)
+    return (finish_readreset(check, n));
+
+  expected = (outcome == 0 ? 0 : (outcome == 1 ? ECONNREFUSED : ECONNRESET));
+  if (check->err != expected) {
+    printf("Connection %d ended with \"%s\", expected \"%s\"\n", n,
+           (check->err ? strerror(check->err) : "made"),
+           (expected ? strerror(expected) : "made"));
+    close(check->sockid);
+    return (1);
+  }
+
+  if ((expected == 0) && setoptions && check_options(check, n)) {
+    close(check->sockid);
+    return (1);
+  }
+
+  if (expected == 0) {
+    fcntl(check->sockid, F_SETFL, 0);
+    len = sprintf(sent, "check %d on %d", n, check->sockid);
+    if (send(check->sockid, sent, len, 0) != len) {
+      printf("Could not send on connection %d (%s)\n", n, strerror(errno));
+      close(check->sockid);
+      return (1);
+    }
+    while ((got < len) &&
+           ((rc = recv(check->sockid, received + got, len - got, 0)) > 0))
+      got += rc;
+    if ((got != len) || memcmp(sent, received, len)) {
+      printf("Connection %d didn't echo what was sent on it\n", n);
+      close(check->sockid);
+      return (1);
+    }
+  }
+
+  close(check->sockid);
+
+  return (0);
+}
+
+static int finish_readreset(struct check *check, int n) {
+  char buf[32];
+  int rc;
+
+  if (check->err) {
+    printf("Connection %d ended with \"%s\", expected \"made\"\n", n,
+           strerror(check->err));
+    close(check->sockid);
+    return (1);
+  }
+
+  fcntl(check->sockid, F_SETFL, 0);
+  rc = recv(check->sockid, buf, sizeof(buf), 0);
+  close(check->sockid);
+  if ((rc != -1) || (errno != ECONNRESET)) {
+    printf("Connection %d's first read returned %d (%s), expected "
+           "\"%s\"\n",
+           n, rc, (rc == -1 ? strerror(errno) : "no error"),
+           strerror(ECONNRESET));
+    return (1);
+  }
+
+  return (0);
+}
+
+/* Set options a program might, none of them the kernel's default */
+static void set_options(int sockid) {
+  int on = 1, idle = CHECK_KEEPIDLE;
+
+  if (setsockopt(sockid, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) ||
+      setsockopt(sockid, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) ||
+      setsockopt(sockid, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle))) {
+    perror("setsockopt");
+    exit(2);
+  }
+}
+
+/* Check a made connection still has the options set before connecting */
+static int check_options(struct check *check, int n) {
+  socklen_t len = sizeof(int);
+  int nodelay = 0, keepalive = 0, idle = 0;
+
+  getsockopt(check->sockid, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+  len = sizeof(int);
+  getsockopt(check->sockid, SOL_SOCKET, SO_KEEPALIVE, &keepalive, &len);
+  len = sizeof(int);
+  getsockopt(check->sockid, IPPROTO_TCP, TCP_KEEPIDLE, &idle, &len);
+  if (!nodelay || !keepalive || (idle != CHECK_KEEPIDLE)) {
+    printf("Connection %d lost its options, TCP_NODELAY %d, SO_KEEPALIVE "
+           "%d, TCP_KEEPIDLE %d\n",
+           n, nodelay, keepalive, idle);
+    return (1);
+  }
+
+  return (0);
+}
@@ -0,0 +1,155 @@
+/*
+
+    POLLBENCH - Part of the tsocks package
+                Times poll() under tsocks on more and more fds while
+                some SOCKS negotiations are still under way. The stub
+                server has to be slow enough that none of them finish,
+                the time spent on each fd should then stay flat as the
+                number of fds grows
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Header Files */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "stubports.h"
+
+#define MAXREQUESTS 1024
+#define ROUNDS 4000000 /* Fds polled at each size, however many there are */
+
+/* Global configuration variables */
+static int sizes[] = {256, 1024, 4096, 16384, 20000, 0};
+static int sockets[MAXREQUESTS];
+
+/* Private Function Prototypes */
+static void usage(char *progname);
+static void start_requests(int count);
+static double time_poll(struct pollfd *ufds, int nfds);
+
+int main(int argc, char *argv[]) {
+  struct pollfd *ufds;
+  int requests = 0, quiet[2], busy[2], nfds, i, j;
+  double ns;
+
+  if ((argc > 2) ||
+      ((argc == 2) && (((requests = atoi(argv[1])) < 0) ||
+                       (requests > MAXREQUESTS))))
+    usage(argv[0]);
+
+  /* Every fd but the first and the requests' sockets is a pipe with */
+  /* nothing to read, the first always has something so poll()       */
+  /* returns at once like it does for a busy program                 */
+  if ((pipe(quiet) != 0) || (pipe(busy) != 0) ||
+      (write(busy[1], "x", 1) != 1)) {
+    perror("pipe");
+    exit(2);
+  }
+
+  start_requests(requests);
+
+  /* Sizes too small for the requests' sockets and the busy pipe are */
+  /* passed over                                                     */
+  for (i = 0; (nfds = sizes[i]); i++) {
+    if (nfds <= requests)
+      continue;
+    if ((ufds = calloc(nfds, sizeof(*ufds))) == NULL) {
+      perror("calloc");
+      exit(2);
+    }
+    for (j = 0; j < nfds; j++) {
+      ufds[j].fd = quiet[0];
+      ufds[j].events = POLLIN;
+    }
+    ufds[0].fd = busy[0];
+    for (j = 0; j < requests; j++) {
+      ufds[nfds - 1 - j].fd = sockets[j];
+      ufds[nfds - 1 - j].events = POLLOUT;
+    }
+
+    ns = time_poll(ufds, nfds);
+    printf("%6d fds %5d requests %10.0f ns/call %7.1f ns/fd\n", nfds,
+           requests, ns, ns / nfds);
+    free(ufds);
+  }
+
+  for (i = 0; i < requests; i++)
+    close(sockets[i]);
+
+  return (0);
+}
+
+static void usage(char *progname) {
+  fprintf(stderr, "Usage: %s [requests, at most %d]\n", progname,
+          MAXREQUESTS);
+  exit(2);
+}
+
+/* Start non blocking connections through tsocks, they're left waiting */
+/* for the stub server                                                  */
+static void start_requests(int count) {
+  struct sockaddr_in dest;
+  int i;
+
+  memset(&dest, 0x0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(STUB_ECHOPORT);
+  inet_aton(STUB_DESTINATION, &(dest.sin_addr));
+
+  for (i = 0; i < count; i++) {
+    if ((sockets[i] = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+      perror("socket");
+      exit(2);
+    }
+    fcntl(sockets[i], F_SETFL, O_NONBLOCK);
+    if ((connect(sockets[i], (struct sockaddr *)&dest, sizeof(dest)) ==
+         0) ||
+        (errno != EINPROGRESS)) {
+      printf("Connection %d didn't wait for the SOCKS server\n", i);
+      exit(2);
+    }
+  }
+}
+
+/* Time poll() on the fds without waiting, returning nanoseconds a call */
+static double time_poll(struct pollfd *ufds, int nfds) {
+  struct timespec start, end;
+  int calls = ROUNDS / nfds + 10, i;
+
+  poll(ufds, nfds, 0);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < calls; i++) {
+    if (poll(ufds, nfds, 0) == -1) {
+      perror("poll");
+      exit(2);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (((end.tv_sec - start.tv_sec) * 1e9 +
+           (end.tv_nsec - start.tv_nsec)) /
+          calls);
+}
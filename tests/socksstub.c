@@ -0,0 +1,204 @@
+/*
+
+    SOCKSSTUB - Part of the tsocks package
+                A stub SOCKS 5 server for the checks run by make check.
+                It waits a while before each reply, so the library has
+                to wait for it, and never really connects anywhere: the
+                port asked for says what to do instead
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Header Files */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "stubports.h"
+
+/* Global configuration variables */
+static int delay = 0; /* Milliseconds to wait before each reply */
+
+/* Private Function Prototypes */
+static void usage(char *progname);
+static void *serve_client(void *arg);
+static int read_bytes(int sockid, unsigned char *buf, int len);
+static int write_bytes(int sockid, unsigned char *buf, int len);
+static void pause_reply(void);
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  pthread_attr_t attr;
+  pthread_t thread;
+  int listener, client, one = 1, opt;
+  pid_t pid;
+
+  while ((opt = getopt(argc, argv, "d:")) != -1) {
+    switch (opt) {
+    case 'd':
+      delay = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc)
+    usage(argv[0]);
+
+  /* Listen on any free port, it's printed with our pid once we're */
+  /* ready so the checks never race us                              */
+  memset(&addr, 0x0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1) ||
+      (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) !=
+       0) ||
+      (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+      (listen(listener, 128) != 0) ||
+      (getsockname(listener, (struct sockaddr *)&addr, &len) != 0)) {
+    fprintf(stderr, "socksstub: Could not listen (%s)\n", strerror(errno));
+    exit(1);
+  }
+
+  if ((pid = fork()) == -1) {
+    fprintf(stderr, "socksstub: Could not fork (%s)\n", strerror(errno));
+    exit(1);
+  } else if (pid) {
+    printf("%d %d\n", (int)pid, ntohs(addr.sin_port));
+    exit(0);
+  }
+  fclose(stdout);
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    if ((client = accept(listener, NULL, NULL)) == -1) {
+      if (errno == EINTR)
+        continue;
+      exit(1);
+    }
+    if (pthread_create(&thread, &attr, serve_client,
+                       (void *)(long)client) != 0)
+      close(client);
+  }
+}
+
+static void usage(char *progname) {
+  fprintf(stderr, "Usage: %s [-d delay in milliseconds]\n", progname);
+  exit(1);
+}
+
+/* Negotiate with one client. Once it asks for a connection the port */
+/* decides whether it's refused, reset or made, a made connection     */
+/* echoes everything sent on it                                       */
+static void *serve_client(void *arg) {
+  int sockid = (int)(long)arg;
+  unsigned char buf[512];
+  struct linger linger;
+  int len, port;
+
+  /* Version and methods, we only offer no authentication */
+  if (read_bytes(sockid, buf, 2) || (buf[0] != 5) ||
+      read_bytes(sockid, buf + 2, buf[1]) ||
+      (memchr(buf + 2, 0, buf[1]) == NULL))
+    goto done;
+  pause_reply();
+  buf[0] = 5;
+  buf[1] = 0;
+  if (write_bytes(sockid, buf, 2))
+    goto done;
+
+  /* A connect request for an IPv4 address */
+  if (read_bytes(sockid, buf, 10) || (buf[0] != 5) || (buf[1] != 1) ||
+      (buf[3] != 1))
+    goto done;
+  port = (buf[8] << 8) | buf[9];
+  pause_reply();
+
+  if (port == STUB_RESETPORT) {
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(sockid, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    goto done;
+  }
+
+  memset(buf, 0x0, 10);
+  buf[0] = 5;
+  buf[1] = (port == STUB_REFUSEPORT ? 5 : 0);
+  buf[3] = 1;
+  if (write_bytes(sockid, buf, 10) || (port == STUB_REFUSEPORT))
+    goto done;
+
+  while ((len = recv(sockid, buf, sizeof(buf), 0)) > 0) {
+    if (write_bytes(sockid, buf, len))
+      break;
+  }
+
+done:
+  close(sockid);
+  return (NULL);
+}
+
+static int read_bytes(int sockid, unsigned char *buf, int len) {
+  int rc;
+
+  while (len > 0) {
+    if ((rc = recv(sockid, buf, len, 0)) <= 0) {
+      if ((rc == -1) && (errno == EINTR))
+        continue;
+      return (1);
+    }
+    buf += rc;
+    len -= rc;
+  }
+
+  return (0);
+}
+
+static int write_bytes(int sockid, unsigned char *buf, int len) {
+  int rc;
+
+  while (len > 0) {
+    if ((rc = send(sockid, buf, len, 0)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return (1);
+    }
+    buf += rc;
+    len -= rc;
+  }
+
+  return (0);
+}
+
+static void pause_reply(void) {
+  struct timespec pause;
+
+  pause.tv_sec = delay / 1000;
+  pause.tv_nsec = (delay % 1000) * 1000000L;
+  while ((nanosleep(&pause, &pause) == -1) && (errno == EINTR))
+    ;
+}
@@ -0,0 +1,268 @@
+/*
+
+    STRESS - Part of the tsocks package
+             Makes connections through socksstub under tsocks from many
+             threads at once for a while, half of them blocking and half
+             non blocking waited for with poll(), and checks each echoes
+             what's sent on it. With -r the configuration file is
+             rewritten over and over while they run, so the library
+             reloads it under them. Reports the connections made a
+             second
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Header Files */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "stubports.h"
+
+#define MAXTHREADS 256
+#define MAXCONF 4096
+#define RELOAD_PAUSE 200 /* Milliseconds between rewrites of the file */
+
+/* A network added to and taken out of the configuration by turns, */
+/* nothing the checks connect to is in it                          */
+#define RELOAD_LOCAL "local = 192.168.255.0/255.255.255.0\n"
+
+/* Structure representing one thread making connections */
+struct worker {
+  pthread_t thread;
+  int n;
+  int made;
+  int failed;
+};
+
+/* Global configuration variables */
+static struct sockaddr_in dest;
+static volatile int stopping = 0;
+
+/* Private Function Prototypes */
+static void usage(char *progname);
+static void *run_worker(void *arg);
+static int make_connection(struct worker *worker, int i);
+static int wait_connection(int sockid);
+static int rewrite_config(char *conffile, char *original, int n);
+static void pause_ms(int ms);
+
+int main(int argc, char *argv[]) {
+  struct worker workers[MAXTHREADS];
+  struct timespec start, end;
+  char original[MAXCONF];
+  char *conffile = NULL;
+  int threads, seconds, reloads = 0, made = 0, failed = 0, len = 0, opt, i;
+  double elapsed;
+  FILE *conf;
+
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    switch (opt) {
+    case 'r':
+      conffile = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if ((argc - optind != 2) || ((threads = atoi(argv[optind])) < 1) ||
+      (threads > MAXTHREADS) || ((seconds = atoi(argv[optind + 1])) < 1))
+    usage(argv[0]);
+
+  if (conffile) {
+    if (((conf = fopen(conffile, "r")) == NULL) ||
+        ((len = fread(original, 1, sizeof(original) - 1, conf)) <= 0)) {
+      perror(conffile);
+      exit(2);
+    }
+    original[len] = '\0';
+    fclose(conf);
+  }
+
+  memset(&dest, 0x0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(STUB_ECHOPORT);
+  inet_aton(STUB_DESTINATION, &(dest.sin_addr));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < threads; i++) {
+    memset(&(workers[i]), 0x0, sizeof(workers[i]));
+    workers[i].n = i;
+    if (pthread_create(&(workers[i].thread), NULL, run_worker,
+                       &(workers[i]))) {
+      fprintf(stderr, "Could not start thread %d\n", i);
+      exit(2);
+    }
+  }
+
+  /* Run for the time we were given, rewriting the configuration */
+  /* every RELOAD_PAUSE milliseconds if we were asked to          */
+  for (i = 0; i < seconds * 1000 / RELOAD_PAUSE; i++) {
+    pause_ms(RELOAD_PAUSE);
+    if (conffile && rewrite_config(conffile, original, ++reloads))
+      exit(2);
+  }
+  stopping = 1;
+
+  for (i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    made += workers[i].made;
+    failed += workers[i].failed;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  /* Put the configuration back the way it was */
+  if (conffile && rewrite_config(conffile, original, 0))
+    exit(2);
+
+  printf("%3d threads %7.0f connections/s, %d made, %d failed, "
+         "%d reloads\n",
+         threads, made / elapsed, made, failed, reloads);
+
+  return (failed || !made);
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+          "Usage: %s [-r configuration file] threads seconds\n",
+          progname);
+  exit(2);
+}
+
+/* Make connections one after another until we're told to stop, odd */
+/* threads make them non blocking                                   */
+static void *run_worker(void *arg) {
+  struct worker *worker = arg;
+  int i;
+
+  for (i = 0; !stopping; i++) {
+    if (make_connection(worker, i))
+      worker->failed++;
+    else
+      worker->made++;
+  }
+
+  return (NULL);
+}
+
+/* Make one connection and check it echoes a message of its own */
+static int make_connection(struct worker *worker, int i) {
+  char sent[64], received[64];
+  int sockid, len, got = 0, rc;
+
+  if ((sockid = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    printf("Thread %d could not make a socket (%s)\n", worker->n,
+           strerror(errno));
+    return (1);
+  }
+
+  if (worker->n & 1) {
+    fcntl(sockid, F_SETFL, O_NONBLOCK);
+    if (connect(sockid, (struct sockaddr *)&dest, sizeof(dest)) == 0)
+      rc = 0;
+    else if (errno == EINPROGRESS)
+      rc = wait_connection(sockid);
+    else
+      rc = errno;
+    fcntl(sockid, F_SETFL, 0);
+  } else {
+    rc = (connect(sockid, (struct sockaddr *)&dest, sizeof(dest)) == 0
+              ? 0
+              : errno);
+  }
+  if (rc) {
+    printf("Thread %d connection %d failed (%s)\n", worker->n, i,
+           strerror(rc));
+    close(sockid);
+    return (1);
+  }
+
+  len = sprintf(sent, "thread %d connection %d on %d", worker->n, i, sockid);
+  if (send(sockid, sent, len, 0) != len) {
+    printf("Thread %d could not send on connection %d (%s)\n", worker->n, i,
+           strerror(errno));
+    close(sockid);
+    return (1);
+  }
+  while ((got < len) &&
+         ((rc = recv(sockid, received + got, len - got, 0)) > 0))
+    got += rc;
+  close(sockid);
+  if ((got != len) || memcmp(sent, received, len)) {
+    printf("Thread %d connection %d didn't echo what was sent on it\n",
+           worker->n, i);
+    return (1);
+  }
+
+  return (0);
+}
+
+/* Wait for a non blocking connection to settle, asking how it went */
+/* by connecting again. Returns 0 or the error it ended with        */
+static int wait_connection(int sockid) {
+  struct pollfd ufd;
+
+  for (;;) {
+    ufd.fd = sockid;
+    ufd.events = POLLOUT;
+    ufd.revents = 0;
+    if ((poll(&ufd, 1, -1) == -1) && (errno != EINTR))
+      return (errno);
+    if ((connect(sockid, (struct sockaddr *)&dest, sizeof(dest)) == 0) ||
+        (errno == EISCONN))
+      return (0);
+    if (errno != EALREADY)
+      return (errno);
+  }
+}
+
+/* Write the configuration again, with RELOAD_LOCAL added every other */
+/* time, and move it into place so the library never reads half of it */
+static int rewrite_config(char *conffile, char *original, int n) {
+  char newfile[4096];
+  FILE *conf;
+
+  snprintf(newfile, sizeof(newfile), "%s.new", conffile);
+  if (((conf = fopen(newfile, "w")) == NULL) ||
+      (fputs(original, conf) == EOF) ||
+      ((n & 1) && (fputs(RELOAD_LOCAL, conf) == EOF)) || fclose(conf) ||
+      rename(newfile, conffile)) {
+    perror(newfile);
+    return (1);
+  }
+
+  return (0);
+}
+
+static void pause_ms(int ms) {
+  struct timespec pause;
+
+  pause.tv_sec = ms / 1000;
+  pause.tv_nsec = (ms % 1000) * 1000000L;
+  while ((nanosleep(&pause, &pause) == -1) && (errno == EINTR))
+    ;
+}
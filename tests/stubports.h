@@ -0,0 +1,10 @@
+/* stubports.h - Destination ports with special meaning to socksstub */
+
+/* The stub never really connects anywhere, a connection to any port */
+/* but these is made and echoes what's sent on it                    */
+#define STUB_ECHOPORT 7   /* Made, everything sent on it is echoed */
+#define STUB_REFUSEPORT 1 /* Refused with a connection refused reply */
+#define STUB_RESETPORT 2  /* Reset by the stub instead of a reply */
+
+/* The address the checks connect to, it has to be routed to the stub */
+#define STUB_DESTINATION "10.255.255.1"
@@ -36,8 +36,14 @@ char *progname = "libtsocks"; /* Name used in err msgs    */
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,14 +51,20 @@ char *progname = "libtsocks"; /* Name used in err msgs    */
 #include <strings.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef USE_SOCKS_DNS
 #include <resolv.h>
 #endif
 #include "parser.h"
+#include "route.h"
 #include "tsocks.h"
+#include "broker.h"
 
 /* Global Declarations */
 #ifdef USE_SOCKS_DNS
@@ -61,11 +73,77 @@ static int (*realresinit)(void);
 static int (*realconnect)(CONNECT_SIGNATURE);
 static int (*realselect)(SELECT_SIGNATURE);
 static int (*realpoll)(POLL_SIGNATURE);
+#ifdef PSELECT_SIGNATURE
+static int (*realpselect)(PSELECT_SIGNATURE);
+#endif
+#ifdef PPOLL_SIGNATURE
+static int (*realppoll)(PPOLL_SIGNATURE);
+#endif
 static int (*realclose)(CLOSE_SIGNATURE);
+#ifdef USE_SENDTO
+static ssize_t (*realsendto)(SENDTO_SIGNATURE);
+#endif
+#ifdef USE_SENDMSG
+static ssize_t (*realsendmsg)(SENDMSG_SIGNATURE);
+#endif
+#ifdef USE_OPTIMISTIC
+struct mmsghdr;
+static ssize_t (*realread)(READ_SIGNATURE);
+static ssize_t (*realrecv)(RECV_SIGNATURE);
+static ssize_t (*realrecvfrom)(RECVFROM_SIGNATURE);
+static ssize_t (*realrecvmsg)(RECVMSG_SIGNATURE);
+static ssize_t (*realreadv)(READV_SIGNATURE);
+static int (*realrecvmmsg)(RECVMMSG_SIGNATURE);
+#ifdef READ_CHK_SIGNATURE
+static ssize_t (*realread_chk)(READ_CHK_SIGNATURE);
+#endif
+#ifdef RECV_CHK_SIGNATURE
+static ssize_t (*realrecv_chk)(RECV_CHK_SIGNATURE);
+#endif
+#ifdef RECVFROM_CHK_SIGNATURE
+static ssize_t (*realrecvfrom_chk)(RECVFROM_CHK_SIGNATURE);
+#endif
+#endif
+#ifdef USE_EPOLL
+static int (*realepoll_ctl)(EPOLL_CTL_SIGNATURE);
+static int (*realepoll_wait)(EPOLL_WAIT_SIGNATURE);
+#ifdef EPOLL_PWAIT_SIGNATURE
+static int (*realepoll_pwait)(EPOLL_PWAIT_SIGNATURE);
+#endif
+#endif
 static struct parsedfile *config;
-static struct connreq *requests = NULL;
+static unsigned int configgen = 0; /* Configurations loaded so far */
+static pthread_mutex_t configlock = PTHREAD_MUTEX_INITIALIZER; /* Held */
+                                   /* while the config is (re)loaded   */
+static pthread_mutex_t resolvelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t initonce = PTHREAD_ONCE_INIT;
+static pthread_once_t envonce = PTHREAD_ONCE_INIT;
+static struct requestpage **requestdirs[REQUEST_DIRS]; /* Requests by */
+static int requestpagecount = 0;   /* socket, and how many pages there */
+                                   /* could be requests in             */
+static int nrequests = 0;
+static int nreplies = 0; /* Optimistic requests, whose reply may be unread */
+static int nwatches = 0; /* Epoll registrations noted or held by shards */
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER; /* Held */
+static pthread_cond_t poolcond = PTHREAD_COND_INITIALIZER; /* while */
+static struct serverpool *pools = NULL;    /* the pools are used, the */
+static int poolthread = 0;                 /* thread fills them       */
+static pid_t poolpid = 0;                  /* in this process         */
+static time_t brokerretry = 0; /* Don't look for the broker before this */
+static int racing = 0;         /* Requests racing more than one server */
+static int brokering = 0;      /* Requests waiting for the broker, and */
+static time_t brokerheard = 0; /* when it last replied to any of them  */
+static struct requestshard requestshards[REQUEST_SHARDS];
+static time_t lastreap = 0;
+static __thread int routing = 0; /* This thread is routing a connection */
 static int suid = 0;
 static char *conffile = NULL;
+static struct routecache routecache[ROUTECACHE_SIZE];
+static struct confstamp confstamps[2];
+static time_t lastcheck = 0;
+static int watching = 0;
+static unsigned long cachehits = 0;
+static unsigned long cachemisses = 0;
 
 /* Exported Function Prototypes */
 void _init(void);
@@ -73,46 +151,214 @@ void tsocks_init(void);
 int connect(CONNECT_SIGNATURE);
 int select(SELECT_SIGNATURE);
 int poll(POLL_SIGNATURE);
+#ifdef PSELECT_SIGNATURE
+int pselect(PSELECT_SIGNATURE);
+#endif
+#ifdef PPOLL_SIGNATURE
+int ppoll(PPOLL_SIGNATURE);
+#endif
 int close(CLOSE_SIGNATURE);
+#ifdef USE_SENDTO
+ssize_t sendto(SENDTO_SIGNATURE);
+#endif
+#ifdef USE_SENDMSG
+ssize_t sendmsg(SENDMSG_SIGNATURE);
+#endif
+#ifdef USE_OPTIMISTIC
+ssize_t read(READ_SIGNATURE);
+ssize_t readv(READV_SIGNATURE);
+ssize_t recv(RECV_SIGNATURE);
+ssize_t recvfrom(RECVFROM_SIGNATURE);
+ssize_t recvmsg(RECVMSG_SIGNATURE);
+int recvmmsg(RECVMMSG_SIGNATURE);
+#ifdef READ_CHK_SIGNATURE
+ssize_t __read_chk(READ_CHK_SIGNATURE);
+#endif
+#ifdef RECV_CHK_SIGNATURE
+ssize_t __recv_chk(RECV_CHK_SIGNATURE);
+#endif
+#ifdef RECVFROM_CHK_SIGNATURE
+ssize_t __recvfrom_chk(RECVFROM_CHK_SIGNATURE);
+#endif
+#endif
+#ifdef USE_EPOLL
+int epoll_ctl(EPOLL_CTL_SIGNATURE);
+int epoll_wait(EPOLL_WAIT_SIGNATURE);
+#ifdef EPOLL_PWAIT_SIGNATURE
+int epoll_pwait(EPOLL_PWAIT_SIGNATURE);
+#endif
+#endif
 #ifdef USE_SOCKS_DNS
 int res_init(void);
 #endif
 
 /* Private Function Prototypes */
+static void init_library(void);
 static int get_config();
+static int load_inherited_config(struct parsedfile *newconfig);
 static int get_environment();
+static void read_environment(void);
+static void stat_config(struct confstamp *stamps);
+static void release_config(struct parsedfile *oldconfig);
+static struct parsedfile *enter_config(struct requestshard *shard);
+static void leave_config(struct requestshard *shard);
+static void wait_for_routing(void);
+static int route_connection(struct parsedfile *current,
+                            struct sockaddr_in *connaddr,
+                            struct serverent **path,
+                            struct sockaddr_in *serveraddr);
+static void fill_route_cache(struct routecache *slot,
+                             struct routecache *entry);
+static unsigned int resolve_server(char *address);
 static int connect_server(struct connreq *conn);
+#ifdef MSG_FASTOPEN
+static int fastopen_server(struct connreq *conn);
+#endif
+static void check_fastopen(struct connreq *conn);
+static void fail_request(struct connreq *conn);
 static int send_socks_request(struct connreq *conn);
 static struct connreq *new_socks_request(int sockid,
                                          struct sockaddr_in *connaddr,
                                          struct sockaddr_in *serveraddr,
-                                         struct serverent *path);
-static void kill_socks_request(struct connreq *conn);
+                                         struct serverent *path,
+                                         struct parsedfile *current);
+static void kill_socks_request(struct requestshard *shard,
+                               struct connreq *conn);
+#if defined(USE_SENDTO) || defined(USE_SENDMSG)
+static int intercept_send(int sockid, const struct iovec *iov, int iovcnt,
+                          int flags, const struct sockaddr *addr,
+                          socklen_t addrlen, ssize_t *sent);
+static int settle_request(int sockid);
+#endif
+#ifdef USE_OPTIMISTIC
+static int read_reply(int sockid);
+static void park_request(struct connreq *conn);
+#endif
+static int connect_sent(int state);
 static int handle_request(struct connreq *conn);
-static struct connreq *find_socks_request(int sockid, int includefailed);
-static int connect_server(struct connreq *conn);
+static struct requestshard *request_shard(int sockid);
+static struct requestpage *request_page(int sockid, int create);
+static struct requestpage **request_dir(int pageno, int create);
+static int has_socks_request(int sockid);
+static struct connreq *lookup_socks_request(int sockid);
+static struct connreq *claim_socks_request(int sockid, int includefinished);
+static void release_socks_request(struct connreq *conn, int kill);
+static int request_state(int sockid);
+static int request_watch(int sockid, int *waitfd);
+static int next_socks_socket(int sockid);
+static int selected_events(int sockid, fd_set *readfds, fd_set *writefds,
+                           fd_set *exceptfds);
+static void start_wait(struct eventwait *wait, int type,
+                       const struct timespec *timeout,
+                       const sigset_t *sigmask);
+static int map_entry(struct eventwait *wait, int index, int sockid,
+                     short events);
+static int map_select_events(struct eventwait *wait, int n, fd_set *readfds,
+                             fd_set *writefds, fd_set *exceptfds);
+static int map_poll_events(struct eventwait *wait, struct pollfd *ufds,
+                           unsigned long nfds);
+static int wait_events(struct eventwait *wait);
+static void watch_events(struct eventwait *wait);
+static int real_wait(struct eventwait *wait);
+static void set_deadline(struct timespec *deadline,
+                         const struct timespec *timeout);
+static void time_left(const struct timespec *deadline, struct timespec *left);
+static int take_events(struct eventwait *wait, struct pollentry *entry,
+                       int *nevents);
+static void give_events(struct eventwait *wait, struct pollentry *entry,
+                        int events, int *nevents);
+static void finish_wait(struct eventwait *wait);
+#ifdef USE_EPOLL
+static int watchable_socket(int sockid);
+static struct epollwatch **find_watch(struct requestshard *shard, int epfd,
+                                      int sockid);
+static int note_watch(struct requestshard *shard, int epfd, int op, int fd,
+                      struct epoll_event *event);
+static void drop_watches(struct requestshard *shard, int sockid);
+static int control_watch(struct requestshard *shard, int epfd, int op,
+                         int fd, struct epoll_event *event, int state,
+                         int waitfd);
+static void update_watches(struct requestshard *shard, int sockid,
+                           int state, int waitfd);
+static void set_watch(int epfd, int sockid, struct epoll_event *event);
+static uint32_t watch_interest(int state);
+static int wait_epoll(int epfd, struct epoll_event *events, int maxevents,
+                      int timeout, const sigset_t *sigmask, int pwait);
+static void handle_epoll_event(int sockid, uint32_t revents);
+#endif
+static struct connreq *alloc_request(struct requestshard *shard);
+static void free_request(struct requestshard *shard, struct connreq *conn);
+static void queue_reap(struct requestshard *shard, struct connreq *conn);
+static void unqueue_reap(struct requestshard *shard, struct connreq *conn);
+static void reap_requests(void);
+static int size_buffer(struct connreq *conn, int len);
+static int wait_request(struct connreq *conn, short events);
 static int send_socks_request(struct connreq *conn);
 static int send_socksv4_request(struct connreq *conn);
 static int send_socksv5_method(struct connreq *conn);
 static int send_socksv5_connect(struct connreq *conn);
+static int send_socksv5_pipeline(struct connreq *conn);
+static int add_socksv5_auth(struct connreq *conn, char *uname, char *upass);
+static void add_socksv5_connect(struct connreq *conn);
+static char *socks_username(struct connreq *conn, struct passwd *pwent,
+                            char *pwbuf, size_t pwbuflen);
+static char *socks_password(struct connreq *conn);
 static int send_buffer(struct connreq *conn);
+static int extra_length(struct connreq *conn);
+static ssize_t send_request(struct connreq *conn, int flags,
+                            struct sockaddr_in *to);
 static int recv_buffer(struct connreq *conn);
 static int read_socksv5_method(struct connreq *conn);
 static int read_socksv4_req(struct connreq *conn);
 static int read_socksv5_connect(struct connreq *conn);
 static int read_socksv5_auth(struct connreq *conn);
+static int read_socksv5_pipeline(struct connreq *conn);
+static int pipelining(struct connreq *conn);
+static int restart_request(struct connreq *conn);
+static void stop_pipelining(struct connreq *conn);
+static void start_race(struct connreq *conn);
+static void delay_race(struct connreq *conn);
+static int race_blocking(struct connreq *conn);
+static struct connreq *run_race(struct connreq *conn);
+static void run_races(void);
+static struct connreq *free_racer(struct serverrace *race);
+static struct connreq *next_racer(struct connreq *conn);
+static struct connreq *start_racer(struct connreq *conn,
+                                   struct connreq *racer,
+                                   struct sockaddr_in *serveraddr);
+static void drop_racer(struct connreq *racer);
+static int adopt_racer(struct connreq *conn, struct connreq *racer);
+static int fail_over(struct connreq *conn);
+static void end_race(struct connreq *conn);
+static int take_ready(struct connreq *conn);
+static int take_pooled(struct connreq *conn);
+static int take_brokered(struct connreq *conn);
+static int ask_broker(struct connreq *conn);
+static int read_broker(struct connreq *conn);
+static int open_broker(struct connreq *conn, int nonblock);
+static int recv_broker(struct connreq *conn, int broker, int flags);
+static int replace_socket(struct connreq *conn, int sock);
+static int waiting_socket(struct connreq *conn);
+static int copy_options(int from, int to);
+static int ticking(void);
+static struct serverpool *find_pool(struct connreq *conn);
+static void start_pool_thread(void);
+static void *pool_thread(void *arg);
+static struct serverpool *tend_pool(struct serverpool *pool, time_t now,
+                                    time_t *next);
+static int warm_socket(struct serverpool *pool);
+static void drop_pool(struct serverpool *pool);
+static void reset_pools(pid_t pid);
 
 void _init(void) { tsocks_init(); }
 
-void tsocks_init(void) {
-  static int global_init = 0;
+void tsocks_init(void) { pthread_once(&initonce, init_library); }
+
+static void init_library(void) {
+  int i;
 #ifdef USE_OLD_DLSYM
   void *lib;
 #endif
-  if (global_init) {
-    return;
-  }
-  global_init = 1;
 
   /* We could do all our initialization here, but to be honest */
   /* most programs that are run won't use our services, so     */
@@ -125,7 +371,43 @@ void tsocks_init(void) {
   realconnect = dlsym(RTLD_NEXT, "connect");
   realselect = dlsym(RTLD_NEXT, "select");
   realpoll = dlsym(RTLD_NEXT, "poll");
+#ifdef PSELECT_SIGNATURE
+  realpselect = dlsym(RTLD_NEXT, "pselect");
+#endif
+#ifdef PPOLL_SIGNATURE
+  realppoll = dlsym(RTLD_NEXT, "ppoll");
+#endif
   realclose = dlsym(RTLD_NEXT, "close");
+#ifdef USE_SENDTO
+  realsendto = dlsym(RTLD_NEXT, "sendto");
+#endif
+#ifdef USE_SENDMSG
+  realsendmsg = dlsym(RTLD_NEXT, "sendmsg");
+#endif
+#ifdef USE_OPTIMISTIC
+  realread = dlsym(RTLD_NEXT, "read");
+  realrecv = dlsym(RTLD_NEXT, "recv");
+  realrecvfrom = dlsym(RTLD_NEXT, "recvfrom");
+  realrecvmsg = dlsym(RTLD_NEXT, "recvmsg");
+  realreadv = dlsym(RTLD_NEXT, "readv");
+  realrecvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
+#ifdef READ_CHK_SIGNATURE
+  realread_chk = dlsym(RTLD_NEXT, "__read_chk");
+#endif
+#ifdef RECV_CHK_SIGNATURE
+  realrecv_chk = dlsym(RTLD_NEXT, "__recv_chk");
+#endif
+#ifdef RECVFROM_CHK_SIGNATURE
+  realrecvfrom_chk = dlsym(RTLD_NEXT, "__recvfrom_chk");
+#endif
+#endif
+#ifdef USE_EPOLL
+  realepoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+  realepoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+#ifdef EPOLL_PWAIT_SIGNATURE
+  realepoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+#endif
+#endif
 #ifdef USE_SOCKS_DNS
   realresinit = dlsym(RTLD_NEXT, "res_init");
 #endif
@@ -134,6 +416,12 @@ void tsocks_init(void) {
   realconnect = dlsym(lib, "connect");
   realselect = dlsym(lib, "select");
   realpoll = dlsym(lib, "poll");
+#ifdef PSELECT_SIGNATURE
+  realpselect = dlsym(lib, "pselect");
+#endif
+#ifdef PPOLL_SIGNATURE
+  realppoll = dlsym(lib, "ppoll");
+#endif
 #ifdef USE_SOCKS_DNS
   realresinit = dlsym(lib, "res_init");
 #endif
@@ -141,19 +429,57 @@ void tsocks_init(void) {
 
   lib = dlopen(LIBC, RTLD_LAZY);
   realclose = dlsym(lib, "close");
+#ifdef USE_SENDTO
+  realsendto = dlsym(lib, "sendto");
+#endif
+#ifdef USE_SENDMSG
+  realsendmsg = dlsym(lib, "sendmsg");
+#endif
+#ifdef USE_OPTIMISTIC
+  realread = dlsym(lib, "read");
+  realrecv = dlsym(lib, "recv");
+  realrecvfrom = dlsym(lib, "recvfrom");
+  realrecvmsg = dlsym(lib, "recvmsg");
+  realreadv = dlsym(lib, "readv");
+  realrecvmmsg = dlsym(lib, "recvmmsg");
+#ifdef READ_CHK_SIGNATURE
+  realread_chk = dlsym(lib, "__read_chk");
+#endif
+#ifdef RECV_CHK_SIGNATURE
+  realrecv_chk = dlsym(lib, "__recv_chk");
+#endif
+#ifdef RECVFROM_CHK_SIGNATURE
+  realrecvfrom_chk = dlsym(lib, "__recvfrom_chk");
+#endif
+#endif
+#ifdef USE_EPOLL
+  realepoll_ctl = dlsym(lib, "epoll_ctl");
+  realepoll_wait = dlsym(lib, "epoll_wait");
+#ifdef EPOLL_PWAIT_SIGNATURE
+  realepoll_pwait = dlsym(lib, "epoll_pwait");
+#endif
+#endif
   dlclose(lib);
 #endif
+
+  for (i = 0; i < REQUEST_SHARDS; i++)
+    pthread_mutex_init(&(requestshards[i].lock), NULL);
+
+  poolpid = getpid();
 }
 
 static int get_environment() {
-  static int done = 0;
+
+  pthread_once(&envonce, read_environment);
+
+  return (0);
+}
+
+static void read_environment(void) {
   int loglevel = MSGERR;
   char *logfile = NULL;
   char *env;
 
-  if (done)
-    return (0);
-
     /* Determine the logging level */
 #ifndef ALLOW_MSG_OUTPUT
   set_log_options(-1, stderr, 0);
@@ -164,49 +490,201 @@ static int get_environment() {
     logfile = env;
   set_log_options(loglevel, logfile, 1);
 #endif
-
-  done = 1;
-
-  return (0);
 }
 
 static int get_config() {
   static int done = 0;
-
-  if (done)
-    return (0);
-
+  struct parsedfile *newconfig, *oldconfig;
+  struct confstamp stamps[2];
+  time_t now, last;
+
+  if (__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+    /* Long running processes pick up changes to the configuration, */
+    /* but we only look for them every CONF_CHECK_INTERVAL seconds. */
+    /* A thread in the middle of routing a connection can't wait    */
+    /* for the old configuration to be let go so it doesn't look    */
+    if (!watching || routing)
+      return (0);
+    now = time(NULL);
+    last = __atomic_load_n(&lastcheck, __ATOMIC_RELAXED);
+    if ((now - last < CONF_CHECK_INTERVAL) && (now >= last))
+      return (0);
+    /* One thread looks, the rest carry on with what they have */
+    if (pthread_mutex_trylock(&configlock))
+      return (0);
+    if (__atomic_load_n(&lastcheck, __ATOMIC_RELAXED) != last) {
+      pthread_mutex_unlock(&configlock);
+      return (0);
+    }
+    __atomic_store_n(&lastcheck, now, __ATOMIC_RELAXED);
+    stat_config(stamps);
+    if (!memcmp(stamps, confstamps, sizeof(stamps))) {
+      pthread_mutex_unlock(&configlock);
+      return (0);
+    }
+    show_msg(MSGNOTICE, "Configuration file %s has changed, reloading it\n",
+             (conffile ? conffile : CONF_FILE));
+  } else {
+    /* Threads arriving together wait for the first to read it */
+    pthread_mutex_lock(&configlock);
+    if (done) {
+      pthread_mutex_unlock(&configlock);
+      return (0);
+    }
     /* Determine the location of the config file */
 #ifdef ALLOW_ENV_CONFIG
-  if (!suid)
-    conffile = getenv("TSOCKS_CONF_FILE");
+    if (!suid)
+      conffile = getenv("TSOCKS_CONF_FILE");
+#endif
+    watching = 1;
+#ifdef STATIC_CONFIG
+    /* A compiled in configuration never changes */
+    if (conffile == NULL)
+      watching = 0;
 #endif
+    lastcheck = time(NULL);
+    stat_config(stamps);
+  }
 
-  /* Read in the config file */
-  config = malloc(sizeof(*config));
-  if (!config)
+  /* Read in the config file. The new configuration is built off to */
+  /* the side, requests started under the old one keep using it     */
+  newconfig = malloc(sizeof(*newconfig));
+  if (!newconfig) {
+    pthread_mutex_unlock(&configlock);
     return (0);
-  read_config(conffile, config);
-  if (config->paths)
+  }
+#ifdef STATIC_CONFIG
+  /* libtsocks-static has its configuration compiled in, but an */
+  /* explicitly requested configuration file still wins         */
+  if (conffile == NULL)
+    load_static_config(newconfig);
+  else
+#endif
+  /* tsocksrun hands its children the configuration ready compiled, */
+  /* after that changes are read from the file as usual             */
+  if (done || load_inherited_config(newconfig))
+    load_config(conffile, newconfig);
+  if (newconfig->paths)
     show_msg(MSGDEBUG, "First lineno for first path is %d\n",
-             config->paths->lineno);
+             newconfig->paths->lineno);
+  newconfig->refcount = 1;
+  /* Decisions cached under any previous configuration are stale */
+  newconfig->generation = ++configgen;
+  memcpy(confstamps, stamps, sizeof(confstamps));
+
+  /* Publish it, then once no thread can still be routing with the */
+  /* old one drop the reference it held as the current config      */
+  oldconfig = __atomic_exchange_n(&config, newconfig, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&configlock);
+
+  if (oldconfig) {
+    wait_for_routing();
+    release_config(oldconfig);
+  }
+
+  return (0);
+}
+
+/* Map the configuration image tsocksrun passed down in a memfd, */
+/* returns 0 on success or 1 if there isn't one we can use        */
+static int load_inherited_config(struct parsedfile *newconfig) {
+  char *env, *end;
+  long fd;
+
+  if (suid || ((env = getenv(IMAGE_FD_ENV)) == NULL))
+    return (1);
 
-  done = 1;
+  fd = strtol(env, &end, 10);
+  if ((*env == '\0') || (*end != '\0') || (fd < 0) || (fd > 65535)) {
+    show_msg(MSGERR, "Invalid %s (%s), ignoring it\n", IMAGE_FD_ENV, env);
+    return (1);
+  }
+
+  if (load_config_fd(fd, conffile, newconfig))
+    return (1);
+
+  show_msg(MSGDEBUG, "Using configuration inherited on descriptor %ld\n", fd);
 
   return (0);
 }
 
+/* Record the identity of the configuration file and any compiled */
+/* image of it, a missing file is recorded as all zeroes          */
+static void stat_config(struct confstamp *stamps) {
+  char *filename = (conffile ? conffile : CONF_FILE);
+  char imagename[1024];
+  struct stat st;
+
+  memset(stamps, 0x0, 2 * sizeof(*stamps));
+  if (stat(filename, &st) == 0) {
+    stamps[0].ino = st.st_ino;
+    stamps[0].mtime = st.st_mtime;
+    stamps[0].size = st.st_size;
+  }
+  if (strlen(filename) + sizeof(IMAGE_SUFFIX) > sizeof(imagename))
+    return;
+  strcpy(imagename, filename);
+  strcat(imagename, IMAGE_SUFFIX);
+  if (stat(imagename, &st) == 0) {
+    stamps[1].ino = st.st_ino;
+    stamps[1].mtime = st.st_mtime;
+    stamps[1].size = st.st_size;
+  }
+}
+
+/* Drop a reference to a configuration, freeing it once neither the */
+/* current configuration nor any request refers to it               */
+static void release_config(struct parsedfile *oldconfig) {
+
+  if (__atomic_sub_fetch(&(oldconfig->refcount), 1, __ATOMIC_ACQ_REL))
+    return;
+
+  show_msg(MSGDEBUG, "Freeing configuration no longer in use\n");
+  free_config(oldconfig);
+  free(oldconfig);
+}
+
+/* Get hold of the current configuration to route a connection with. */
+/* Until leave_config() a configuration replaced in the meantime     */
+/* isn't released, so the caller can look at it and take its own    */
+/* reference without a lock                                          */
+static struct parsedfile *enter_config(struct requestshard *shard) {
+
+  __atomic_add_fetch(&(shard->readers), 1, __ATOMIC_SEQ_CST);
+  routing++;
+
+  return (__atomic_load_n(&config, __ATOMIC_SEQ_CST));
+}
+
+static void leave_config(struct requestshard *shard) {
+
+  routing--;
+  __atomic_sub_fetch(&(shard->readers), 1, __ATOMIC_RELEASE);
+}
+
+/* Wait for every thread that might have picked up the configuration */
+/* that was just replaced to be done routing with it                 */
+static void wait_for_routing(void) {
+  int i;
+
+  for (i = 0; i < REQUEST_SHARDS; i++)
+    while (__atomic_load_n(&(requestshards[i].readers), __ATOMIC_SEQ_CST))
+      sched_yield();
+}
+
 int connect(CONNECT_SIGNATURE) {
   struct sockaddr_in *connaddr;
   struct sockaddr_in peer_address;
   struct sockaddr_in server_address;
-  int gotvalidserver = 0, rc;
+  int verdict, rc, err = 0, finished;
   socklen_t namelen = sizeof(peer_address);
   int sock_type = -1;
   socklen_t sock_type_len = sizeof(sock_type);
-  unsigned int res = -1;
   struct serverent *path;
-  struct connreq *newconn;
+  struct connreq *newconn = NULL;
+  struct requestshard *shard;
+  struct parsedfile *current;
 
   tsocks_init();
 
@@ -235,8 +713,10 @@ int connect(CONNECT_SIGNATURE) {
   /* If we haven't initialized yet, do it now */
   get_config();
 
+  reap_requests();
+
   /* Are we already handling this connect? */
-  if ((newconn = find_socks_request(__fd, 1))) {
+  if ((newconn = claim_socks_request(__fd, 1))) {
     if (memcmp(&newconn->connaddr, connaddr, sizeof(*connaddr))) {
       /* Ok, they're calling connect on a socket that is in our
        * queue but this connect() isn't to the same destination,
@@ -250,7 +730,7 @@ int connect(CONNECT_SIGNATURE) {
                "tsocks request for socket %d but to "
                "new destination, deleting old request\n",
                newconn->sockid);
-      kill_socks_request(newconn);
+      release_socks_request(newconn, 1);
     } else {
       /* Ok, this call to connect() is to check the status of
        * a current non blocking connect(). */
@@ -259,22 +739,27 @@ int connect(CONNECT_SIGNATURE) {
                  "Call to connect received on failed "
                  "request %d, returning %d\n",
                  newconn->sockid, newconn->err);
-        errno = newconn->err;
+        err = newconn->err;
         rc = -1;
       } else if (newconn->state == DONE) {
-        show_msg(MSGERR,
+        show_msg(MSGDEBUG,
                  "Call to connect received on completed "
                  "request %d\n",
-                 newconn->sockid, newconn->err);
+                 newconn->sockid);
         rc = 0;
       } else {
         show_msg(MSGDEBUG, "Call to connect received on current request %d\n",
                  newconn->sockid);
-        rc = handle_request(newconn);
-        errno = rc;
+        rc = err = handle_request(newconn);
+        /* Still waiting on the SOCKS server, like a real connect */
+        /* still in progress                                        */
+        if (err == EWOULDBLOCK)
+          err = EALREADY;
       }
-      if ((newconn->state == FAILED) || (newconn->state == DONE))
-        kill_socks_request(newconn);
+      finished = ((newconn->state == FAILED) || (newconn->state == DONE));
+      release_socks_request(newconn, finished);
+      if (rc)
+        errno = err;
       return ((rc ? -1 : 0));
     }
   }
@@ -292,19 +777,110 @@ int connect(CONNECT_SIGNATURE) {
            "%s\n",
            __fd, inet_ntoa(connaddr->sin_addr));
 
+  /* Work out how this destination should be reached, the request */
+  /* takes its own reference to the configuration it was routed by  */
+  shard = request_shard(__fd);
+  current = enter_config(shard);
+  verdict = route_connection(current, connaddr, &path, &server_address);
+  if (verdict == CACHE_PROXY)
+    newconn = new_socks_request(__fd, connaddr, &server_address, path,
+                                current);
+  leave_config(shard);
+
   /* If the address is local call realconnect */
-  if (!(is_local(config, &(connaddr->sin_addr), ntohs(connaddr->sin_port)))) {
+  if (verdict == CACHE_LOCAL) {
     show_msg(MSGDEBUG, "Connection for socket %d is local\n", __fd);
+#ifdef USE_EPOLL
+    if (__atomic_load_n(&nwatches, __ATOMIC_RELAXED)) {
+      pthread_mutex_lock(&(shard->lock));
+      drop_watches(shard, __fd);
+      pthread_mutex_unlock(&(shard->lock));
+    }
+#endif
     return (realconnect(__fd, __addr, __len));
   }
 
+  /* If we haven't found a valid server we return connection refused */
+  if (!newconn) {
+    errno = ECONNREFUSED;
+    return (-1);
+  } else {
+    /* Now we call the main function to handle the connect. */
+    rc = handle_request(newconn);
+    /* If the request completed immediately it mustn't have been
+     * a non blocking socket, in this case we don't need to know
+     * about this socket anymore. */
+    finished = ((newconn->state == FAILED) || (newconn->state == DONE));
+    release_socks_request(newconn, finished);
+    /* Otherwise it's a non blocking socket and the negotiation */
+    /* carries on as select(), poll() or epoll see it's ready     */
+    errno = (rc == EWOULDBLOCK ? EINPROGRESS : rc);
+    return ((rc ? -1 : 0));
+  }
+}
+
+/* Decide how a destination should be reached, returning CACHE_LOCAL,  */
+/* CACHE_PROXY (with the path and socks server address filled in) or   */
+/* CACHE_INVALID. Local and proxied verdicts are remembered in a small */
+/* direct mapped cache so repeat connections skip the classification   */
+static int route_connection(struct parsedfile *current,
+                            struct sockaddr_in *connaddr,
+                            struct serverent **path,
+                            struct sockaddr_in *serveraddr) {
+  struct routecache *slot, entry;
+  unsigned int res = -1, seq;
+  uint32_t hash;
+
+  hash = (ntohl(connaddr->sin_addr.s_addr) ^
+          (ntohs(connaddr->sin_port) * 0x9e3779b1U)) *
+         2654435761U;
+  slot = &(routecache[hash >> (32 - ROUTECACHE_BITS)]);
+
+  /* Slots are copied without a lock and the copy is only believed */
+  /* if no other thread was writing the slot while we read it      */
+  seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+  memcpy(&entry, slot, sizeof(entry));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (!(seq & 1) && (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == seq) &&
+      (entry.verdict != CACHE_EMPTY) &&
+      (entry.generation == current->generation) &&
+      (entry.ip == connaddr->sin_addr.s_addr) &&
+      (entry.port == connaddr->sin_port)) {
+    show_msg(MSGDEBUG,
+             "Route cache hit for %s:%d (%lu hits, %lu misses)\n",
+             inet_ntoa(connaddr->sin_addr), ntohs(connaddr->sin_port),
+             __atomic_add_fetch(&cachehits, 1, __ATOMIC_RELAXED),
+             cachemisses);
+    *path = entry.path;
+    memcpy(serveraddr, &(entry.serveraddr), sizeof(*serveraddr));
+    return (entry.verdict);
+  }
+
+  show_msg(MSGDEBUG,
+           "Route cache miss for %s:%d (%lu hits, %lu misses)\n",
+           inet_ntoa(connaddr->sin_addr), ntohs(connaddr->sin_port),
+           cachehits, __atomic_add_fetch(&cachemisses, 1, __ATOMIC_RELAXED));
+
+  memset(&entry, 0x0, sizeof(entry));
+  entry.generation = current->generation;
+  entry.ip = connaddr->sin_addr.s_addr;
+  entry.port = connaddr->sin_port;
+
+  if (!(is_local(current, &(connaddr->sin_addr),
+                 ntohs(connaddr->sin_port)))) {
+    entry.verdict = CACHE_LOCAL;
+    fill_route_cache(slot, &entry);
+    return (CACHE_LOCAL);
+  }
+
   /* Ok, so its not local, we need a path to the net */
-  pick_server(config, &path, &(connaddr->sin_addr), ntohs(connaddr->sin_port));
+  pick_server(current, path, &(connaddr->sin_addr),
+              ntohs(connaddr->sin_port));
 
   show_msg(MSGDEBUG, "Picked server %s for connection\n",
-           (path->address ? path->address : "(Not Provided)"));
-  if (path->address == NULL) {
-    if (path == &(config->defaultserver))
+           ((*path)->address ? (*path)->address : "(Not Provided)"));
+  if ((*path)->address == NULL) {
+    if (*path == &(current->defaultserver))
       show_msg(MSGERR, "Connection needs to be made "
                        "via default server but "
                        "the default server has not "
@@ -316,610 +892,3229 @@ int connect(CONNECT_SIGNATURE) {
                "%d in configuration file but "
                "the server has not been "
                "specified for this path\n",
-               path->lineno);
-  } else if ((res = resolve_ip(path->address, 0, HOSTNAMES)) == -1) {
+               (*path)->lineno);
+    return (CACHE_INVALID);
+  } else if ((res = resolve_server((*path)->address)) == -1) {
     show_msg(MSGERR,
              "The SOCKS server (%s) listed in the configuration "
              "file which needs to be used for this connection "
              "is invalid\n",
-             path->address);
-  } else {
-    /* Construct the addr for the socks server */
-    server_address.sin_family = AF_INET; /* host byte order */
-    server_address.sin_addr.s_addr = res;
-    server_address.sin_port = htons(path->port);
-    bzero(&(server_address.sin_zero), 8);
-
-    /* Complain if this server isn't on a localnet */
-    if (is_local(config, &server_address.sin_addr, server_address.sin_port)) {
-      show_msg(MSGERR, "SOCKS server %s (%s) is not on a local subnet!\n",
-               path->address, inet_ntoa(server_address.sin_addr));
-    } else
-      gotvalidserver = 1;
+             (*path)->address);
+    return (CACHE_INVALID);
   }
 
-  /* If we haven't found a valid server we return connection refused */
-  if (!gotvalidserver ||
-      !(newconn = new_socks_request(__fd, connaddr, &server_address, path))) {
-    errno = ECONNREFUSED;
-    return (-1);
-  } else {
-    /* Now we call the main function to handle the connect. */
-    rc = handle_request(newconn);
-    /* If the request completed immediately it mustn't have been
-     * a non blocking socket, in this case we don't need to know
-     * about this socket anymore. */
-    if ((newconn->state == FAILED) || (newconn->state == DONE))
-      kill_socks_request(newconn);
-    errno = rc;
-    return ((rc ? -1 : 0));
+  /* Construct the addr for the socks server */
+  serveraddr->sin_family = AF_INET; /* host byte order */
+  serveraddr->sin_addr.s_addr = res;
+  serveraddr->sin_port = htons((*path)->port);
+  bzero(&(serveraddr->sin_zero), 8);
+
+  /* Complain if this server isn't on a localnet */
+  if (is_local(current, &serveraddr->sin_addr, serveraddr->sin_port)) {
+    show_msg(MSGERR, "SOCKS server %s (%s) is not on a local subnet!\n",
+             (*path)->address, inet_ntoa(serveraddr->sin_addr));
+    return (CACHE_INVALID);
   }
+
+  /* Problems with the server aren't cached so they keep being */
+  /* reported, only usable decisions are remembered             */
+  entry.verdict = CACHE_PROXY;
+  entry.path = *path;
+  memcpy(&(entry.serveraddr), serveraddr, sizeof(entry.serveraddr));
+  fill_route_cache(slot, &entry);
+
+  return (CACHE_PROXY);
+}
+
+/* Store a decision in a route cache slot, unless another thread is */
+/* already storing one there                                        */
+static void fill_route_cache(struct routecache *slot,
+                             struct routecache *entry) {
+  unsigned int seq;
+
+  seq = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&(slot->seq), &seq, seq + 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->generation = entry->generation;
+  slot->ip = entry->ip;
+  slot->port = entry->port;
+  slot->verdict = entry->verdict;
+  slot->path = entry->path;
+  memcpy(&(slot->serveraddr), &(entry->serveraddr), sizeof(slot->serveraddr));
+
+  __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Find the address of a SOCKS server, gethostbyname() isn't safe for */
+/* several threads at once so names are looked up one at a time       */
+static unsigned int resolve_server(char *address) {
+  unsigned int res;
+
+  if ((res = inet_addr(address)) != (unsigned int)-1)
+    return (res);
+
+  pthread_mutex_lock(&resolvelock);
+  res = resolve_ip(address, 0, HOSTNAMES);
+  pthread_mutex_unlock(&resolvelock);
+
+  return (res);
 }
 
 int select(SELECT_SIGNATURE) {
-  int nevents = 0;
-  int setevents = 0;
-  int monitoring = 0;
-  struct connreq *conn, *nextconn;
-  fd_set mywritefds, myreadfds, myexceptfds;
+  struct eventwait wait;
+  struct timespec limit;
+  int rc;
 
   tsocks_init();
 
   /* If we're not currently managing any requests we can just
    * leave here */
-  if (!requests)
+  if (!__atomic_load_n(&nrequests, __ATOMIC_RELAXED))
     return (realselect(n, readfds, writefds, exceptfds, timeout));
 
   get_environment();
 
+  reap_requests();
+
   show_msg(MSGDEBUG,
            "Intercepted call to select with %d fds, "
            "0x%08x 0x%08x 0x%08x, timeout %08x\n",
            n, readfds, writefds, exceptfds, timeout);
 
-  for (conn = requests; conn != NULL; conn = conn->next) {
-    if ((conn->state == FAILED) || (conn->state == DONE))
-      continue;
-    conn->selectevents = 0;
-    show_msg(MSGDEBUG, "Checking requests for socks enabled socket %d\n",
-             conn->sockid);
-    conn->selectevents |=
-        (writefds ? (FD_ISSET(conn->sockid, writefds) ? WRITE : 0) : 0);
-    conn->selectevents |=
-        (readfds ? (FD_ISSET(conn->sockid, readfds) ? READ : 0) : 0);
-    conn->selectevents |=
-        (exceptfds ? (FD_ISSET(conn->sockid, exceptfds) ? EXCEPT : 0) : 0);
-    if (conn->selectevents) {
-      show_msg(MSGDEBUG, "Socket %d was set for events\n", conn->sockid);
-      monitoring = 1;
-    }
+  if (timeout) {
+    limit.tv_sec = timeout->tv_sec;
+    limit.tv_nsec = timeout->tv_usec * 1000;
   }
+  start_wait(&wait, WAIT_SELECT, (timeout ? &limit : NULL), NULL);
+  wait.selecttimeout = timeout;
 
-  if (!monitoring)
+  if ((rc = map_select_events(&wait, n, readfds, writefds, exceptfds)) == 0)
     return (realselect(n, readfds, writefds, exceptfds, timeout));
+  if (rc == -1)
+    return (-1);
 
-  /* This is our select loop. In it we repeatedly call select(). We
-   * pass select the same fdsets as provided by the caller except we
-   * modify the fdsets for the sockets we're managing to get events
-   * we're interested in (while negotiating with the socks server). When
-   * events we're interested in happen we go off and process the result
-   * ourselves, without returning the events to the caller. The loop
-   * ends when an event which isn't one we need to handle occurs or
-   * the select times out */
-  do {
-    /* Copy the clients fd events, we'll change them as we wish */
-    if (readfds)
-      memcpy(&myreadfds, readfds, sizeof(myreadfds));
-    else
-      FD_ZERO(&myreadfds);
-    if (writefds)
-      memcpy(&mywritefds, writefds, sizeof(mywritefds));
-    else
-      FD_ZERO(&mywritefds);
-    if (exceptfds)
-      memcpy(&myexceptfds, exceptfds, sizeof(myexceptfds));
-    else
-      FD_ZERO(&myexceptfds);
-
-    /* Now enable our sockets for the events WE want to hear about */
-    for (conn = requests; conn != NULL; conn = conn->next) {
-      if ((conn->state == FAILED) || (conn->state == DONE) ||
-          (conn->selectevents == 0))
-        continue;
-      /* We always want to know about socket exceptions */
-      FD_SET(conn->sockid, &myexceptfds);
-      /* If we're waiting for a connect or to be able to send
-       * on a socket we want to get write events */
-      if ((conn->state == SENDING) || (conn->state == CONNECTING))
-        FD_SET(conn->sockid, &mywritefds);
-      else
-        FD_CLR(conn->sockid, &mywritefds);
-      /* If we're waiting to receive data we want to get
-       * read events */
-      if (conn->state == RECEIVING)
-        FD_SET(conn->sockid, &myreadfds);
-      else
-        FD_CLR(conn->sockid, &myreadfds);
-    }
+  return (wait_events(&wait));
+}
 
-    nevents = realselect(n, &myreadfds, &mywritefds, &myexceptfds, timeout);
-    /* If there were no events we must have timed out or had an error */
-    if (nevents <= 0)
-      break;
+#ifdef PSELECT_SIGNATURE
+int pselect(PSELECT_SIGNATURE) {
+  struct eventwait wait;
+  int rc;
 
-    /* Loop through all the sockets we're monitoring and see if
-     * any of them have had events */
-    for (conn = requests; conn != NULL; conn = nextconn) {
-      nextconn = conn->next;
-      if ((conn->state == FAILED) || (conn->state == DONE))
-        continue;
-      show_msg(MSGDEBUG, "Checking socket %d for events\n", conn->sockid);
-      /* Clear all the events on the socket (if any), we'll reset
-       * any that are necessary later. */
-      setevents = 0;
-      if (FD_ISSET(conn->sockid, &mywritefds)) {
-        nevents--;
-        setevents |= WRITE;
-        show_msg(MSGDEBUG, "Socket had write event\n");
-        FD_CLR(conn->sockid, &mywritefds);
-      }
-      if (FD_ISSET(conn->sockid, &myreadfds)) {
-        nevents--;
-        setevents |= READ;
-        show_msg(MSGDEBUG, "Socket had write event\n");
-        FD_CLR(conn->sockid, &myreadfds);
-      }
-      if (FD_ISSET(conn->sockid, &myexceptfds)) {
-        nevents--;
-        setevents |= EXCEPT;
-        show_msg(MSGDEBUG, "Socket had except event\n");
-        FD_CLR(conn->sockid, &myexceptfds);
-      }
+  tsocks_init();
 
-      if (!setevents) {
-        show_msg(MSGDEBUG, "No events on socket %d\n", conn->sockid);
-        continue;
-      }
+  if (!__atomic_load_n(&nrequests, __ATOMIC_RELAXED))
+    return (realpselect(n, readfds, writefds, exceptfds, timeout, sigmask));
 
-      if (setevents & EXCEPT) {
-        conn->state = FAILED;
-      } else {
-        handle_request(conn);
-      }
-      /* If the connection hasn't failed or completed there is nothing
-       * to report to the client */
-      if ((conn->state != FAILED) && (conn->state != DONE))
-        continue;
+  get_environment();
 
-      /* Ok, the connection is completed, for good or for bad. We now
-       * hand back the relevant events to the caller. We don't delete the
-       * connection though since the caller should call connect() to
-       * check the status, we delete it then */
+  reap_requests();
 
-      if (conn->state == FAILED) {
-        /* Damn, the connection failed. Whatever the events the socket
-         * was selected for we flag */
-        if (conn->selectevents & EXCEPT) {
-          FD_SET(conn->sockid, &myexceptfds);
-          nevents++;
-        }
-        if (conn->selectevents & READ) {
-          FD_SET(conn->sockid, &myreadfds);
-          nevents++;
-        }
-        if (conn->selectevents & WRITE) {
-          FD_SET(conn->sockid, &mywritefds);
-          nevents++;
-        }
-        /* We should use setsockopt to set the SO_ERROR errno for this
-         * socket, but this isn't allowed for some silly reason which
-         * leaves us a bit hamstrung.
-         * We don't delete the request so that hopefully we can
-         * return the error on the socket if they call connect() on it */
-      } else {
-        /* The connection is done,  if the client selected for
-         * writing we can go ahead and signal that now (since the socket must
-         * be ready for writing), otherwise we'll just let the select loop
-         * come around again (since we can't flag it for read, we don't know
-         * if there is any data to be read and can't be bothered checking) */
-        if (conn->selectevents & WRITE) {
-          FD_SET(conn->sockid, &mywritefds);
-          nevents++;
-        }
-      }
-    }
-  } while (nevents == 0);
+  show_msg(MSGDEBUG,
+           "Intercepted call to pselect with %d fds, "
+           "0x%08x 0x%08x 0x%08x, timeout %08x\n",
+           n, readfds, writefds, exceptfds, timeout);
 
-  show_msg(MSGDEBUG, "Finished intercepting select(), %d events\n", nevents);
+  start_wait(&wait, WAIT_PSELECT, timeout, sigmask);
 
-  /* Now copy our event blocks back to the client blocks */
-  if (readfds)
-    memcpy(readfds, &myreadfds, sizeof(myreadfds));
-  if (writefds)
-    memcpy(writefds, &mywritefds, sizeof(mywritefds));
-  if (exceptfds)
-    memcpy(exceptfds, &myexceptfds, sizeof(myexceptfds));
+  if ((rc = map_select_events(&wait, n, readfds, writefds, exceptfds)) == 0)
+    return (realpselect(n, readfds, writefds, exceptfds, timeout, sigmask));
+  if (rc == -1)
+    return (-1);
 
-  return (nevents);
+  return (wait_events(&wait));
 }
+#endif
 
 int poll(POLL_SIGNATURE) {
-  int nevents = 0;
-  int i;
-  int setevents = 0;
-  int monitoring = 0;
-  struct connreq *conn, *nextconn;
+  struct eventwait wait;
+  struct timespec limit;
+  int rc;
 
   tsocks_init();
 
   /* If we're not currently managing any requests we can just
    * leave here */
-  if (!requests)
+  if (!__atomic_load_n(&nrequests, __ATOMIC_RELAXED))
     return (realpoll(ufds, nfds, timeout));
 
   get_environment();
 
+  reap_requests();
+
   show_msg(MSGDEBUG,
            "Intercepted call to poll with %d fds, "
            "0x%08x timeout %d\n",
            nfds, ufds, timeout);
 
-  for (conn = requests; conn != NULL; conn = conn->next)
-    conn->selectevents = 0;
-
-  /* Record what events on our sockets the caller was interested
-   * in */
-  for (i = 0; i < nfds; i++) {
-    if (!(conn = find_socks_request(ufds[i].fd, 0)))
-      continue;
-    show_msg(MSGDEBUG, "Have event checks for socks enabled socket %d\n",
-             conn->sockid);
-    conn->selectevents = ufds[i].events;
-    monitoring = 1;
+  if (timeout >= 0) {
+    limit.tv_sec = timeout / 1000;
+    limit.tv_nsec = (timeout % 1000) * 1000000;
   }
+  start_wait(&wait, WAIT_POLL, ((timeout >= 0) ? &limit : NULL), NULL);
 
-  if (!monitoring)
+  if ((rc = map_poll_events(&wait, ufds, nfds)) == 0)
     return (realpoll(ufds, nfds, timeout));
+  if (rc == -1)
+    return (-1);
 
-  /* This is our poll loop. In it we repeatedly call poll(). We
-   * pass select the same event list as provided by the caller except we
-   * modify the events for the sockets we're managing to get events
-   * we're interested in (while negotiating with the socks server). When
-   * events we're interested in happen we go off and process the result
-   * ourselves, without returning the events to the caller. The loop
-   * ends when an event which isn't one we need to handle occurs or
-   * the poll times out */
-  do {
-    /* Enable our sockets for the events WE want to hear about */
-    for (i = 0; i < nfds; i++) {
-      if (!(conn = find_socks_request(ufds[i].fd, 0)))
-        continue;
+  return (wait_events(&wait));
+}
 
-      /* We always want to know about socket exceptions but they're
-       * always returned (i.e they don't need to be in the list of
-       * wanted events to be returned by the kernel */
-      ufds[i].events = 0;
-
-      /* If we're waiting for a connect or to be able to send
-       * on a socket we want to get write events */
-      if ((conn->state == SENDING) || (conn->state == CONNECTING))
-        ufds[i].events |= POLLOUT;
-      /* If we're waiting to receive data we want to get
-       * read events */
-      if (conn->state == RECEIVING)
-        ufds[i].events |= POLLIN;
-    }
+#ifdef PPOLL_SIGNATURE
+int ppoll(PPOLL_SIGNATURE) {
+  struct eventwait wait;
+  int rc;
 
-    nevents = realpoll(ufds, nfds, timeout);
-    /* If there were no events we must have timed out or had an error */
-    if (nevents <= 0)
-      break;
+  tsocks_init();
 
-    /* Loop through all the sockets we're monitoring and see if
-     * any of them have had events */
-    for (conn = requests; conn != NULL; conn = nextconn) {
-      nextconn = conn->next;
-      if ((conn->state == FAILED) || (conn->state == DONE))
-        continue;
+  if (!__atomic_load_n(&nrequests, __ATOMIC_RELAXED))
+    return (realppoll(ufds, nfds, timeout, sigmask));
 
-      /* Find the socket in the poll list */
-      for (i = 0; ((i < nfds) && (ufds[i].fd != conn->sockid)); i++)
-        /* Empty Loop */;
-      if (i == nfds)
-        continue;
+  get_environment();
 
-      show_msg(MSGDEBUG, "Checking socket %d for events\n", conn->sockid);
+  reap_requests();
 
-      if (!ufds[i].revents) {
-        show_msg(MSGDEBUG, "No events on socket\n");
-        continue;
-      }
+  show_msg(MSGDEBUG,
+           "Intercepted call to ppoll with %d fds, "
+           "0x%08x timeout %08x\n",
+           nfds, ufds, timeout);
 
-      /* Clear any read or write events on the socket, we'll reset
-       * any that are necessary later. */
-      setevents = ufds[i].revents;
-      if (setevents & POLLIN) {
-        show_msg(MSGDEBUG, "Socket had read event\n");
-        ufds[i].revents &= ~POLLIN;
-        nevents--;
-      }
-      if (setevents & POLLOUT) {
-        show_msg(MSGDEBUG, "Socket had write event\n");
-        ufds[i].revents &= ~POLLOUT;
-        nevents--;
-      }
-      if (setevents & (POLLERR | POLLNVAL | POLLHUP))
-        show_msg(MSGDEBUG, "Socket had error event\n");
+  start_wait(&wait, WAIT_PPOLL, timeout, sigmask);
 
-      /* Now handle this event */
-      if (setevents & (POLLERR | POLLNVAL | POLLHUP)) {
-        conn->state = FAILED;
-      } else {
-         handle_request(conn);
-      }
-      /* If the connection hasn't failed or completed there is nothing
-       * to report to the client */
-      if ((conn->state != FAILED) && (conn->state != DONE))
-        continue;
+  if ((rc = map_poll_events(&wait, ufds, nfds)) == 0)
+    return (realppoll(ufds, nfds, timeout, sigmask));
+  if (rc == -1)
+    return (-1);
 
-      /* Ok, the connection is completed, for good or for bad. We now
-       * hand back the relevant events to the caller. We don't delete the
-       * connection though since the caller should call connect() to
-       * check the status, we delete it then */
+  return (wait_events(&wait));
+}
+#endif
+
+#ifdef USE_EPOLL
+int epoll_ctl(EPOLL_CTL_SIGNATURE) {
+  struct requestshard *shard;
+  struct connreq *conn;
+  int rc;
+
+  tsocks_init();
+
+  /* Sockets with unfinished requests are our business, and so are */
+  /* IPv4 stream sockets that aren't connected yet since programs   */
+  /* like nginx register sockets before connecting them. Once we've */
+  /* noted a registration changes to it are noted too               */
+  if ((!__atomic_load_n(&nrequests, __ATOMIC_RELAXED) ||
+       !has_socks_request(fd)) &&
+      ((op == EPOLL_CTL_ADD) ? !watchable_socket(fd)
+                             : !__atomic_load_n(&nwatches, __ATOMIC_RELAXED)))
+    return (realepoll_ctl(epfd, op, fd, event));
+
+  get_environment();
+
+  /* The registration is changed with the shard locked so it always */
+  /* matches the state the request was last left in                 */
+  shard = request_shard(fd);
+  pthread_mutex_lock(&(shard->lock));
+  conn = lookup_socks_request(fd);
+  if (conn && (conn->state != FAILED) && (conn->state != DONE))
+    rc = control_watch(shard, epfd, op, fd, event, conn->state,
+                       waiting_socket(conn));
+  else if (conn == NULL)
+    rc = note_watch(shard, epfd, op, fd, event);
+  else
+    rc = realepoll_ctl(epfd, op, fd, event);
+  pthread_mutex_unlock(&(shard->lock));
+
+  return (rc);
+}
+
+int epoll_wait(EPOLL_WAIT_SIGNATURE) {
+  tsocks_init();
+
+  return (wait_epoll(epfd, events, maxevents, timeout, NULL, 0));
+}
+
+#ifdef EPOLL_PWAIT_SIGNATURE
+int epoll_pwait(EPOLL_PWAIT_SIGNATURE) {
+  tsocks_init();
+
+  return (wait_epoll(epfd, events, maxevents, timeout, sigmask, 1));
+}
+#endif
+#endif
+
+int close(CLOSE_SIGNATURE) {
+  int rc;
+  struct connreq *conn;
+  struct requestshard *shard;
+
+  tsocks_init();
+
+  if (realclose == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: close\n");
+    return (-1);
+  }
+
+  show_msg(MSGDEBUG, "Call to close(%d)\n", fd);
+
+  /* If we have this fd in our request handling list we
+   * remove it now, that takes a lock but finding out it isn't
+   * one of ours doesn't. It's done before the real close so
+   * another thread can't be given the same fd in the meantime */
+  if (has_socks_request(fd)) {
+    shard = request_shard(fd);
+    pthread_mutex_lock(&(shard->lock));
+    if ((conn = lookup_socks_request(fd))) {
+      show_msg(MSGDEBUG,
+               "Call to close() received on file descriptor "
+               "%d which is a connection request of status %d\n",
+               conn->sockid, conn->state);
+      kill_socks_request(shard, conn);
+    }
+#ifdef USE_EPOLL
+    if (shard->watches)
+      update_watches(shard, fd, -1, fd);
+#endif
+    pthread_mutex_unlock(&(shard->lock));
+  }
+#ifdef USE_EPOLL
+  else if (__atomic_load_n(&nwatches, __ATOMIC_RELAXED)) {
+    shard = request_shard(fd);
+    pthread_mutex_lock(&(shard->lock));
+    drop_watches(shard, fd);
+    pthread_mutex_unlock(&(shard->lock));
+  }
+#endif
+
+  rc = realclose(fd);
+
+  return (rc);
+}
+
+#ifdef USE_SENDTO
+ssize_t sendto(SENDTO_SIGNATURE) {
+  struct iovec iov;
+  ssize_t sent;
+
+  tsocks_init();
+
+  if (realsendto == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: sendto\n");
+    return (-1);
+  }
+
+  /* Only fast open connections and sockets we have requests for */
+  /* are our business, everything else goes straight through    */
+  if (!(__flags & MSG_FASTOPEN) &&
+      (!__atomic_load_n(&nrequests, __ATOMIC_RELAXED) ||
+       !has_socks_request(__fd)))
+    return (realsendto(__fd, __buf, __n, __flags, __addr, __addr_len));
+
+  iov.iov_base = (void *)__buf;
+  iov.iov_len = __n;
+  if (intercept_send(__fd, &iov, 1, __flags, __addr, __addr_len, &sent))
+    return (realsendto(__fd, __buf, __n, __flags, __addr, __addr_len));
+
+  return (sent);
+}
+#endif
+
+#ifdef USE_SENDMSG
+ssize_t sendmsg(SENDMSG_SIGNATURE) {
+  ssize_t sent;
+
+  tsocks_init();
+
+  if (realsendmsg == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: sendmsg\n");
+    return (-1);
+  }
+
+  if (!(__flags & MSG_FASTOPEN) &&
+      (!__atomic_load_n(&nrequests, __ATOMIC_RELAXED) ||
+       !has_socks_request(__fd)))
+    return (realsendmsg(__fd, __message, __flags));
+
+  if (intercept_send(__fd, __message->msg_iov, __message->msg_iovlen,
+                     __flags, __message->msg_name, __message->msg_namelen,
+                     &sent))
+    return (realsendmsg(__fd, __message, __flags));
+
+  return (sent);
+}
+#endif
+
+#ifdef USE_OPTIMISTIC
+/* Reads only concern us when there might be a SOCKS server's reply */
+/* to read first, the rest go straight through                      */
+ssize_t read(READ_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realread == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: read\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realread(__fd, __buf, __nbytes));
+}
+
+ssize_t recv(RECV_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realrecv == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: recv\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realrecv(__fd, __buf, __n, __flags));
+}
+
+ssize_t recvfrom(RECVFROM_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realrecvfrom == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: recvfrom\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realrecvfrom(__fd, __buf, __n, __flags, __addr, __addr_len));
+}
+
+ssize_t recvmsg(RECVMSG_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realrecvmsg == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: recvmsg\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realrecvmsg(__fd, __message, __flags));
+}
+
+ssize_t readv(READV_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realreadv == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: readv\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realreadv(__fd, __iovec, __count));
+}
+
+int recvmmsg(RECVMMSG_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realrecvmmsg == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: recvmmsg\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realrecvmmsg(__fd, __vmessages, __vlen, __flags, __tmo));
+}
+
+/* Programs built with _FORTIFY_SOURCE call these instead of read(), */
+/* recv() and recvfrom() when they know the size of the buffer       */
+#ifdef READ_CHK_SIGNATURE
+ssize_t __read_chk(READ_CHK_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realread_chk == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: __read_chk\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realread_chk(__fd, __buf, __nbytes, __buflen));
+}
+#endif
+
+#ifdef RECV_CHK_SIGNATURE
+ssize_t __recv_chk(RECV_CHK_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realrecv_chk == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: __recv_chk\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realrecv_chk(__fd, __buf, __n, __buflen, __flags));
+}
+#endif
+
+#ifdef RECVFROM_CHK_SIGNATURE
+ssize_t __recvfrom_chk(RECVFROM_CHK_SIGNATURE) {
+  int rc;
+
+  tsocks_init();
+
+  if (realrecvfrom_chk == NULL) {
+    show_msg(MSGERR, "Unresolved symbol: __recvfrom_chk\n");
+    return (-1);
+  }
+
+  if (__atomic_load_n(&nreplies, __ATOMIC_RELAXED) &&
+      has_socks_request(__fd) && (rc = read_reply(__fd))) {
+    errno = rc;
+    return (-1);
+  }
+
+  return (realrecvfrom_chk(__fd, __buf, __n, __buflen, __flags, __addr,
+                          __addr_len));
+}
+#endif
+
+/* Read the SOCKS server's reply to a request on an optimistic path    */
+/* before the application reads the socket. Returns 0 once it's read   */
+/* (or if there was none to read), EAGAIN if it hasn't all arrived on  */
+/* a non blocking socket and ECONNRESET if the server refused the      */
+/* connection, the socket is shut down then as there's nothing more    */
+/* to come from it                                                     */
+static int read_reply(int sockid) {
+  struct connreq *conn;
+  int rc;
+
+  if ((conn = claim_socks_request(sockid, 1)) == NULL)
+    return (0);
+  if (!(conn->options & REQUEST_REPLYDUE)) {
+    release_socks_request(conn, 0);
+    return (0);
+  }
+
+  show_msg(MSGDEBUG, "Reading SOCKS server's reply for socket %d\n", sockid);
+  conn->options &= ~REQUEST_REPLYDUE;
+  conn->state = (connect_sent(conn->nextstate) ? conn->nextstate : RECEIVING);
+  rc = handle_request(conn);
+
+  if (rc == EWOULDBLOCK) {
+    park_request(conn);
+    release_socks_request(conn, 0);
+    return (EAGAIN);
+  }
+
+  if (conn->state == FAILED) {
+    show_msg(MSGDEBUG, "SOCKS server refused the connection for socket %d "
+                       "after it was reported made, resetting it\n",
+             sockid);
+    shutdown(sockid, SHUT_RDWR);
+    rc = ECONNRESET;
+  }
+  release_socks_request(conn, 1);
+
+  return (rc);
+}
+
+/* Tell the application its connection is made although the reply to */
+/* the connect request hasn't been read, it's read when the            */
+/* application first reads from the socket                            */
+static void park_request(struct connreq *conn) {
+  if (!(conn->options & REQUEST_OPTIMISTIC)) {
+    show_msg(MSGDEBUG, "Reporting socket %d connected before the SOCKS "
+                       "server replies\n",
+             conn->sockid);
+    conn->options |= REQUEST_OPTIMISTIC;
+    __atomic_add_fetch(&nreplies, 1, __ATOMIC_RELAXED);
+  }
+
+  conn->options |= REQUEST_REPLYDUE;
+  if (conn->state != RECEIVING)
+    conn->nextstate = conn->state;
+  conn->state = DONE;
+}
+#endif
+
+#if defined(USE_SENDTO) || defined(USE_SENDMSG)
+/* Open a connection the application started with sendto() or       */
+/* sendmsg() and MSG_FASTOPEN instead of connect(). The destination  */
+/* is routed like any other and the data goes to the SOCKS server    */
+/* straight after the connect request, in the same packet. Returns 1 */
+/* if the real call should be made instead, otherwise the result is  */
+/* in sent (with errno set if it's -1)                               */
+static int intercept_send(int sockid, const struct iovec *iov, int iovcnt,
+                          int flags, const struct sockaddr *addr,
+                          socklen_t addrlen, ssize_t *sent) {
+  struct sockaddr_in *connaddr = (struct sockaddr_in *)addr;
+  struct sockaddr_in peer_address;
+  struct sockaddr_in server_address;
+  socklen_t namelen = sizeof(peer_address);
+  int sock_type = -1;
+  socklen_t sock_type_len = sizeof(sock_type);
+  struct serverent *path;
+  struct connreq *newconn = NULL;
+  struct requestshard *shard;
+  struct parsedfile *current;
+  int verdict, rc, finished, i;
+  size_t len = 0, part;
+  char *extra;
+
+  get_environment();
+
+  /* Sending on a socket we're negotiating for has to wait until */
+  /* the negotiation is done, or fail the way it did             */
+  if (has_socks_request(sockid) && (rc = settle_request(sockid))) {
+    show_msg(MSGDEBUG, "Send on socket %d before its request finished, %s\n",
+             sockid, strerror(rc));
+    errno = rc;
+    *sent = -1;
+    return (0);
+  }
+
+  /* Anything but fast open to an INET address on an unconnected */
+  /* TCP socket is left to the real call                         */
+  if (!(flags & MSG_FASTOPEN) || (connaddr == NULL) ||
+      (addrlen < sizeof(*connaddr)) || (connaddr->sin_family != AF_INET))
+    return (1);
+  getsockopt(sockid, SOL_SOCKET, SO_TYPE, (void *)&sock_type, &sock_type_len);
+  if ((sock_type != SOCK_STREAM) ||
+      !getpeername(sockid, (struct sockaddr *)&peer_address, &namelen))
+    return (1);
+
+  show_msg(MSGDEBUG, "Got fast open request for socket %d to %s\n", sockid,
+           inet_ntoa(connaddr->sin_addr));
+
+  get_config();
+
+  reap_requests();
+
+  shard = request_shard(sockid);
+  current = enter_config(shard);
+  verdict = route_connection(current, connaddr, &path, &server_address);
+  if (verdict == CACHE_PROXY)
+    newconn = new_socks_request(sockid, connaddr, &server_address, path,
+                                current);
+  leave_config(shard);
+
+  if (verdict == CACHE_LOCAL) {
+    show_msg(MSGDEBUG, "Connection for socket %d is local\n", sockid);
+    return (1);
+  }
+
+  if (!newconn) {
+    errno = ECONNREFUSED;
+    *sent = -1;
+    return (0);
+  }
+
+  /* Take as much of the data as fits at the end of the buffer, like */
+  /* the kernel we may take less than we're given                    */
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (len > CONNREQ_MAXEXTRA)
+    len = CONNREQ_MAXEXTRA;
+  if (size_buffer(newconn, CONNREQ_MAXBUF)) {
+    release_socks_request(newconn, 1);
+    errno = ENOMEM;
+    *sent = -1;
+    return (0);
+  }
+  extra = newconn->buffer + CONNREQ_MAXBUF - len;
+  for (i = 0; (i < iovcnt) && (extra < newconn->buffer + CONNREQ_MAXBUF);
+       i++) {
+    part = iov[i].iov_len;
+    if (part > (size_t)(newconn->buffer + CONNREQ_MAXBUF - extra))
+      part = newconn->buffer + CONNREQ_MAXBUF - extra;
+    memcpy(extra, iov[i].iov_base, part);
+    extra += part;
+  }
+  newconn->extralen = len;
+  newconn->options |= REQUEST_NOCONNECT;
+
+  rc = handle_request(newconn);
+  finished = ((newconn->state == FAILED) || (newconn->state == DONE));
+  release_socks_request(newconn, finished);
+
+  /* The data is as good as sent once it's in the request, a non */
+  /* blocking socket carries on without the application          */
+  if (rc && (rc != EWOULDBLOCK)) {
+    errno = rc;
+    *sent = -1;
+  } else
+    *sent = len;
+
+  return (0);
+}
+
+/* Bring the request for a socket as far along as it will go, returning */
+/* 0 if it's done (or gone), EAGAIN if it's still going or the error it */
+/* failed with                                                          */
+static int settle_request(int sockid) {
+  struct connreq *conn;
+  int rc = 0;
+
+  if ((conn = claim_socks_request(sockid, 1)) == NULL)
+    return (has_socks_request(sockid) ? EAGAIN : 0);
+
+  if ((conn->state != FAILED) && (conn->state != DONE) &&
+      (handle_request(conn) == EWOULDBLOCK))
+    rc = EAGAIN;
+  if (conn->state == FAILED)
+    rc = conn->err;
+  release_socks_request(conn, 0);
+
+  return (rc);
+}
+#endif
+
+static struct connreq *new_socks_request(int sockid,
+                                         struct sockaddr_in *connaddr,
+                                         struct sockaddr_in *serveraddr,
+                                         struct serverent *path,
+                                         struct parsedfile *current) {
+  struct requestshard *shard = request_shard(sockid);
+  struct requestpage *page;
+  struct connreq *newconn;
+  int slot = sockid & (REQUEST_PAGESIZE - 1);
+
+  if ((page = request_page(sockid, 1)) == NULL) {
+    show_msg(MSGERR, "Could not allocate memory for new socks request\n");
+    return (NULL);
+  }
+
+  pthread_mutex_lock(&(shard->lock));
+  if ((newconn = alloc_request(shard)) == NULL) {
+    /* Could not malloc, we're stuffed */
+    pthread_mutex_unlock(&(shard->lock));
+    show_msg(MSGERR, "Could not allocate memory for new socks request\n");
+    return (NULL);
+  }
+
+  /* A stale request for the same socket can't be found any more */
+  if (page->conns[slot])
+    kill_socks_request(shard, page->conns[slot]);
+
+  /* Add this connection to be proxied to the table, it's handed */
+  /* back busy for the caller to start on                        */
+  memset(newconn, 0x0, sizeof(*newconn));
+  newconn->buffer = newconn->inlinebuf;
+  newconn->sockid = sockid;
+  newconn->state = UNSTARTED;
+  newconn->flags = REQUEST_BUSY;
+  newconn->path = path;
+  newconn->config = current;
+  __atomic_add_fetch(&(current->refcount), 1, __ATOMIC_ACQ_REL);
+  memcpy(&(newconn->connaddr), connaddr, sizeof(newconn->connaddr));
+  memcpy(&(newconn->serveraddr), serveraddr, sizeof(newconn->serveraddr));
+  page->conns[slot] = newconn;
+  __atomic_or_fetch(&(page->bits[slot / REQUEST_WORDBITS]), REQUEST_BIT(slot),
+                    __ATOMIC_RELEASE);
+  __atomic_add_fetch(&nrequests, 1, __ATOMIC_RELAXED);
+#ifdef USE_EPOLL
+  /* Registrations the application made before connecting are taken */
+  /* over now, before it can hear about the socket                   */
+  if (shard->watches)
+    update_watches(shard, sockid, newconn->state, sockid);
+#endif
+  pthread_mutex_unlock(&(shard->lock));
+
+  return (newconn);
+}
+
+/* Take a request out of the table, the shard must be locked. If */
+/* another thread is busy with it that thread frees it later      */
+static void kill_socks_request(struct requestshard *shard,
+                               struct connreq *conn) {
+  struct requestpage *page = request_page(conn->sockid, 0);
+  int slot = conn->sockid & (REQUEST_PAGESIZE - 1);
+
+  page->conns[slot] = NULL;
+  __atomic_and_fetch(&(page->bits[slot / REQUEST_WORDBITS]),
+                     ~REQUEST_BIT(slot), __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&nrequests, 1, __ATOMIC_RELAXED);
+  if (conn->options & REQUEST_OPTIMISTIC)
+    __atomic_sub_fetch(&nreplies, 1, __ATOMIC_RELAXED);
+
+  if (conn->reaptime)
+    unqueue_reap(shard, conn);
+  if (conn->flags & REQUEST_BUSY)
+    conn->flags |= REQUEST_DEAD;
+  else
+    free_request(shard, conn);
+}
+
+static struct requestshard *request_shard(int sockid) {
+
+  return (&(requestshards[sockid % REQUEST_SHARDS]));
+}
+
+/* Find the page of the request table a socket is in, allocating it */
+/* if create is set. Returns NULL if there isn't one                */
+static struct requestpage *request_page(int sockid, int create) {
+  struct requestpage *page, *newpage, **dir;
+  int pageno = sockid >> REQUEST_PAGEBITS;
+  int count;
+
+  if ((sockid < 0) || ((dir = request_dir(pageno, create)) == NULL))
+    return (NULL);
+
+  page = __atomic_load_n(&(dir[pageno & (REQUEST_DIRSIZE - 1)]),
+                         __ATOMIC_ACQUIRE);
+  if (page || !create)
+    return (page);
+
+  /* If another thread adds the page first we use theirs */
+  if ((newpage = calloc(1, sizeof(*newpage))) == NULL)
+    return (NULL);
+  if (!__atomic_compare_exchange_n(&(dir[pageno & (REQUEST_DIRSIZE - 1)]),
+                                   &page, newpage, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    free(newpage);
+    return (page);
+  }
+  count = __atomic_load_n(&requestpagecount, __ATOMIC_RELAXED);
+  while ((count <= pageno) &&
+         !__atomic_compare_exchange_n(&requestpagecount, &count, pageno + 1,
+                                      0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  return (newpage);
+}
+
+/* Find the directory a page of the request table is in, allocating */
+/* it if create is set. Returns NULL if there isn't one              */
+static struct requestpage **request_dir(int pageno, int create) {
+  struct requestpage **dir, **newdir;
+  int dirno = pageno >> REQUEST_DIRBITS;
+
+  if (dirno >= REQUEST_DIRS)
+    return (NULL);
+
+  dir = __atomic_load_n(&(requestdirs[dirno]), __ATOMIC_ACQUIRE);
+  if (dir || !create)
+    return (dir);
+
+  if ((newdir = calloc(REQUEST_DIRSIZE, sizeof(*newdir))) == NULL)
+    return (NULL);
+  if (!__atomic_compare_exchange_n(&(requestdirs[dirno]), &dir, newdir, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(newdir);
+    return (dir);
+  }
+
+  return (newdir);
+}
+
+/* See whether a socket has a request without taking any lock, most */
+/* sockets (and every file) that reach close() aren't ours           */
+static int has_socks_request(int sockid) {
+  struct requestpage *page;
+  int slot = sockid & (REQUEST_PAGESIZE - 1);
+
+  if ((page = request_page(sockid, 0)) == NULL)
+    return (0);
+
+  return ((__atomic_load_n(&(page->bits[slot / REQUEST_WORDBITS]),
+                           __ATOMIC_ACQUIRE) &
+           REQUEST_BIT(slot)) != 0);
+}
+
+/* Look up the request for a socket, its shard must be locked */
+static struct connreq *lookup_socks_request(int sockid) {
+  struct requestpage *page;
+
+  if ((page = request_page(sockid, 0)) == NULL)
+    return (NULL);
+
+  return (page->conns[sockid & (REQUEST_PAGESIZE - 1)]);
+}
+
+/* Find the request for a socket and mark it busy, so the caller can */
+/* work on it without holding the shard lock. Finished requests are  */
+/* only returned if includefinished is set, and none is returned if  */
+/* another thread is busy with it                                    */
+static struct connreq *claim_socks_request(int sockid, int includefinished) {
+  struct requestshard *shard;
+  struct connreq *conn;
+
+  if (!has_socks_request(sockid))
+    return (NULL);
+
+  shard = request_shard(sockid);
+  pthread_mutex_lock(&(shard->lock));
+  conn = lookup_socks_request(sockid);
+  if (conn && ((conn->flags & REQUEST_BUSY) ||
+               (((conn->state == FAILED) || (conn->state == DONE)) &&
+                !includefinished)))
+    conn = NULL;
+  if (conn)
+    conn->flags |= REQUEST_BUSY;
+  pthread_mutex_unlock(&(shard->lock));
+
+  return (conn);
+}
+
+/* Finish working on a request. It's killed if asked, otherwise if it */
+/* has finished it waits to be reaped in case nobody collects it      */
+static void release_socks_request(struct connreq *conn, int kill) {
+  struct requestshard *shard = request_shard(conn->sockid);
+
+  /* A reply still to be read keeps the request until it's read */
+  if (conn->options & REQUEST_REPLYDUE)
+    kill = 0;
+
+  pthread_mutex_lock(&(shard->lock));
+  conn->flags &= ~REQUEST_BUSY;
+#ifdef USE_EPOLL
+  /* A dead request's socket was closed, and its number may have been */
+  /* reused, close() has already dealt with its registrations          */
+  if (shard->watches && !(conn->flags & REQUEST_DEAD))
+    update_watches(shard, conn->sockid, (kill ? -1 : conn->state),
+                   waiting_socket(conn));
+#endif
+  if (conn->flags & REQUEST_DEAD)
+    free_request(shard, conn);
+  else if (kill)
+    kill_socks_request(shard, conn);
+  else if (((conn->state == FAILED) || (conn->state == DONE)) &&
+           !(conn->options & REQUEST_REPLYDUE))
+    queue_reap(shard, conn);
+  pthread_mutex_unlock(&(shard->lock));
+}
+
+/* Get the state of a socket's request, or -1 if it hasn't one */
+static int request_state(int sockid) {
+  struct requestshard *shard;
+  struct connreq *conn;
+  int state = -1;
+
+  if (!has_socks_request(sockid))
+    return (-1);
+
+  shard = request_shard(sockid);
+  pthread_mutex_lock(&(shard->lock));
+  if ((conn = lookup_socks_request(sockid)))
+    state = conn->state;
+  pthread_mutex_unlock(&(shard->lock));
+
+  return (state);
+}
+
+/* Get the state of a socket's request like request_state(), and the */
+/* descriptor its events come on                                     */
+static int request_watch(int sockid, int *waitfd) {
+  struct requestshard *shard;
+  struct connreq *conn;
+  int state = -1;
+
+  *waitfd = sockid;
+  if (!has_socks_request(sockid))
+    return (-1);
+
+  shard = request_shard(sockid);
+  pthread_mutex_lock(&(shard->lock));
+  if ((conn = lookup_socks_request(sockid))) {
+    state = conn->state;
+    *waitfd = waiting_socket(conn);
+  }
+  pthread_mutex_unlock(&(shard->lock));
+
+  return (state);
+}
+
+/* Find the lowest socket above sockid with a request, so they can */
+/* all be visited in order starting with sockid -1. Returns -1 once */
+/* there are no more                                                */
+static int next_socks_socket(int sockid) {
+  struct requestpage *page;
+  unsigned long word;
+  int pages, pageno, slot, i;
+
+  pages = __atomic_load_n(&requestpagecount, __ATOMIC_ACQUIRE);
+  sockid++;
+  slot = sockid & (REQUEST_PAGESIZE - 1);
+  for (pageno = sockid >> REQUEST_PAGEBITS; pageno < pages;
+       pageno++, slot = 0) {
+    /* A missing directory is passed over whole */
+    if (request_dir(pageno, 0) == NULL) {
+      pageno |= REQUEST_DIRSIZE - 1;
+      continue;
+    }
+    if ((page = request_page(pageno << REQUEST_PAGEBITS, 0)) == NULL)
+      continue;
+    for (i = slot / REQUEST_WORDBITS; i < REQUEST_PAGESIZE / REQUEST_WORDBITS;
+         i++) {
+      word = __atomic_load_n(&(page->bits[i]), __ATOMIC_ACQUIRE);
+      if (i == slot / REQUEST_WORDBITS)
+        word &= ~0UL << (slot % REQUEST_WORDBITS);
+      if (word)
+        return ((pageno << REQUEST_PAGEBITS) + i * REQUEST_WORDBITS +
+                __builtin_ctzl(word));
+    }
+  }
+
+  return (-1);
+}
+
+/* Work out which events select() was asked for on a socket, as the */
+/* poll() events they correspond to                                 */
+static int selected_events(int sockid, fd_set *readfds, fd_set *writefds,
+                           fd_set *exceptfds) {
+  int events = 0;
+
+  if (writefds && FD_ISSET(sockid, writefds))
+    events |= POLLOUT;
+  if (readfds && FD_ISSET(sockid, readfds))
+    events |= POLLIN;
+  if (exceptfds && FD_ISSET(sockid, exceptfds))
+    events |= POLLPRI;
+
+  return (events);
+}
+
+/* Set up to wait for events, timeout is relative and NULL to wait */
+/* for ever                                                         */
+static void start_wait(struct eventwait *wait, int type,
+                       const struct timespec *timeout,
+                       const sigset_t *sigmask) {
+  wait->type = type;
+  wait->sigmask = sigmask;
+  wait->selecttimeout = NULL;
+  wait->nmapped = 0;
+  wait->mapsize = POLL_MAPSIZE;
+  wait->map = wait->stackmap;
+
+  if (!(wait->forever = (timeout == NULL)))
+    set_deadline(&(wait->deadline), timeout);
+}
+
+/* Note a socket with an unfinished request, returns -1 (and frees */
+/* the map) if there is no memory to note it                       */
+static int map_entry(struct eventwait *wait, int index, int sockid,
+                     short events) {
+  struct pollentry *newmap;
+
+  if (wait->nmapped == wait->mapsize) {
+    wait->mapsize *= 2;
+    if (wait->map == wait->stackmap) {
+      if ((newmap = malloc(sizeof(*newmap) * wait->mapsize)))
+        memcpy(newmap, wait->stackmap, sizeof(wait->stackmap));
+    } else {
+      newmap = realloc(wait->map, sizeof(*newmap) * wait->mapsize);
+    }
+    if (newmap == NULL) {
+      if (wait->map != wait->stackmap)
+        free(wait->map);
+      errno = ENOMEM;
+      return (-1);
+    }
+    wait->map = newmap;
+  }
+  wait->map[wait->nmapped].index = index;
+  wait->map[wait->nmapped].sockid = sockid;
+  wait->map[wait->nmapped].events = events;
+  wait->nmapped++;
+
+  return (0);
+}
+
+/* Find the sockets select() was passed that have unfinished requests, */
+/* returns how many there are or -1 on error                           */
+static int map_select_events(struct eventwait *wait, int n, fd_set *readfds,
+                             fd_set *writefds, fd_set *exceptfds) {
+  int sockid, state, events;
+
+  if (n > FD_SETSIZE)
+    n = FD_SETSIZE;
+  wait->n = n;
+  wait->callerfds[0] = readfds;
+  wait->callerfds[1] = writefds;
+  wait->callerfds[2] = exceptfds;
+
+  /* The events the caller selected our sockets for are worked out */
+  /* from its fd_sets each time, other threads may be selecting on  */
+  /* other sockets at the same time                                 */
+  for (sockid = next_socks_socket(-1); (sockid != -1) && (sockid < n);
+       sockid = next_socks_socket(sockid)) {
+    if (!(events = selected_events(sockid, readfds, writefds, exceptfds)))
+      continue;
+    state = request_state(sockid);
+    if ((state == -1) || (state == FAILED) || (state == DONE))
+      continue;
+    show_msg(MSGDEBUG, "Socket %d was set for events\n", sockid);
+    if (map_entry(wait, sockid, sockid, events))
+      return (-1);
+  }
+
+  return (wait->nmapped);
+}
+
+/* Find the entries poll() was passed for sockets with unfinished */
+/* requests. This is the only pass over the whole array, after     */
+/* this only these entries are looked at                           */
+static int map_poll_events(struct eventwait *wait, struct pollfd *ufds,
+                           unsigned long nfds) {
+  unsigned long i;
+  int state;
+
+  wait->ufds = ufds;
+  wait->nfds = nfds;
+
+  for (i = 0; i < nfds; i++) {
+    if (!has_socks_request(ufds[i].fd))
+      continue;
+    state = request_state(ufds[i].fd);
+    if ((state == -1) || (state == FAILED) || (state == DONE))
+      continue;
+    show_msg(MSGDEBUG, "Have event checks for socks enabled socket %d\n",
+             ufds[i].fd);
+    if (map_entry(wait, i, ufds[i].fd, ufds[i].events))
+      return (-1);
+  }
+
+  return (wait->nmapped);
+}
+
+/* This is our event loop, shared by select(), pselect(), poll() and
+ * ppoll(). In it we repeatedly call the real function. We pass it the
+ * same events as provided by the caller except we modify the events for
+ * the sockets we're managing to get events we're interested in (while
+ * negotiating with the socks server). When events we're interested in
+ * happen we go off and process the result ourselves, without returning
+ * the events to the caller. The loop ends when an event which isn't one
+ * we need to handle occurs or the caller's timeout runs out */
+static int wait_events(struct eventwait *wait) {
+  struct pollentry *entry;
+  struct connreq *conn;
+  int nevents, setevents, i;
+
+  do {
+    watch_events(wait);
+
+    nevents = real_wait(wait);
+    /* If there were no events we must have timed out or had an error, */
+    /* unless we only stopped to see to the races                      */
+    if ((nevents < 0) || ((nevents == 0) && !wait->ticked))
+      break;
+
+    /* Loop through the sockets we're monitoring and see if any of */
+    /* them have had events                                        */
+    for (i = 0; i < wait->nmapped; i++) {
+      entry = &(wait->map[i]);
+      if (!entry->watching)
+        continue;
+      /* Whatever happens these events were ours, not the caller's */
+      if (!(setevents = take_events(wait, entry, &nevents)))
+        continue;
+
+      if (!(conn = claim_socks_request(entry->sockid, 0)))
+        continue;
+
+      show_msg(MSGDEBUG, "Checking socket %d for events\n", conn->sockid);
+
+      if (setevents & POLLIN)
+        show_msg(MSGDEBUG, "Socket had read event\n");
+      if (setevents & POLLOUT)
+        show_msg(MSGDEBUG, "Socket had write event\n");
+      if (setevents & (POLLPRI | POLLERR | POLLNVAL | POLLHUP))
+        show_msg(MSGDEBUG, "Socket had error event\n");
+
+      /* Now handle this event */
+      if (setevents & (POLLPRI | POLLERR | POLLNVAL | POLLHUP)) {
+        fail_request(conn);
+      } else {
+        handle_request(conn);
+      }
+      /* If the connection hasn't failed or completed there is nothing
+       * to report to the client */
+      if ((conn->state != FAILED) && (conn->state != DONE)) {
+        release_socks_request(conn, 0);
+        continue;
+      }
+
+      /* Ok, the connection is completed, for good or for bad. We now
+       * hand back the relevant events to the caller. We don't delete the
+       * connection though since the caller should call connect() to
+       * check the status, we delete it then (or once it has waited
+       * CONNREQ_GRACE seconds for a caller that never asks) */
 
       if (conn->state == FAILED) {
-        /* Damn, the connection failed. Just copy back the error events
-         * from the poll call, error events are always valid even if not
-         * requested by the client */
+        /* Damn, the connection failed. Copy back the error events,
+         * error events are always valid even if not requested by the
+         * client, and flag whatever events the socket was waited on
+         * for */
         /* We should use setsockopt to set the SO_ERROR errno for this
          * socket, but this isn't allowed for some silly reason which
          * leaves us a bit hamstrung.
          * We don't delete the request so that hopefully we can
          * return the error on the socket if they call connect() on it */
+        give_events(wait, entry,
+                    (setevents & (POLLERR | POLLNVAL | POLLHUP)) |
+                        (entry->events & (POLLIN | POLLOUT | POLLPRI)),
+                    &nevents);
       } else {
-        /* The connection is done,  if the client polled for
+        /* The connection is done, if the client waited for
          * writing we can go ahead and signal that now (since the socket must
-         * be ready for writing), otherwise we'll just let the select loop
+         * be ready for writing), otherwise we'll just let the loop
          * come around again (since we can't flag it for read, we don't know
          * if there is any data to be read and can't be bothered checking) */
-        if (conn->selectevents & WRITE) {
-          setevents |= POLLOUT;
-          nevents++;
-        }
+        give_events(wait, entry, entry->events & POLLOUT, &nevents);
+      }
+      release_socks_request(conn, 0);
+    }
+
+    if (ticking())
+      run_races();
+  } while (nevents == 0);
+
+  show_msg(MSGDEBUG, "Finished waiting for events, %d events\n", nevents);
+
+  finish_wait(wait);
+
+  return (nevents);
+}
+
+/* Set up the events to wait for, the caller's except on the sockets */
+/* we're negotiating on, which wait for the events WE want to hear   */
+/* about. Once a request has finished its socket goes back to what   */
+/* the caller asked for. A socket waiting for the broker has nothing */
+/* to wait for, poll() waits on the broker's descriptor in its place */
+/* and select() leaves it to run_races() every RACE_TICK              */
+static void watch_events(struct eventwait *wait) {
+  struct pollentry *entry;
+  int state, sockid, waitfd, want, i;
+
+  /* Copy the clients fd events, we'll change them as we wish */
+  if (!WAIT_POLLING(wait)) {
+    for (i = 0; i < 3; i++) {
+      if (wait->callerfds[i])
+        memcpy(&(wait->fds[i]), wait->callerfds[i], FDSET_BYTES(wait->n));
+      else
+        memset(&(wait->fds[i]), 0, FDSET_BYTES(wait->n));
+    }
+  }
+
+  for (i = 0; i < wait->nmapped; i++) {
+    entry = &(wait->map[i]);
+    sockid = entry->sockid;
+    state = request_watch(sockid, &waitfd);
+    entry->watching = ((state != -1) && (state != FAILED) &&
+                       (state != DONE));
+    if (!entry->watching) {
+      if (WAIT_POLLING(wait)) {
+        wait->ufds[entry->index].fd = sockid;
+        wait->ufds[entry->index].events = entry->events;
       }
+      continue;
+    }
+
+    /* If we're waiting for a connect or to be able to send
+     * on a socket we want to get write events, if we're waiting
+     * to receive data we want to get read events */
+    want = 0;
+    if ((state == SENDING) || (state == CONNECTING))
+      want = POLLOUT;
+    else if ((state == RECEIVING) || (state == BROKERING))
+      want = POLLIN;
+
+    if (WAIT_POLLING(wait)) {
+      /* Exceptions are always returned by poll(), they don't need */
+      /* to be asked for                                           */
+      wait->ufds[entry->index].fd = waitfd;
+      wait->ufds[entry->index].events = want;
+      continue;
+    }
+    if (state == BROKERING)
+      want = 0;
+
+    /* We always want to know about socket exceptions */
+    FD_SET(sockid, &(wait->fds[2]));
+    if (want & POLLOUT)
+      FD_SET(sockid, &(wait->fds[1]));
+    else
+      FD_CLR(sockid, &(wait->fds[1]));
+    if (want & POLLIN)
+      FD_SET(sockid, &(wait->fds[0]));
+    else
+      FD_CLR(sockid, &(wait->fds[0]));
+  }
+}
+
+/* Call the real function the caller called, for whatever is left   */
+/* of its timeout, or RACE_TICK if that's sooner and any of the     */
+/* caller's sockets may be racing servers or waiting for the broker */
+static int real_wait(struct eventwait *wait) {
+  struct timespec left, *leftp = NULL;
+  struct timeval tv, *tvp = NULL;
+  int ms = -1;
+
+  if (!wait->forever)
+    time_left(&(wait->deadline), &left);
+  wait->ticked =
+      (wait->nmapped && ticking() &&
+       (wait->forever || left.tv_sec || (left.tv_nsec > RACE_TICK * 1000000)));
+  if (wait->ticked) {
+    left.tv_sec = 0;
+    left.tv_nsec = RACE_TICK * 1000000;
+  }
+
+  if (!wait->forever || wait->ticked) {
+    leftp = &left;
+    tv.tv_sec = left.tv_sec;
+    if ((tv.tv_usec = (left.tv_nsec + 999) / 1000) == 1000000) {
+      tv.tv_sec++;
+      tv.tv_usec = 0;
+    }
+    tvp = &tv;
+    ms = ((left.tv_sec >= INT_MAX / 1000 - 1)
+              ? INT_MAX
+              : (left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000));
+  }
+
+  switch (wait->type) {
+  case WAIT_SELECT:
+    return (realselect(wait->n, &(wait->fds[0]), &(wait->fds[1]),
+                       &(wait->fds[2]), tvp));
+#ifdef PSELECT_SIGNATURE
+  case WAIT_PSELECT:
+    return (realpselect(wait->n, &(wait->fds[0]), &(wait->fds[1]),
+                        &(wait->fds[2]), leftp, wait->sigmask));
+#endif
+  case WAIT_POLL:
+    return (realpoll(wait->ufds, wait->nfds, ms));
+#ifdef PPOLL_SIGNATURE
+  case WAIT_PPOLL:
+    return (realppoll(wait->ufds, wait->nfds, leftp, wait->sigmask));
+#endif
+  }
+
+  errno = ENOSYS;
+  return (-1);
+}
+
+/* Work out the CLOCK_MONOTONIC time a relative timeout runs out */
+static void set_deadline(struct timespec *deadline,
+                         const struct timespec *timeout) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeout->tv_sec;
+  deadline->tv_nsec += timeout->tv_nsec;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+/* Work out how long is left until the deadline, or 0 if it's passed */
+static void time_left(const struct timespec *deadline, struct timespec *left) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  left->tv_sec = deadline->tv_sec - now.tv_sec;
+  left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+  if (left->tv_nsec < 0) {
+    left->tv_sec--;
+    left->tv_nsec += 1000000000;
+  }
+  if (left->tv_sec < 0) {
+    left->tv_sec = 0;
+    left->tv_nsec = 0;
+  }
+}
+
+/* Remove the events that happened on one of our sockets from what */
+/* the caller will see, returning them as poll() events            */
+static int take_events(struct eventwait *wait, struct pollentry *entry,
+                       int *nevents) {
+  int events = 0;
+
+  if (WAIT_POLLING(wait)) {
+    events = wait->ufds[entry->index].revents;
+    wait->ufds[entry->index].revents = 0;
+    if (events)
+      (*nevents)--;
+    return (events);
+  }
+
+  if (FD_ISSET(entry->index, &(wait->fds[0]))) {
+    events |= POLLIN;
+    FD_CLR(entry->index, &(wait->fds[0]));
+    (*nevents)--;
+  }
+  if (FD_ISSET(entry->index, &(wait->fds[1]))) {
+    events |= POLLOUT;
+    FD_CLR(entry->index, &(wait->fds[1]));
+    (*nevents)--;
+  }
+  if (FD_ISSET(entry->index, &(wait->fds[2]))) {
+    events |= POLLPRI;
+    FD_CLR(entry->index, &(wait->fds[2]));
+    (*nevents)--;
+  }
+
+  return (events);
+}
+
+/* Report poll() events on one of our sockets to the caller */
+static void give_events(struct eventwait *wait, struct pollentry *entry,
+                        int events, int *nevents) {
+  if (WAIT_POLLING(wait)) {
+    wait->ufds[entry->index].revents = events;
+    if (events)
+      (*nevents)++;
+    return;
+  }
+
+  if (events & POLLIN) {
+    FD_SET(entry->index, &(wait->fds[0]));
+    (*nevents)++;
+  }
+  if (events & POLLOUT) {
+    FD_SET(entry->index, &(wait->fds[1]));
+    (*nevents)++;
+  }
+  if (events & POLLPRI) {
+    FD_SET(entry->index, &(wait->fds[2]));
+    (*nevents)++;
+  }
+}
+
+/* Hand the results back to the caller. select() gets our copies of */
+/* its fd_sets (and like Linux, what's left of its timeout), poll()  */
+/* gets back the events it asked for on the entries we changed       */
+static void finish_wait(struct eventwait *wait) {
+  struct timespec left;
+  int i;
+
+  if (WAIT_POLLING(wait)) {
+    for (i = 0; i < wait->nmapped; i++) {
+      wait->ufds[wait->map[i].index].fd = wait->map[i].sockid;
+      wait->ufds[wait->map[i].index].events = wait->map[i].events;
+    }
+  } else {
+    for (i = 0; i < 3; i++) {
+      if (wait->callerfds[i])
+        memcpy(wait->callerfds[i], &(wait->fds[i]), FDSET_BYTES(wait->n));
+    }
+    if (wait->selecttimeout) {
+      time_left(&(wait->deadline), &left);
+      wait->selecttimeout->tv_sec = left.tv_sec;
+      wait->selecttimeout->tv_usec = left.tv_nsec / 1000;
+    }
+  }
+
+  if (wait->map != wait->stackmap)
+    free(wait->map);
+}
+
+#ifdef USE_EPOLL
+/* Whether a socket could yet be connected through a SOCKS server, an */
+/* IPv4 stream socket that isn't connected. Connected sockets and     */
+/* things that aren't sockets are ruled out by the first call         */
+static int watchable_socket(int sockid) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int type;
+
+  if ((getpeername(sockid, (struct sockaddr *)&addr, &len) == 0) ||
+      (errno != ENOTCONN))
+    return (0);
+
+  len = sizeof(type);
+  if ((getsockopt(sockid, SOL_SOCKET, SO_TYPE, &type, &len) != 0) ||
+      (type != SOCK_STREAM))
+    return (0);
+
+  len = sizeof(addr);
+  if ((getsockname(sockid, (struct sockaddr *)&addr, &len) != 0) ||
+      (addr.sin_family != AF_INET))
+    return (0);
+
+  return (1);
+}
+
+/* Find where a socket's registration with an epoll instance is, or */
+/* would be, in a shard's list. The shard must be locked            */
+static struct epollwatch **find_watch(struct requestshard *shard, int epfd,
+                                      int sockid) {
+  struct epollwatch **wp;
+
+  for (wp = &(shard->watches);
+       (*wp) && (((*wp)->epfd != epfd) || ((*wp)->sockid != sockid));
+       wp = &((*wp)->next))
+    ;
+
+  return (wp);
+}
+
+/* Make an application's epoll registration for a socket without a */
+/* request and note it, so it can be taken over if the socket's     */
+/* connected through a SOCKS server. The shard must be locked       */
+static int note_watch(struct requestshard *shard, int epfd, int op, int fd,
+                      struct epoll_event *event) {
+  struct epollwatch **wp, *watch;
+
+  if (realepoll_ctl(epfd, op, fd, event) == -1)
+    return (-1);
+
+  wp = find_watch(shard, epfd, fd);
+  if (((op != EPOLL_CTL_ADD) && (op != EPOLL_CTL_MOD)) || (event == NULL)
+#ifdef EPOLLEXCLUSIVE
+      || (event->events & EPOLLEXCLUSIVE)
+#endif
+  ) {
+    if ((watch = *wp)) {
+      *wp = watch->next;
+      free(watch);
+      __atomic_sub_fetch(&nwatches, 1, __ATOMIC_RELAXED);
+    }
+    return (0);
+  }
+
+  /* Without memory to note it the registration just won't be */
+  /* taken over                                                */
+  if ((watch = *wp) == NULL) {
+    if ((watch = malloc(sizeof(*watch))) == NULL)
+      return (0);
+    watch->epfd = epfd;
+    watch->sockid = fd;
+    watch->next = shard->watches;
+    shard->watches = watch;
+    __atomic_add_fetch(&nwatches, 1, __ATOMIC_RELAXED);
+  }
+  watch->event = *event;
+
+  return (0);
+}
+
+/* Forget the registrations noted for a socket without a request, */
+/* it's being closed or connected directly. The shard must be      */
+/* locked                                                          */
+static void drop_watches(struct requestshard *shard, int sockid) {
+  struct epollwatch **wp, *watch;
+
+  for (wp = &(shard->watches); (watch = *wp);) {
+    if (watch->sockid != sockid) {
+      wp = &(watch->next);
+      continue;
+    }
+    *wp = watch->next;
+    free(watch);
+    __atomic_sub_fetch(&nwatches, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* Take over (or let go of) an application's epoll registration for a */
+/* socket with an unfinished request, the shard must be locked. The    */
+/* registration we make is for waitfd, the descriptor the request's    */
+/* events come on                                                      */
+static int control_watch(struct requestshard *shard, int epfd, int op,
+                         int fd, struct epoll_event *event, int state,
+                         int waitfd) {
+  struct epollwatch **wp, *watch, *newwatch = NULL;
+  struct epoll_event ours;
+  int rc;
+
+  wp = find_watch(shard, epfd, fd);
+  if (op == EPOLL_CTL_DEL) {
+    if ((watch = *wp)) {
+      *wp = watch->next;
+      free(watch);
+      __atomic_sub_fetch(&nwatches, 1, __ATOMIC_RELAXED);
+    }
+    rc = realepoll_ctl(epfd, op, fd, event);
+    /* A socket waiting for the broker may have been taken out of the */
+    /* epoll instance already, with the broker's descriptor put in    */
+    if (waitfd != fd) {
+      realepoll_ctl(epfd, op, waitfd, event);
+      if (watch)
+        rc = 0;
+    }
+    return (rc);
+  }
+
+  if (((op != EPOLL_CTL_ADD) && (op != EPOLL_CTL_MOD)) || (event == NULL))
+    return (realepoll_ctl(epfd, op, fd, event));
+#ifdef EPOLLEXCLUSIVE
+  /* Exclusive registrations can't be modified, so we can't take */
+  /* them over                                                   */
+  if (event->events & EPOLLEXCLUSIVE)
+    return (realepoll_ctl(epfd, op, fd, event));
+#endif
+
+  if ((*wp == NULL) && ((newwatch = malloc(sizeof(*newwatch))) == NULL)) {
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  ours.events = watch_interest(state);
+  ours.data.u64 = EPOLL_TAG | (uint32_t)fd;
+  if (waitfd != fd) {
+    realepoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    set_watch(epfd, waitfd, &ours);
+  } else if (realepoll_ctl(epfd, op, fd, &ours) == -1) {
+    free(newwatch);
+    return (-1);
+  }
+
+  show_msg(MSGDEBUG, "Took over registration of socket %d with epoll %d\n",
+           fd, epfd);
+  if ((watch = *wp) == NULL) {
+    watch = newwatch;
+    watch->epfd = epfd;
+    watch->sockid = fd;
+    watch->next = shard->watches;
+    shard->watches = watch;
+    __atomic_add_fetch(&nwatches, 1, __ATOMIC_RELAXED);
+  }
+  watch->event = *event;
+
+  return (0);
+}
+
+/* Bring the epoll registrations we hold for a socket in line with */
+/* its request's state, giving them back to the application once   */
+/* it has finished (or state is -1). The shard must be locked. We  */
+/* wait on waitfd, which is the broker's descriptor in place of    */
+/* the socket while the request waits for the broker: the socket   */
+/* isn't connected to anything then, and would only report hang    */
+/* ups. It's put back once the request has moved on                */
+static void update_watches(struct requestshard *shard, int sockid,
+                           int state, int waitfd) {
+  struct epollwatch **wp, *watch;
+  struct epoll_event ours;
+  int olderrno = errno;
+
+  for (wp = &(shard->watches); (watch = *wp);) {
+    if (watch->sockid != sockid) {
+      wp = &(watch->next);
+      continue;
+    }
+    if ((state == -1) || (state == FAILED) || (state == DONE)) {
+      /* Modifying the registration makes the kernel look at the */
+      /* socket again, so anything the application is waiting    */
+      /* for that's already happened is reported to it           */
+      show_msg(MSGDEBUG,
+               "Giving back registration of socket %d with epoll %d\n",
+               sockid, watch->epfd);
+      set_watch(watch->epfd, sockid, &(watch->event));
+      *wp = watch->next;
+      free(watch);
+      __atomic_sub_fetch(&nwatches, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    ours.events = watch_interest(state);
+    ours.data.u64 = EPOLL_TAG | (uint32_t)sockid;
+    if (waitfd != sockid)
+      realepoll_ctl(watch->epfd, EPOLL_CTL_DEL, sockid, NULL);
+    set_watch(watch->epfd, waitfd, &ours);
+    wp = &(watch->next);
+  }
+
+  errno = olderrno;
+}
+
+/* Change a registration, a socket whose request was started again  */
+/* on a new connection, or that was waiting for the broker, has lost */
+/* its registrations so they're added                                */
+static void set_watch(int epfd, int sockid, struct epoll_event *event) {
+  if ((realepoll_ctl(epfd, EPOLL_CTL_MOD, sockid, event) == -1) &&
+      (errno == ENOENT))
+    realepoll_ctl(epfd, EPOLL_CTL_ADD, sockid, event);
+}
+
+/* The events we wait for on a socket in the given state, one shot */
+/* so only one thread handles each and it can move the request on  */
+/* before anyone else looks at it                                  */
+static uint32_t watch_interest(int state) {
+  if ((state == RECEIVING) || (state == BROKERING))
+    return (EPOLLIN | EPOLLONESHOT);
+
+  return (EPOLLOUT | EPOLLONESHOT);
+}
+
+/* Wait for events like epoll_wait() or epoll_pwait(). Events tagged */
+/* as ours move negotiations along and are kept from the caller, if   */
+/* they were all there were we wait again for what's left of the      */
+/* timeout                                                            */
+static int wait_epoll(int epfd, struct epoll_event *events, int maxevents,
+                      int timeout, const sigset_t *sigmask, int pwait) {
+  struct timespec deadline, left;
+  int nevents, kept, wait, ticked, i;
+
+  if (timeout > 0) {
+    left.tv_sec = timeout / 1000;
+    left.tv_nsec = (timeout % 1000) * 1000000;
+    set_deadline(&deadline, &left);
+  }
+
+  for (;;) {
+    /* Races between servers, and waits for the broker, are seen to */
+    /* every RACE_TICK                                              */
+    ticked = (ticking() && ((timeout < 0) || (timeout > RACE_TICK)));
+    wait = (ticked ? RACE_TICK : timeout);
+#ifdef EPOLL_PWAIT_SIGNATURE
+    if (pwait)
+      nevents = realepoll_pwait(epfd, events, maxevents, wait, sigmask);
+    else
+#endif
+      nevents = realepoll_wait(epfd, events, maxevents, wait);
+    if ((nevents < 0) || ((nevents == 0) && !ticked))
+      return (nevents);
+
+    /* This is done however few requests there are, another thread */
+    /* may have taken over a registration while we were waiting     */
+    for (i = kept = 0; i < nevents; i++) {
+      if ((events[i].data.u64 & EPOLL_TAGMASK) == EPOLL_TAG)
+        handle_epoll_event((int)(events[i].data.u64 & ~EPOLL_TAGMASK),
+                           events[i].events);
+      else
+        events[kept++] = events[i];
+    }
+    if (ticking())
+      run_races();
+    if (kept)
+      return (kept);
+
+    if (timeout > 0) {
+      time_left(&deadline, &left);
+      timeout = left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000;
+    }
+  }
+}
+
+/* Move a negotiation along after an event on its socket, if another */
+/* thread is already doing so (or it's finished) there is nothing to */
+/* do, the registration is rearmed or given back when it's released  */
+static void handle_epoll_event(int sockid, uint32_t revents) {
+  struct connreq *conn;
+
+  get_environment();
+
+  if (!(conn = claim_socks_request(sockid, 0)))
+    return;
+
+  show_msg(MSGDEBUG, "Epoll event 0x%x on socket %d\n", revents, sockid);
+
+  if (revents & (EPOLLERR | EPOLLHUP))
+    fail_request(conn);
+  else
+    handle_request(conn);
+
+  release_socks_request(conn, 0);
+}
+#endif
+
+/* Take a request from the shard's free list, refilling it a slab at */
+/* a time. Slabs are never returned, each pool only grows to the most */
+/* requests that were ever in progress at once                       */
+static struct connreq *alloc_request(struct requestshard *shard) {
+  struct connreq *slab, *conn;
+  int i;
+
+  if (shard->free == NULL) {
+    if (posix_memalign((void **)&slab, CONNREQ_ALIGN,
+                       CONNREQ_SLAB * sizeof(*slab)))
+      return (NULL);
+    for (i = CONNREQ_SLAB - 1; i >= 0; i--) {
+      slab[i].next = shard->free;
+      shard->free = &slab[i];
+    }
+  }
+
+  conn = shard->free;
+  shard->free = conn->next;
+
+  return (conn);
+}
+
+/* Give a request back to the pool along with its buffer, any */
+/* racers it has and its reference to the configuration       */
+static void free_request(struct requestshard *shard, struct connreq *conn) {
+
+  if (conn->race)
+    end_race(conn);
+  if (conn->state == BROKERING) {
+    realclose(conn->broker);
+    __atomic_sub_fetch(&brokering, 1, __ATOMIC_RELAXED);
+  }
+  release_config(conn->config);
+  if (conn->buffer != conn->inlinebuf)
+    free(conn->buffer);
+  conn->next = shard->free;
+  shard->free = conn;
+}
+
+/* Put a finished request on the end of the reap queue, the queue is */
+/* in order of reaptime since the grace period is always the same    */
+static void queue_reap(struct requestshard *shard, struct connreq *conn) {
+
+  if (conn->reaptime)
+    return;
+
+  conn->reaptime = time(NULL) + CONNREQ_GRACE;
+  conn->next = NULL;
+  conn->prev = shard->reaptail;
+  if (shard->reaptail)
+    shard->reaptail->next = conn;
+  else
+    shard->reaphead = conn;
+  shard->reaptail = conn;
+}
+
+static void unqueue_reap(struct requestshard *shard, struct connreq *conn) {
+
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    shard->reaphead = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  else
+    shard->reaptail = conn->prev;
+  conn->reaptime = 0;
+}
+
+/* Throw away finished requests nobody called connect() for in time, */
+/* the shards are checked at most once a second                      */
+static void reap_requests(void) {
+  struct requestshard *shard;
+  time_t now, last;
+  int i;
+
+  now = time(NULL);
+  last = __atomic_load_n(&lastreap, __ATOMIC_RELAXED);
+  if ((now == last) ||
+      !__atomic_compare_exchange_n(&lastreap, &last, now, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+
+  for (i = 0; i < REQUEST_SHARDS; i++) {
+    shard = &(requestshards[i]);
+    if (__atomic_load_n(&(shard->reaphead), __ATOMIC_RELAXED) == NULL)
+      continue;
+    pthread_mutex_lock(&(shard->lock));
+    while (shard->reaphead && (shard->reaphead->reaptime <= now)) {
+      show_msg(MSGDEBUG,
+               "Reaping request for socket %d which finished with "
+               "status %d\n",
+               shard->reaphead->sockid, shard->reaphead->state);
+      kill_socks_request(shard, shard->reaphead);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+  }
+}
+
+/* Make sure the request's buffer can hold len bytes, messages that  */
+/* don't fit inline get CONNREQ_MAXBUF bytes from the heap which stay */
+/* with the request until it is freed, returns 0 on success           */
+static int size_buffer(struct connreq *conn, int len) {
+  char *heapbuf;
+
+  if (len > CONNREQ_MAXBUF - conn->extralen)
+    return (1);
+  if ((len <= CONNREQ_INLINE) || (conn->buffer != conn->inlinebuf))
+    return (0);
+
+  if ((heapbuf = malloc(CONNREQ_MAXBUF)) == NULL)
+    return (1);
+  memcpy(heapbuf, conn->inlinebuf, CONNREQ_INLINE);
+  conn->buffer = heapbuf;
+
+  return (0);
+}
+
+/* Move the negotiation on as far as it will go without blocking on a */
+/* non blocking socket, returning EWOULDBLOCK if it has to wait. On a  */
+/* blocking socket it is finished (or failed) before we return         */
+static int handle_request(struct connreq *conn) {
+  struct connreq *winner;
+  int rc = 0;
+  int i = 0;
+
+  show_msg(MSGDEBUG, "Beginning handle loop for socket %d\n", conn->sockid);
+
+  /* Whichever of the path's servers gets there first wins */
+  if (conn->race && (winner = run_race(conn)))
+    adopt_racer(conn, winner);
+
+  while ((rc == 0) && (conn->state != FAILED) && (conn->state != DONE) &&
+         (i++ < 20)) {
+    show_msg(MSGDEBUG,
+             "In request handle loop for socket %d, "
+             "current state of request is %d\n",
+             conn->sockid, conn->state);
+#ifdef USE_OPTIMISTIC
+    /* On optimistic paths the application hears it's connected once */
+    /* the connect request is sent, the rest waits for it to read     */
+    if (connect_sent(conn->state) &&
+        !(conn->options & (REQUEST_OPTIMISTIC | REQUEST_RACER)) &&
+        (__atomic_load_n(&(conn->path->flags), __ATOMIC_RELAXED) &
+         SERVER_OPTIMISTIC)) {
+      park_request(conn);
+      break;
+    }
+#endif
+    switch (conn->state) {
+    case UNSTARTED:
+    case CONNECTING:
+      rc = connect_server(conn);
+      break;
+    case CONNECTED:
+      rc = send_socks_request(conn);
+      break;
+    case SENDING:
+      rc = send_buffer(conn);
+      break;
+    case RECEIVING:
+      rc = recv_buffer(conn);
+      break;
+    case SENTV4REQ:
+      show_msg(MSGDEBUG, "Receiving reply to SOCKS V4 connect request\n");
+      conn->datalen = sizeof(struct sockrep);
+      conn->datadone = 0;
+      conn->state = RECEIVING;
+      conn->nextstate = GOTV4REQ;
+      break;
+    case GOTV4REQ:
+      rc = read_socksv4_req(conn);
+      break;
+    case SENTV5METHOD:
+      show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 method negotiation\n");
+      conn->datalen = 2;
+      conn->datadone = 0;
+      conn->state = RECEIVING;
+      conn->nextstate = GOTV5METHOD;
+      break;
+    case GOTV5METHOD:
+      rc = read_socksv5_method(conn);
+      break;
+    case SENTV5AUTH:
+      show_msg(MSGDEBUG,
+               "Receiving reply to SOCKS V5 authentication negotiation\n");
+      conn->datalen = 2;
+      conn->datadone = 0;
+      conn->state = RECEIVING;
+      conn->nextstate = GOTV5AUTH;
+      break;
+    case GOTV5AUTH:
+      rc = read_socksv5_auth(conn);
+      break;
+    case SENTV5CONNECT:
+      show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 connect request\n");
+      conn->datalen = 10;
+      conn->datadone = 0;
+      conn->state = RECEIVING;
+      conn->nextstate = GOTV5CONNECT;
+      break;
+    case GOTV5CONNECT:
+      rc = read_socksv5_connect(conn);
+      break;
+    case SENTV5PIPE:
+    case SENTV5PIPEAUTH:
+      show_msg(MSGDEBUG,
+               "Receiving replies to pipelined SOCKS V5 requests\n");
+      conn->datalen = 2;
+      conn->datadone = 0;
+      conn->nextstate =
+          (conn->state == SENTV5PIPE ? GOTV5PIPEMETHOD : GOTV5PIPEAUTHMETHOD);
+      conn->state = RECEIVING;
+      break;
+    case GOTV5PIPEMETHOD:
+    case GOTV5PIPEAUTHMETHOD:
+    case GOTV5PIPEAUTH:
+      rc = read_socksv5_pipeline(conn);
+      break;
+    case BROKERING:
+      rc = read_broker(conn);
+      break;
     }
-  } while (nevents == 0);
+  }
 
-  show_msg(MSGDEBUG, "Finished intercepting poll(), %d events\n", nevents);
+  /* A server that won't take pipelined requests gets this one again */
+  /* on a new connection, one request at a time                       */
+  if ((rc != 0) && (rc != EWOULDBLOCK) && pipelining(conn)) {
+    stop_pipelining(conn);
+    /* The application may have sent data on this connection already */
+    if (!(conn->options & REQUEST_OPTIMISTIC))
+      return (restart_request(conn));
+  }
 
-  /* Now restore the events polled in each of the blocks */
-  for (i = 0; i < nfds; i++) {
-    if (!(conn = find_socks_request(ufds[i].fd, 1)))
-      continue;
+  /* So does one whose pooled socket the server had already closed */
+  if (((rc == ECONNRESET) || (rc == EPIPE)) &&
+      ((conn->options & (REQUEST_POOLED | REQUEST_OPTIMISTIC)) ==
+       REQUEST_POOLED)) {
+    conn->options &= ~REQUEST_POOLED;
+    conn->options |= REQUEST_NOREADY;
+    return (restart_request(conn));
+  }
+
+  /* Another of the path's servers takes over from one that failed */
+  if ((rc != 0) && (rc != EWOULDBLOCK) && conn->race && fail_over(conn))
+    return (handle_request(conn));
 
-    ufds[i].events = conn->selectevents;
+  /* Anything but waiting for the socket is the end of the request */
+  if ((rc != 0) && (rc != EWOULDBLOCK))
+    conn->state = FAILED;
+  if (conn->state == FAILED) {
+    conn->err = (rc ? rc : ECONNREFUSED);
+    if (conn->options & REQUEST_NOCONNECT)
+      shutdown(conn->sockid, SHUT_RDWR);
   }
+  if (conn->race && ((conn->state == FAILED) || (conn->state == DONE)))
+    end_race(conn);
 
-  return (nevents);
+  if (i == 20)
+    show_msg(MSGERR, "Ooops, state loop while handling request %d\n",
+             conn->sockid);
+
+  show_msg(MSGDEBUG,
+           "Handle loop completed for socket %d in state %d, "
+           "returning %d\n",
+           conn->sockid, conn->state, rc);
+  return (rc);
 }
 
-int close(CLOSE_SIGNATURE) {
+static int connect_server(struct connreq *conn) {
+  int rc, flags;
+
+  /* A socket from a pool is ready for the connect request, a non  */
+  /* blocking socket may have to wait for the broker's reply first */
+  if ((conn->state == UNSTARTED) &&
+      !(conn->options & (REQUEST_WARMUP | REQUEST_RACER)) &&
+      take_ready(conn)) {
+    if (conn->state == BROKERING)
+      return (wait_request(conn, POLLIN));
+    if (conn->path->type == 4) {
+      conn->state = CONNECTED;
+      return (0);
+    }
+    return (send_socksv5_connect(conn));
+  }
+
+  /* Otherwise a path with more than one server races them */
+  if ((conn->state == UNSTARTED) && conn->path->failover && !conn->race &&
+      !(conn->options & (REQUEST_WARMUP | REQUEST_RACER))) {
+    start_race(conn);
+    if (conn->race && ((flags = fcntl(conn->sockid, F_GETFL)) != -1) &&
+        !(flags & O_NONBLOCK))
+      return (race_blocking(conn));
+  }
+
+#ifdef MSG_FASTOPEN
+  if ((conn->state == UNSTARTED) && !(conn->options & REQUEST_WARMUP) &&
+      (__atomic_load_n(&(conn->path->flags), __ATOMIC_RELAXED) &
+       SERVER_FASTOPEN))
+    return (fastopen_server(conn));
+#endif
+
+  /* Connect this socket to the socks server, if we're already */
+  /* connecting asking again tells us how that's going         */
+  show_msg(MSGDEBUG, "Connecting to %s port %d\n",
+           inet_ntoa(conn->serveraddr.sin_addr),
+           ntohs(conn->serveraddr.sin_port));
+
+  rc = realconnect(conn->sockid, (CONNECT_SOCKARG) & (conn->serveraddr),
+                   sizeof(conn->serveraddr));
+
+  show_msg(MSGDEBUG, "Connect returned %d, errno is %d\n", rc, errno);
+  if (rc && (conn->state == CONNECTING) && (errno == EISCONN))
+    rc = 0;
+  if (rc) {
+    if ((errno != EINPROGRESS) && (errno != EALREADY)) {
+      show_msg(MSGERR,
+               "Error %d attempting to connect to SOCKS "
+               "server (%s)\n",
+               errno, strerror(errno));
+      conn->state = FAILED;
+    } else {
+      show_msg(MSGDEBUG, "Connection in progress\n");
+      conn->state = CONNECTING;
+      /* Come back to connect() again once it has finished */
+      return (wait_request(conn, POLLOUT));
+    }
+  } else {
+    show_msg(MSGDEBUG, "Socket %d connected to SOCKS server\n", conn->sockid);
+    conn->state = CONNECTED;
+  }
+
+  return ((rc ? errno : 0));
+}
+
+#ifdef MSG_FASTOPEN
+/* Open the connection to the SOCKS server with TCP Fast Open, the  */
+/* first request goes in the SYN if the kernel has a cookie for the */
+/* server, otherwise the kernel sends it once we're connected       */
+static int fastopen_server(struct connreq *conn) {
   int rc;
+
+  show_msg(MSGDEBUG, "Connecting to %s port %d with fast open\n",
+           inet_ntoa(conn->serveraddr.sin_addr),
+           ntohs(conn->serveraddr.sin_port));
+
+  if ((rc = send_socks_request(conn)))
+    return (rc);
+
+  rc = send_request(conn, MSG_FASTOPEN, &(conn->serveraddr));
+
+  show_msg(MSGDEBUG, "Fast open returned %d, errno is %d\n", rc, errno);
+  if (rc >= 0) {
+    conn->datadone = rc;
+    conn->options |= REQUEST_FASTOPEN;
+    return (0);
+  }
+
+  if (errno == EINPROGRESS) {
+    /* No cookie yet, the request waits for the connection */
+    show_msg(MSGDEBUG, "Connection in progress\n");
+    conn->options |= REQUEST_FASTOPEN;
+    return (wait_request(conn, POLLOUT));
+  }
+
+  if (errno == EOPNOTSUPP) {
+    /* Fast open is turned off in the kernel, connect normally */
+    if (__atomic_fetch_and(&(conn->path->flags), ~SERVER_FASTOPEN,
+                           __ATOMIC_RELAXED) &
+        SERVER_FASTOPEN)
+      show_msg(MSGERR, "TCP Fast Open is turned off in the kernel "
+                       "(net.ipv4.tcp_fastopen), connecting to SOCKS "
+                       "servers normally\n");
+    conn->state = UNSTARTED;
+    return (connect_server(conn));
+  }
+
+  show_msg(MSGERR,
+           "Error %d attempting to connect to SOCKS "
+           "server (%s)\n",
+           errno, strerror(errno));
+  conn->state = FAILED;
+
+  return (errno);
+}
+#endif
+
+/* Once the SOCKS server replies, see whether it took the request we */
+/* sent in the SYN. If it didn't (it doesn't do fast open or we had  */
+/* no cookie for it yet) the kernel sent it again after the handshake */
+static void check_fastopen(struct connreq *conn) {
+#ifdef TCPI_OPT_SYN_DATA
+  struct tcp_info info;
+  socklen_t infolen = sizeof(info);
+
+  if (!getsockopt(conn->sockid, IPPROTO_TCP, TCP_INFO, (void *)&info,
+                  &infolen))
+    show_msg(MSGDEBUG, "SOCKS server %s %s the request in the SYN\n",
+             inet_ntoa(conn->serveraddr.sin_addr),
+             (info.tcpi_options & TCPI_OPT_SYN_DATA) ? "took" : "didn't take");
+#endif
+
+  conn->options &= ~REQUEST_FASTOPEN;
+}
+
+/* Fail a request whose socket reported an error or hung up, keeping */
+/* the error for the caller's next connect(). Pipelined requests are  */
+/* started again instead, and racing requests go on with another of  */
+/* their path's servers                                              */
+static void fail_request(struct connreq *conn) {
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  /* The broker hangs up once it has replied, the reply is read as usual */
+  if (conn->state == BROKERING) {
+    handle_request(conn);
+    return;
+  }
+
+  if (pipelining(conn) || (conn->options & REQUEST_POOLED)) {
+    if (pipelining(conn))
+      stop_pipelining(conn);
+    if (conn->options & REQUEST_POOLED)
+      conn->options |= REQUEST_NOREADY;
+    conn->options &= ~REQUEST_POOLED;
+    restart_request(conn);
+    return;
+  }
+
+  /* A racing request may have moved to another server's connection  */
+  /* since the event, the next step on it finds out if it has failed */
+  if (conn->race) {
+    handle_request(conn);
+    return;
+  }
+
+  if (getsockopt(conn->sockid, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen) ||
+      !err)
+    err = ECONNREFUSED;
+  show_msg(MSGDEBUG, "Request for socket %d failed, %s\n", conn->sockid,
+           strerror(err));
+  conn->state = FAILED;
+  conn->err = err;
+  if (conn->options & REQUEST_NOCONNECT)
+    shutdown(conn->sockid, SHUT_RDWR);
+  if (conn->race)
+    end_race(conn);
+}
+
+/* Whether a request is part way through a pipelined negotiation */
+static int pipelining(struct connreq *conn) {
+  int state = conn->state;
+
+  if ((state == SENDING) || (state == RECEIVING))
+    state = conn->nextstate;
+
+  return ((state >= SENTV5PIPE) && (state <= GOTV5PIPEAUTH));
+}
+
+/* Start a request again without pipelining after its server refused */
+/* the pipelined requests, the path doesn't pipeline any more until  */
+/* the configuration is read again. A connected socket can't connect */
+/* again so a new one takes over its descriptor, with its file flags */
+static int restart_request(struct connreq *conn) {
+  int sock, err;
+
+  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    err = errno;
+  else
+    err = replace_socket(conn, sock);
+
+  if (err) {
+    show_msg(MSGERR, "Could not start request for socket %d again, %s\n",
+             conn->sockid, strerror(err));
+    conn->state = FAILED;
+    conn->err = err;
+    return (err);
+  }
+
+  show_msg(MSGDEBUG, "Starting request for socket %d again\n", conn->sockid);
+  conn->state = UNSTARTED;
+
+  return (handle_request(conn));
+}
+
+/* Turn pipelining off for a server that refused pipelined requests */
+static void stop_pipelining(struct connreq *conn) {
+  if (__atomic_fetch_and(&(conn->path->flags), ~SERVER_PIPELINE,
+                         __ATOMIC_RELAXED) &
+      SERVER_PIPELINE)
+    show_msg(MSGERR,
+             "SOCKS server %s refused pipelined requests, "
+             "turning pipelining off for it\n",
+             inet_ntoa(conn->serveraddr.sin_addr));
+}
+
+/* Start racing the path's other servers for a request. A socket bound */
+/* to a port of its own has to be used as it is, and data sent with    */
+/* the connection must only reach the destination once, so neither     */
+/* of those race                                                       */
+static void start_race(struct connreq *conn) {
+  struct sockaddr_in local;
+  socklen_t locallen = sizeof(local);
+  struct serverrace *race;
+  int i;
+
+  if (conn->extralen ||
+      (!getsockname(conn->sockid, (struct sockaddr *)&local, &locallen) &&
+       (local.sin_family == AF_INET) && local.sin_port))
+    return;
+
+  if ((race = malloc(sizeof(*race))) == NULL)
+    return;
+  race->next = conn->path->failover;
+  race->err = 0;
+  for (i = 0; i < RACE_MAX; i++)
+    race->racers[i].sockid = -1;
+  conn->race = race;
+  delay_race(conn);
+  __atomic_add_fetch(&racing, 1, __ATOMIC_RELAXED);
+}
+
+/* Put off trying the request's next server for the path's delay */
+static void delay_race(struct connreq *conn) {
+  struct timespec delay;
+  int ms = conn->path->failoverdelay;
+
+  if (!ms)
+    ms = FAILOVER_DELAY;
+  delay.tv_sec = ms / 1000;
+  delay.tv_nsec = (ms % 1000) * 1000000;
+  set_deadline(&(conn->race->start), &delay);
+}
+
+/* Race a blocking socket's servers, starting with the one it was */
+/* routed to, and move the first to finish onto the socket        */
+static int race_blocking(struct connreq *conn) {
+  struct serverrace *race = conn->race;
+  struct pollfd ufds[RACE_MAX];
+  struct connreq *racer;
+  struct timespec left;
+  int n, ms, i, err;
+
+  start_racer(conn, free_racer(race), &(conn->serveraddr));
+  while (!(racer = run_race(conn))) {
+    for (i = n = 0; i < RACE_MAX; i++) {
+      if (race->racers[i].sockid == -1)
+        continue;
+      ufds[n].fd = race->racers[i].sockid;
+      ufds[n].events =
+          (race->racers[i].state == RECEIVING ? POLLIN : POLLOUT);
+      ufds[n].revents = 0;
+      n++;
+    }
+    if (!n && !race->next)
+      break;
+
+    /* Wait until it's time for the next server if there's room */
+    ms = -1;
+    if (race->next && (n < RACE_MAX)) {
+      time_left(&(race->start), &left);
+      ms = left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000;
+    }
+    if ((realpoll(ufds, n, ms) == -1) && (errno != EINTR)) {
+      race->err = errno;
+      break;
+    }
+  }
+
+  if (racer && !(err = adopt_racer(conn, racer)))
+    return (0);
+  if (racer)
+    race->err = err;
+
+  conn->state = FAILED;
+  return (race->err ? race->err : ECONNREFUSED);
+}
+
+/* Move a request's racers along without waiting, and start its next */
+/* server if it's time. Returns a racer that has finished, if any    */
+static struct connreq *run_race(struct connreq *conn) {
+  struct serverrace *race = conn->race;
+  struct connreq *racer;
+  struct timespec left;
+  int i;
+
+  for (i = 0; i < RACE_MAX; i++) {
+    racer = &(race->racers[i]);
+    if (racer->sockid == -1)
+      continue;
+    if (racer->state != DONE)
+      handle_request(racer);
+    if (racer->state == DONE)
+      return (racer);
+    if (racer->state == FAILED) {
+      show_msg(MSGDEBUG, "SOCKS server %s failed for socket %d, %s\n",
+               inet_ntoa(racer->serveraddr.sin_addr), conn->sockid,
+               strerror(racer->err));
+      race->err = racer->err;
+      drop_racer(racer);
+      /* The next server needn't wait for one that's failed */
+      clock_gettime(CLOCK_MONOTONIC, &(race->start));
+    }
+  }
+
+  if (race->next) {
+    time_left(&(race->start), &left);
+    if (!left.tv_sec && !left.tv_nsec && (racer = next_racer(conn)) &&
+        (racer->state == DONE))
+      return (racer);
+  }
+
+  return (NULL);
+}
+
+/* Move along every request's race, called whenever a wait for events */
+/* wakes while there are any. Only the requests' own sockets are      */
+/* waited on, so this is the only time their racers are looked at.    */
+/* Requests waiting for the broker are looked at too, in case it has  */
+/* gone quiet                                                         */
+static void run_races(void) {
   struct connreq *conn;
+  int sockid;
 
-  tsocks_init();
+  for (sockid = next_socks_socket(-1); sockid != -1;
+       sockid = next_socks_socket(sockid)) {
+    if (!(conn = claim_socks_request(sockid, 0)))
+      continue;
+    if (conn->race || (conn->state == BROKERING))
+      handle_request(conn);
+    release_socks_request(conn, 0);
+  }
+}
+
+/* Find a slot for another racer, returns NULL if they're all in use */
+static struct connreq *free_racer(struct serverrace *race) {
+  int i;
+
+  for (i = 0; i < RACE_MAX; i++) {
+    if (race->racers[i].sockid == -1)
+      return (&(race->racers[i]));
+  }
+
+  return (NULL);
+}
+
+/* Start a racer for the next of the request's servers that can be */
+/* used, returning it or NULL if there are none or no room for one */
+static struct connreq *next_racer(struct connreq *conn) {
+  struct serverrace *race = conn->race;
+  struct sockaddr_in serveraddr;
+  struct connreq *racer = NULL;
+  char host[256];
+  int len;
+
+  while (!racer && race->next && free_racer(race)) {
+    len = strcspn(race->next, " ");
+    snprintf(host, sizeof(host), "%.*s", len, race->next);
+    race->next += len + strspn(race->next + len, " ");
+    if (*(race->next) == '\0')
+      race->next = NULL;
+
+    memset(&serveraddr, 0x0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(conn->path->port);
+    if ((serveraddr.sin_addr.s_addr = resolve_server(host)) == -1) {
+      show_msg(MSGERR,
+               "The SOCKS server (%s) listed in the configuration "
+               "file for the path on line %d is invalid\n",
+               host, conn->path->lineno);
+      continue;
+    }
+    if (is_local(conn->config, &(serveraddr.sin_addr), conn->path->port)) {
+      show_msg(MSGERR, "SOCKS server %s (%s) is not on a local subnet!\n",
+               host, inet_ntoa(serveraddr.sin_addr));
+      continue;
+    }
+
+    racer = start_racer(conn, free_racer(race), &serveraddr);
+  }
+  delay_race(conn);
+
+  return (racer);
+}
+
+/* Start a racer negotiating with a server for the request, on a non */
+/* blocking socket of its own given the options set on the request's */
+/* before it connects. Returns it, or NULL if it has failed already, */
+/* in which case the next server is due straight away                */
+static struct connreq *start_racer(struct connreq *conn,
+                                   struct connreq *racer,
+                                   struct sockaddr_in *serveraddr) {
+  struct serverrace *race = conn->race;
+  int err;
+
+  memset(racer, 0x0, sizeof(*racer));
+  if ((racer->sockid = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                                           SOCK_CLOEXEC, 0)) == -1) {
+    race->err = errno;
+    clock_gettime(CLOCK_MONOTONIC, &(race->start));
+    return (NULL);
+  }
+  if ((err = copy_options(conn->sockid, racer->sockid))) {
+    show_msg(MSGERR, "Could not give the socket options of socket %d to "
+                     "another of its SOCKS servers, %s\n",
+             conn->sockid, strerror(err));
+    realclose(racer->sockid);
+    racer->sockid = -1;
+    race->err = err;
+    clock_gettime(CLOCK_MONOTONIC, &(race->start));
+    return (NULL);
+  }
+  racer->buffer = racer->inlinebuf;
+  racer->state = UNSTARTED;
+  racer->options = REQUEST_RACER;
+  racer->path = conn->path;
+  racer->config = conn->config;
+  memcpy(&(racer->connaddr), &(conn->connaddr), sizeof(racer->connaddr));
+  memcpy(&(racer->serveraddr), serveraddr, sizeof(racer->serveraddr));
+
+  show_msg(MSGDEBUG, "Trying SOCKS server %s for socket %d\n",
+           inet_ntoa(racer->serveraddr.sin_addr), conn->sockid);
+  handle_request(racer);
+  if (racer->state == FAILED) {
+    race->err = racer->err;
+    drop_racer(racer);
+    clock_gettime(CLOCK_MONOTONIC, &(race->start));
+    return (NULL);
+  }
+
+  return (racer);
+}
+
+/* Close a racer's socket and free its slot */
+static void drop_racer(struct connreq *racer) {
+
+  realclose(racer->sockid);
+  if (racer->buffer != racer->inlinebuf)
+    free(racer->buffer);
+  racer->buffer = racer->inlinebuf;
+  racer->sockid = -1;
+}
+
+/* Move a racer's connection onto the request's socket with its file */
+/* flags, like a restarted request's, and carry on from where the    */
+/* racer got to. Returns 0, or an error number if it can't be moved  */
+/* (the racer is dropped either way)                                 */
+static int adopt_racer(struct connreq *conn, struct connreq *racer) {
+  int flags, fdflags, err;
+
+  if (((flags = fcntl(conn->sockid, F_GETFL)) == -1) ||
+      ((fdflags = fcntl(conn->sockid, F_GETFD)) == -1) ||
+      (fcntl(racer->sockid, F_SETFL, flags) == -1) ||
+      (fcntl(racer->sockid, F_SETFD, fdflags) == -1) ||
+      (dup2(racer->sockid, conn->sockid) == -1)) {
+    err = errno;
+    show_msg(MSGERR, "Could not move the connection to %s onto socket %d, "
+                     "%s\n",
+             inet_ntoa(racer->serveraddr.sin_addr), conn->sockid,
+             strerror(err));
+    drop_racer(racer);
+    return (err);
+  }
+
+  show_msg(MSGDEBUG, "Socket %d goes on with SOCKS server %s\n",
+           conn->sockid, inet_ntoa(racer->serveraddr.sin_addr));
+  if (conn->buffer != conn->inlinebuf)
+    free(conn->buffer);
+  if (racer->buffer == racer->inlinebuf) {
+    memcpy(conn->inlinebuf, racer->inlinebuf, CONNREQ_INLINE);
+    conn->buffer = conn->inlinebuf;
+  } else {
+    conn->buffer = racer->buffer;
+    racer->buffer = racer->inlinebuf;
+  }
+  conn->state = racer->state;
+  conn->nextstate = racer->nextstate;
+  conn->datalen = racer->datalen;
+  conn->datadone = racer->datadone;
+  conn->options =
+      (conn->options & REQUEST_NOCONNECT) | (racer->options & ~REQUEST_RACER);
+  memcpy(&(conn->serveraddr), &(racer->serveraddr), sizeof(conn->serveraddr));
+  drop_racer(racer);
+
+  return (0);
+}
+
+/* Go on with another of the request's servers after the one on its  */
+/* own socket failed, a racer if there is one and otherwise the next */
+/* server straight away. Returns 1 if there was one to go on with    */
+static int fail_over(struct connreq *conn) {
+  struct connreq *racer = NULL;
+  int i;
+
+  for (i = 0; (i < RACE_MAX) && !racer; i++) {
+    if (conn->race->racers[i].sockid != -1)
+      racer = &(conn->race->racers[i]);
+  }
+  if ((racer == NULL) && ((racer = next_racer(conn)) == NULL))
+    return (0);
+
+  return (!adopt_racer(conn, racer));
+}
+
+/* Close whatever racers are left once a request has finished */
+static void end_race(struct connreq *conn) {
+  int i;
+
+  for (i = 0; i < RACE_MAX; i++) {
+    if (conn->race->racers[i].sockid != -1)
+      drop_racer(&(conn->race->racers[i]));
+  }
+  free(conn->race);
+  conn->race = NULL;
+  __atomic_sub_fetch(&racing, 1, __ATOMIC_RELAXED);
+}
+
+/* Put an idle connection from the path's pool, or else from the broker  */
+/* if the path uses it, in place of the request's socket, returning 1 if */
+/* there was one. It's dup2()ed over the application's descriptor and   */
+/* given its file flags and socket options                               */
+static int take_ready(struct connreq *conn) {
+  struct sockaddr_in local;
+  socklen_t locallen = sizeof(local), devicelen = IFNAMSIZ,
+            marklen = sizeof(int);
+  char device[IFNAMSIZ];
+  char *from = "pool";
+  int sock = -1, askbroker, flags, mark, err;
+
+  askbroker =
+      ((__atomic_load_n(&(conn->path->flags), __ATOMIC_RELAXED) &
+        SERVER_BROKER) &&
+       (time(NULL) >= __atomic_load_n(&brokerretry, __ATOMIC_RELAXED)));
+  if ((conn->options & REQUEST_NOREADY) ||
+      (!conn->path->poolsize && !askbroker))
+    return (0);
+
+  /* A socket bound to a port of its own has to be used as it is, */
+  /* and one bound to a device or marked for routing has to make  */
+  /* its own connection for them to take effect                   */
+  if (!getsockname(conn->sockid, (struct sockaddr *)&local, &locallen) &&
+      (local.sin_family == AF_INET) && local.sin_port)
+    return (0);
+  if ((!getsockopt(conn->sockid, SOL_SOCKET, SO_BINDTODEVICE, device,
+                   &devicelen) &&
+       devicelen && device[0]) ||
+      (!getsockopt(conn->sockid, SOL_SOCKET, SO_MARK, &mark, &marklen) &&
+       mark))
+    return (0);
+
+  if (conn->path->poolsize)
+    sock = take_pooled(conn);
+  if ((sock == -1) && askbroker) {
+    /* Non blocking sockets never wait for the broker here */
+    if (((flags = fcntl(conn->sockid, F_GETFL)) != -1) &&
+        (flags & O_NONBLOCK))
+      return (ask_broker(conn));
+    sock = take_brokered(conn);
+    from = "broker";
+  }
+  if (sock == -1)
+    return (0);
+
+  if ((err = replace_socket(conn, sock))) {
+    show_msg(MSGERR, "Could not use pooled socket for socket %d, %s\n",
+             conn->sockid, strerror(err));
+    return (0);
+  }
+
+  show_msg(MSGDEBUG, "Socket %d took an idle connection to %s from the "
+                     "%s\n",
+           conn->sockid, inet_ntoa(conn->serveraddr.sin_addr), from);
+  conn->options |= REQUEST_POOLED;
+
+  return (1);
+}
+
+/* Take the newest idle socket from the path's pool, returning -1 if */
+/* there isn't one. Whether there was one or not the pool thread is  */
+/* asked to fill the pool up again                                   */
+static int take_pooled(struct connreq *conn) {
+  struct serverpool *pool;
+  struct pollfd ufd;
+  int sock = -1, idle;
+  time_t now = time(NULL);
+  pid_t pid = getpid();
+
+  if (pid != __atomic_load_n(&poolpid, __ATOMIC_ACQUIRE))
+    reset_pools(pid);
+
+  idle = (conn->path->poolidle ? conn->path->poolidle : POOL_IDLE);
+  pthread_mutex_lock(&poollock);
+  if ((pool = find_pool(conn))) {
+    /* Anything to read on an idle socket means the server closed it */
+    while ((sock == -1) && pool->count) {
+      sock = pool->sockets[--(pool->count)];
+      ufd.fd = sock;
+      ufd.events = POLLIN;
+      ufd.revents = 0;
+      if ((pool->idlesince[pool->count] + idle <= now) ||
+          realpoll(&ufd, 1, 0)) {
+        realclose(sock);
+        sock = -1;
+      }
+    }
+    pool->refill = 1;
+    pthread_cond_signal(&poolcond);
+  }
+  pthread_mutex_unlock(&poollock);
+
+  return (sock);
+}
+
+/* Ask the tsocksd broker for a connection to the request's server, */
+/* made with the credentials we'd use ourselves, returning -1 if it */
+/* has none. Only blocking sockets wait for the reply here, non     */
+/* blocking ones ask with ask_broker() and read it with             */
+/* read_broker() once the socket is readable                        */
+static int take_brokered(struct connreq *conn) {
+  int broker, sock;
+
+  if ((broker = open_broker(conn, 0)) == -1)
+    return (-1);
+  sock = recv_broker(conn, broker, MSG_WAITALL);
+  realclose(broker);
+
+  return (sock);
+}
+
+/* Send the broker a non blocking socket's request, the connection */
+/* to it is kept with the request until the reply comes. Returns 0 */
+/* if the broker couldn't be asked, the request connects by itself */
+/* then                                                            */
+static int ask_broker(struct connreq *conn) {
+  int broker;
+
+  if ((broker = open_broker(conn, 1)) == -1)
+    return (0);
+
+  show_msg(MSGDEBUG, "Socket %d is waiting for the broker\n", conn->sockid);
+  conn->broker = broker;
+  conn->state = BROKERING;
+  if (__atomic_add_fetch(&brokering, 1, __ATOMIC_RELAXED) == 1)
+    __atomic_store_n(&brokerheard, time(NULL), __ATOMIC_RELAXED);
+
+  return (1);
+}
+
+/* Read the broker's reply to a non blocking socket's request. The   */
+/* connection it sent takes the socket's place, without one (or if   */
+/* it can't) the request connects to the server by itself on the     */
+/* socket it has. A broker that has said nothing to anyone for       */
+/* BROKER_TIMEOUT seconds is as good as one that failed              */
+static int read_broker(struct connreq *conn) {
+  int sock, err;
+
+  sock = recv_broker(conn, conn->broker, MSG_DONTWAIT);
+  if ((sock == -1) && (errno == EAGAIN)) {
+    if (time(NULL) <=
+        __atomic_load_n(&brokerheard, __ATOMIC_RELAXED) + BROKER_TIMEOUT)
+      return (wait_request(conn, POLLIN));
+    show_msg(MSGDEBUG, "No reply from the broker for socket %d\n",
+             conn->sockid);
+    __atomic_store_n(&brokerretry, time(NULL) + BROKER_RETRY,
+                     __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(&brokerheard, time(NULL), __ATOMIC_RELAXED);
+  }
+  __atomic_sub_fetch(&brokering, 1, __ATOMIC_RELAXED);
+  realclose(conn->broker);
+  conn->state = UNSTARTED;
+
+  if ((sock != -1) && (err = replace_socket(conn, sock))) {
+    show_msg(MSGERR, "Could not use brokered socket for socket %d, %s\n",
+             conn->sockid, strerror(err));
+    sock = -1;
+  }
+  if (sock != -1) {
+    show_msg(MSGDEBUG, "Socket %d took an idle connection to %s from the "
+                       "broker\n",
+             conn->sockid, inet_ntoa(conn->serveraddr.sin_addr));
+    conn->options |= REQUEST_POOLED;
+    if (conn->path->type == 4) {
+      conn->state = CONNECTED;
+      return (0);
+    }
+    return (send_socksv5_connect(conn));
+  }
+
+  conn->options |= REQUEST_NOREADY;
+
+  return (0);
+}
+
+/* Connect to the broker and send it the request, returning the   */
+/* connection to it or -1. A broker that can't be reached is left */
+/* alone for BROKER_RETRY seconds, and one run by another user is */
+/* ignored                                                        */
+static int open_broker(struct connreq *conn, int nonblock) {
+  struct brokerrequest request;
+  struct sockaddr_un addr;
+  struct timeval timeout;
+  struct passwd pwent;
+  char pwbuf[1024];
+  char *name, *uname, *upass;
+  struct stat owner;
+  int broker;
+
+  if (time(NULL) < __atomic_load_n(&brokerretry, __ATOMIC_RELAXED))
+    return (-1);
+
+  if (suid || ((name = getenv(BROKER_ENV)) == NULL))
+    name = BROKER_SOCKET;
+  memset(&addr, 0x0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(name) >= sizeof(addr.sun_path))
+    return (-1);
+  strcpy(addr.sun_path, name);
+
+  /* The socket belongs to whoever runs the broker */
+  if (stat(name, &owner) || (owner.st_uid && (owner.st_uid != getuid()))) {
+    if (!access(name, F_OK))
+      show_msg(MSGERR, "Ignoring broker at %s, it isn't run by root or us\n",
+               name);
+    __atomic_store_n(&brokerretry, time(NULL) + BROKER_RETRY,
+                     __ATOMIC_RELAXED);
+    return (-1);
+  }
+
+  if ((broker = socket(AF_UNIX,
+                       SOCK_STREAM | SOCK_CLOEXEC |
+                           (nonblock ? SOCK_NONBLOCK : 0),
+                       0)) == -1)
+    return (-1);
+  if (!nonblock) {
+    timeout.tv_sec = BROKER_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(broker, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(broker, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+
+  memset(&request, 0x0, sizeof(request));
+  request.version = BROKER_VERSION;
+  request.type = conn->path->type;
+  memcpy(&(request.serveraddr), &(conn->serveraddr),
+         sizeof(request.serveraddr));
+  if ((conn->path->type == 5) && (upass = socks_password(conn)) && *upass &&
+      (uname = socks_username(conn, &pwent, pwbuf, sizeof(pwbuf)))) {
+    strncpy(request.user, uname, sizeof(request.user) - 1);
+    strncpy(request.pass, upass, sizeof(request.pass) - 1);
+  }
+
+  /* A broker with a full backlog is as good as none */
+  if ((realconnect(broker, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+      (send(broker, &request, sizeof(request), MSG_NOSIGNAL) !=
+       sizeof(request))) {
+    show_msg(MSGDEBUG, "Could not ask broker at %s, %s\n", name,
+             strerror(errno));
+    __atomic_store_n(&brokerretry, time(NULL) + BROKER_RETRY,
+                     __ATOMIC_RELAXED);
+    realclose(broker);
+    return (-1);
+  }
+
+  return (broker);
+}
+
+/* Read the broker's reply, returning the connection that came with  */
+/* it or -1. errno is EAGAIN if a non blocking reply isn't here yet, */
+/* any other failure leaves the broker alone for BROKER_RETRY        */
+/* seconds, a broker with no connection to give isn't failing        */
+static int recv_broker(struct connreq *conn, int broker, int flags) {
+  struct brokerreply reply;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  int sock = -1, rc;
+
+  memset(&msg, 0x0, sizeof(msg));
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof(reply);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  while (((rc = recvmsg(broker, &msg, flags | MSG_CMSG_CLOEXEC)) == -1) &&
+         (errno == EINTR))
+    ;
+  if ((rc == -1) && (errno == EAGAIN) && (flags & MSG_DONTWAIT))
+    return (-1);
+
+  if (rc > 0) {
+    if ((cmsg = CMSG_FIRSTHDR(&msg)) && (cmsg->cmsg_level == SOL_SOCKET) &&
+        (cmsg->cmsg_type == SCM_RIGHTS) &&
+        (cmsg->cmsg_len == CMSG_LEN(sizeof(int))))
+      memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if ((rc != sizeof(reply)) || (reply.version != BROKER_VERSION)) {
+    show_msg(MSGDEBUG, "No reply from the broker, %s\n",
+             (rc == -1 ? strerror(errno) : "bad reply"));
+    __atomic_store_n(&brokerretry, time(NULL) + BROKER_RETRY,
+                     __ATOMIC_RELAXED);
+    if (sock != -1)
+      realclose(sock);
+    errno = EIO;
+    return (-1);
+  }
 
-  if (realclose == NULL) {
-    show_msg(MSGERR, "Unresolved symbol: close\n");
+  if (reply.status) {
+    show_msg(MSGDEBUG, "Broker had no connection to %s, %s\n",
+             inet_ntoa(conn->serveraddr.sin_addr), strerror(reply.status));
+    if (sock != -1)
+      realclose(sock);
+    errno = EIO;
     return (-1);
   }
+  if (sock == -1)
+    errno = EIO;
 
-  show_msg(MSGDEBUG, "Call to close(%d)\n", fd);
+  return (sock);
+}
 
-  rc = realclose(fd);
+/* Put a socket in place of the request's, dup2()ed over the  */
+/* application's descriptor and given its file flags and      */
+/* socket options, sock is closed whether it worked or not.   */
+/* Returns 0 or an errno                                      */
+static int replace_socket(struct connreq *conn, int sock) {
+  int flags, fdflags, err = 0;
+
+  if (((flags = fcntl(conn->sockid, F_GETFL)) == -1) ||
+      ((fdflags = fcntl(conn->sockid, F_GETFD)) == -1) ||
+      (fcntl(sock, F_SETFL, flags) == -1) ||
+      (fcntl(sock, F_SETFD, fdflags) == -1) ||
+      (err = copy_options(conn->sockid, sock)) ||
+      (dup2(sock, conn->sockid) == -1))
+    err = (err ? err : errno);
+  realclose(sock);
+
+  return (err);
+}
 
-  /* If we have this fd in our request handling list we
-   * remove it now */
-  if ((conn = find_socks_request(fd, 1))) {
-    show_msg(MSGDEBUG,
-             "Call to close() received on file descriptor "
-             "%d which is a connection request of status %d\n",
-             conn->sockid, conn->state);
-    kill_socks_request(conn);
+/* Give a socket taking over from another the options set on that     */
+/* one. Only options whose values differ are set, so a buffer size    */
+/* the kernel picked stays its to tune, and those either socket can't */
+/* report are passed over. Returns 0 or the errno of an option that   */
+/* couldn't be set                                                    */
+static int copy_options(int from, int to) {
+  static const int options[][2] = {
+      {SOL_SOCKET, SO_KEEPALIVE},     {SOL_SOCKET, SO_PRIORITY},
+      {SOL_SOCKET, SO_MARK},          {SOL_SOCKET, SO_SNDBUF},
+      {SOL_SOCKET, SO_RCVBUF},        {IPPROTO_IP, IP_TOS},
+      {IPPROTO_TCP, TCP_NODELAY},     {IPPROTO_TCP, TCP_KEEPIDLE},
+      {IPPROTO_TCP, TCP_KEEPINTVL},   {IPPROTO_TCP, TCP_KEEPCNT},
+      {IPPROTO_TCP, TCP_USER_TIMEOUT}};
+  struct linger linger, tolinger;
+  char device[IFNAMSIZ], todevice[IFNAMSIZ];
+  socklen_t len, tolen;
+  int value, tovalue;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    len = tolen = sizeof(value);
+    if (getsockopt(from, options[i][0], options[i][1], &value, &len) ||
+        getsockopt(to, options[i][0], options[i][1], &tovalue, &tolen) ||
+        (value == tovalue))
+      continue;
+    /* Buffer sizes are reported doubled, and doubled again when set */
+    if ((options[i][0] == SOL_SOCKET) &&
+        ((options[i][1] == SO_SNDBUF) || (options[i][1] == SO_RCVBUF)))
+      value /= 2;
+    if (setsockopt(to, options[i][0], options[i][1], &value, sizeof(value)))
+      return (errno);
   }
 
-  return (rc);
+  len = tolen = sizeof(linger);
+  if (!getsockopt(from, SOL_SOCKET, SO_LINGER, &linger, &len) &&
+      !getsockopt(to, SOL_SOCKET, SO_LINGER, &tolinger, &tolen) &&
+      ((linger.l_onoff != tolinger.l_onoff) ||
+       (linger.l_linger != tolinger.l_linger)) &&
+      setsockopt(to, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)))
+    return (errno);
+
+  len = tolen = sizeof(device);
+  if (!getsockopt(from, SOL_SOCKET, SO_BINDTODEVICE, device, &len) &&
+      !getsockopt(to, SOL_SOCKET, SO_BINDTODEVICE, todevice, &tolen) &&
+      ((len != tolen) || memcmp(device, todevice, len)) &&
+      setsockopt(to, SOL_SOCKET, SO_BINDTODEVICE, device, len))
+    return (errno);
+
+  return (0);
 }
 
-static struct connreq *new_socks_request(int sockid,
-                                         struct sockaddr_in *connaddr,
-                                         struct sockaddr_in *serveraddr,
-                                         struct serverent *path) {
-  struct connreq *newconn;
+/* The descriptor a request's events come on, the connection to the */
+/* broker while it waits for the broker's reply                      */
+static int waiting_socket(struct connreq *conn) {
+  return (conn->state == BROKERING ? conn->broker : conn->sockid);
+}
 
-  if ((newconn = malloc(sizeof(*newconn))) == NULL) {
-    /* Could not malloc, we're stuffed */
-    show_msg(MSGERR, "Could not allocate memory for new socks request\n");
+/* Waits for events are cut to RACE_TICK while any requests are racing */
+/* servers or waiting for the broker                                   */
+static int ticking(void) {
+  return (__atomic_load_n(&racing, __ATOMIC_RELAXED) ||
+          __atomic_load_n(&brokering, __ATOMIC_RELAXED));
+}
+
+/* Find the pool for a request's path, making it if the request was */
+/* routed by the current configuration. The pool lock must be held  */
+static struct serverpool *find_pool(struct connreq *conn) {
+  struct serverpool *pool;
+
+  for (pool = pools; pool; pool = pool->next)
+    if (pool->path == conn->path)
+      return (pool);
+
+  if ((conn->config != __atomic_load_n(&config, __ATOMIC_ACQUIRE)) ||
+      ((pool = calloc(1, sizeof(*pool))) == NULL))
     return (NULL);
-  }
 
-  /* Add this connection to be proxied to the list */
-  memset(newconn, 0x0, sizeof(*newconn));
-  newconn->sockid = sockid;
-  newconn->state = UNSTARTED;
-  newconn->path = path;
-  memcpy(&(newconn->connaddr), connaddr, sizeof(newconn->connaddr));
-  memcpy(&(newconn->serveraddr), serveraddr, sizeof(newconn->serveraddr));
-  newconn->next = requests;
-  requests = newconn;
+  show_msg(MSGDEBUG, "Making a pool of %d sockets for SOCKS server %s\n",
+           conn->path->poolsize, inet_ntoa(conn->serveraddr.sin_addr));
+  pool->path = conn->path;
+  pool->config = conn->config;
+  __atomic_add_fetch(&(conn->config->refcount), 1, __ATOMIC_ACQ_REL);
+  memcpy(&(pool->serveraddr), &(conn->serveraddr), sizeof(pool->serveraddr));
+  pool->next = pools;
+  pools = pool;
 
-  return (newconn);
+  if (!poolthread)
+    start_pool_thread();
+
+  return (pool);
 }
 
-static void kill_socks_request(struct connreq *conn) {
-  struct connreq *connnode;
+/* Start the thread that fills the pools, it never takes the */
+/* application's signals. The pool lock must be held         */
+static void start_pool_thread(void) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, pool_thread, NULL))
+    show_msg(MSGERR, "Could not start the thread to fill socket pools\n");
+  else
+    poolthread = 1;
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
 
-  if (requests == conn)
-    requests = conn->next;
-  else {
-    for (connnode = requests; connnode != NULL; connnode = connnode->next) {
-      if (connnode->next == conn) {
-        connnode->next = conn->next;
-        break;
+/* Keep the pools filled, one socket at a time, closing sockets that */
+/* have been idle too long and throwing away pools made under a      */
+/* configuration that has since been replaced. The lock is only let  */
+/* go while a socket is being readied                                */
+static void *pool_thread(void *arg) {
+  struct serverpool *pool, **prev, *fill;
+  struct timespec until;
+  time_t now, next;
+  int sock, backoff;
+
+  pthread_mutex_lock(&poollock);
+  for (;;) {
+    now = time(NULL);
+    next = 0;
+    fill = NULL;
+    for (prev = &pools; (pool = *prev);) {
+      if (pool->config != __atomic_load_n(&config, __ATOMIC_ACQUIRE)) {
+        *prev = pool->next;
+        drop_pool(pool);
+        continue;
       }
+      if (tend_pool(pool, now, &next) && !fill)
+        fill = pool;
+      prev = &(pool->next);
+    }
+
+    if (fill) {
+      pthread_mutex_unlock(&poollock);
+      sock = warm_socket(fill);
+      pthread_mutex_lock(&poollock);
+      now = time(NULL);
+      if (sock == -1) {
+        fill->failures++;
+        backoff = (fill->failures < 6 ? 1 << fill->failures : POOL_BACKOFF);
+        fill->retry = now + (backoff < POOL_BACKOFF ? backoff : POOL_BACKOFF);
+      } else if (fill->count < fill->path->poolsize) {
+        fill->failures = 0;
+        fill->sockets[fill->count] = sock;
+        fill->idlesince[fill->count++] = now;
+      } else
+        realclose(sock);
+      continue;
     }
+
+    if (next) {
+      until.tv_sec = next;
+      until.tv_nsec = 0;
+      pthread_cond_timedwait(&poolcond, &poollock, &until);
+    } else
+      pthread_cond_wait(&poolcond, &poollock);
   }
 
-  free(conn);
+  return (arg);
 }
 
-static struct connreq *find_socks_request(int sockid, int includefinished) {
-  struct connreq *connnode;
-
-  for (connnode = requests; connnode != NULL; connnode = connnode->next) {
-    if (connnode->sockid == sockid) {
-      if (((connnode->state == FAILED) || (connnode->state == DONE)) &&
-          !includefinished)
-        break;
-      else
-        return (connnode);
-    }
+/* Close a pool's sockets that have been idle too long and work out */
+/* when it next needs looking at, returns the pool if it should     */
+/* have a socket added to it now                                    */
+static struct serverpool *tend_pool(struct serverpool *pool, time_t now,
+                                    time_t *next) {
+  int idle = (pool->path->poolidle ? pool->path->poolidle : POOL_IDLE);
+  time_t when;
+
+  while (pool->count && (pool->idlesince[0] + idle <= now)) {
+    realclose(pool->sockets[0]);
+    pool->count--;
+    memmove(pool->sockets, pool->sockets + 1,
+            pool->count * sizeof(pool->sockets[0]));
+    memmove(pool->idlesince, pool->idlesince + 1,
+            pool->count * sizeof(pool->idlesince[0]));
+    if (__atomic_load_n(&(pool->path->flags), __ATOMIC_RELAXED) &
+        SERVER_POOLALWAYS)
+      pool->refill = 1;
   }
+  if (pool->count) {
+    when = pool->idlesince[0] + idle;
+    if (!*next || (when < *next))
+      *next = when;
+  }
+
+  if (pool->count >= pool->path->poolsize)
+    pool->refill = 0;
+  if (!pool->refill)
+    return (NULL);
+  if (pool->retry <= now)
+    return (pool);
 
+  if (!*next || (pool->retry < *next))
+    *next = pool->retry;
   return (NULL);
 }
 
-static int handle_request(struct connreq *conn) {
-  int rc = 0;
-  int i = 0;
-  int flags = 0;
-
-  show_msg(MSGDEBUG, "Beginning handle loop for socket %d\n", conn->sockid);
-
-  /* disable O_NONBLOCK */
-  flags = fcntl(conn->sockid, F_GETFL);
-  if (flags & O_NONBLOCK) {
-    fcntl(conn->sockid, F_SETFL, flags & ~O_NONBLOCK);
-  }
+/* Open a connection to a pool's SOCKS server and take it as far as */
+/* the connect request, returning the socket or -1. The negotiation */
+/* is the usual one on a non blocking socket, with its own timeout  */
+static int warm_socket(struct serverpool *pool) {
+  struct connreq conn;
+  struct pollfd ufd;
+  time_t deadline = time(NULL) + POOL_TIMEOUT;
+  int rc;
 
-  while ((rc == 0) && (conn->state != FAILED) && (conn->state != DONE) &&
-         (i++ < 20)) {
-    show_msg(MSGDEBUG,
-             "In request handle loop for socket %d, "
-             "current state of request is %d\n",
-             conn->sockid, conn->state);
-    switch (conn->state) {
-    case UNSTARTED:
-    case CONNECTING:
-      rc = connect_server(conn);
-      break;
-    case CONNECTED:
-      rc = send_socks_request(conn);
-      break;
-    case SENDING:
-      rc = send_buffer(conn);
-      break;
-    case RECEIVING:
-      rc = recv_buffer(conn);
-      break;
-    case SENTV4REQ:
-      show_msg(MSGDEBUG, "Receiving reply to SOCKS V4 connect request\n");
-      conn->datalen = sizeof(struct sockrep);
-      conn->datadone = 0;
-      conn->state = RECEIVING;
-      conn->nextstate = GOTV4REQ;
-      break;
-    case GOTV4REQ:
-      rc = read_socksv4_req(conn);
-      break;
-    case SENTV5METHOD:
-      show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 method negotiation\n");
-      conn->datalen = 2;
-      conn->datadone = 0;
-      conn->state = RECEIVING;
-      conn->nextstate = GOTV5METHOD;
-      break;
-    case GOTV5METHOD:
-      rc = read_socksv5_method(conn);
-      break;
-    case SENTV5AUTH:
-      show_msg(MSGDEBUG,
-               "Receiving reply to SOCKS V5 authentication negotiation\n");
-      conn->datalen = 2;
-      conn->datadone = 0;
-      conn->state = RECEIVING;
-      conn->nextstate = GOTV5AUTH;
-      break;
-    case GOTV5AUTH:
-      rc = read_socksv5_auth(conn);
-      break;
-    case SENTV5CONNECT:
-      show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 connect request\n");
-      conn->datalen = 10;
-      conn->datadone = 0;
-      conn->state = RECEIVING;
-      conn->nextstate = GOTV5CONNECT;
-      break;
-    case GOTV5CONNECT:
-      rc = read_socksv5_connect(conn);
+  memset(&conn, 0x0, sizeof(conn));
+  if ((conn.sockid = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                                         SOCK_CLOEXEC, 0)) == -1)
+    return (-1);
+  conn.buffer = conn.inlinebuf;
+  conn.state = UNSTARTED;
+  conn.options = REQUEST_WARMUP;
+  conn.path = pool->path;
+  conn.config = pool->config;
+  memcpy(&(conn.serveraddr), &(pool->serveraddr), sizeof(conn.serveraddr));
+
+  show_msg(MSGDEBUG, "Opening an idle connection to %s for the pool\n",
+           inet_ntoa(conn.serveraddr.sin_addr));
+  while ((rc = handle_request(&conn)) == EWOULDBLOCK) {
+    ufd.fd = conn.sockid;
+    ufd.events = (conn.state == RECEIVING ? POLLIN : POLLOUT);
+    ufd.revents = 0;
+    if ((deadline <= time(NULL)) ||
+        (realpoll(&ufd, 1, (deadline - time(NULL)) * 1000) <= 0)) {
+      rc = ETIMEDOUT;
       break;
     }
-
-    conn->err = errno;
   }
 
-  if (i == 20)
-    show_msg(MSGERR, "Ooops, state loop while handling request %d\n",
-             conn->sockid);
-
-  /* restore O_NONBLOCK */
-  if (flags & O_NONBLOCK) {
-    flags = fcntl(conn->sockid, F_GETFL);
-    fcntl(conn->sockid, F_SETFL, flags | O_NONBLOCK);
+  if (conn.buffer != conn.inlinebuf)
+    free(conn.buffer);
+  if (rc || (conn.state != DONE)) {
+    show_msg(MSGDEBUG, "Could not open an idle connection to %s, %s\n",
+             inet_ntoa(conn.serveraddr.sin_addr),
+             strerror(rc ? rc : conn.err));
+    realclose(conn.sockid);
+    return (-1);
   }
 
-  show_msg(MSGDEBUG,
-           "Handle loop completed for socket %d in state %d, "
-           "returning %d\n",
-           conn->sockid, conn->state, rc);
-  return (rc);
+  return (conn.sockid);
 }
 
-static int connect_server(struct connreq *conn) {
-  int rc;
-
-  /* Connect this socket to the socks server */
-  show_msg(MSGDEBUG, "Connecting to %s port %d\n",
-           inet_ntoa(conn->serveraddr.sin_addr),
-           ntohs(conn->serveraddr.sin_port));
+/* Close a pool's sockets and free it, it's already been unlinked */
+static void drop_pool(struct serverpool *pool) {
+  int i;
 
-  rc = realconnect(conn->sockid, (CONNECT_SOCKARG) & (conn->serveraddr),
-                   sizeof(conn->serveraddr));
+  for (i = 0; i < pool->count; i++)
+    realclose(pool->sockets[i]);
+  release_config(pool->config);
+  free(pool);
+}
 
-  show_msg(MSGDEBUG, "Connect returned %d, errno is %d\n", rc, errno);
-  if (rc) {
-    if (errno != EINPROGRESS) {
-      show_msg(MSGERR,
-               "Error %d attempting to connect to SOCKS "
-               "server (%s)\n",
-               errno, strerror(errno));
-      conn->state = FAILED;
-    } else {
-      show_msg(MSGDEBUG, "Connection in progress\n");
-      conn->state = CONNECTING;
+/* A forked child has no pool thread, its pool lock may have been held */
+/* by the parent's and the idle sockets it inherited are the parent's, */
+/* so it starts again with none. One thread does this while any others */
+/* wait for it to finish                                               */
+static void reset_pools(pid_t pid) {
+  struct serverpool *pool;
+  pid_t parent = __atomic_load_n(&poolpid, __ATOMIC_ACQUIRE);
+
+  if ((parent != pid) && (parent != -1) &&
+      __atomic_compare_exchange_n(&poolpid, &parent, -1, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE)) {
+    pthread_mutex_init(&poollock, NULL);
+    pthread_cond_init(&poolcond, NULL);
+    while ((pool = pools)) {
+      pools = pool->next;
+      drop_pool(pool);
     }
-  } else {
-    show_msg(MSGDEBUG, "Socket %d connected to SOCKS server\n", conn->sockid);
-    conn->state = CONNECTED;
+    poolthread = 0;
+    __atomic_store_n(&poolpid, pid, __ATOMIC_RELEASE);
   }
 
-  return ((rc ? errno : 0));
+  while (__atomic_load_n(&poolpid, __ATOMIC_ACQUIRE) != pid)
+    sched_yield();
+}
+
+/* Wait for a blocking socket to be ready for the next step of the */
+/* negotiation, returns 0 or an error number. Non blocking sockets  */
+/* return EWOULDBLOCK straight away, the negotiation is picked up   */
+/* again when select(), poll() or epoll see the socket is ready     */
+static int wait_request(struct connreq *conn, short events) {
+  struct pollfd ufd;
+  int flags;
+
+  if (((flags = fcntl(conn->sockid, F_GETFL)) != -1) &&
+      (flags & O_NONBLOCK))
+    return (EWOULDBLOCK);
+
+  ufd.fd = conn->sockid;
+  ufd.events = events;
+  ufd.revents = 0;
+  while (realpoll(&ufd, 1, -1) == -1)
+    if (errno != EINTR)
+      return (errno);
+
+  return (0);
 }
 
 static int send_socks_request(struct connreq *conn) {
   int rc = 0;
 
-  if (conn->path->type == 4)
+  /* Version 4 has nothing to say before the connect request */
+  if ((conn->options & REQUEST_WARMUP) && (conn->path->type == 4))
+    conn->state = DONE;
+  else if (conn->path->type == 4)
     rc = send_socksv4_request(conn);
   else
     rc = send_socksv5_method(conn);
@@ -928,23 +4123,25 @@ static int send_socks_request(struct connreq *conn) {
 }
 
 static int send_socksv4_request(struct connreq *conn) {
-  struct passwd *user;
+  struct passwd pwent, *user;
   struct sockreq *thisreq;
+  char pwbuf[1024];
 
-  /* Determine the current username */
-  user = getpwuid(getuid());
-
-  thisreq = (struct sockreq *)conn->buffer;
+  /* Determine the current username, getpwuid() isn't thread safe */
+  if (getpwuid_r(getuid(), &pwent, pwbuf, sizeof(pwbuf), &user))
+    user = NULL;
 
   /* Check the buffer has enough space for the request  */
   /* and the user name                                  */
-  conn->datalen =
-      sizeof(struct sockreq) + (user == NULL ? 0 : strlen(user->pw_name)) + 1;
-  if (sizeof(conn->buffer) < conn->datalen) {
+  if (size_buffer(conn, sizeof(struct sockreq) +
+                            (user == NULL ? 0 : strlen(user->pw_name)) + 1)) {
     show_msg(MSGERR, "The SOCKS username is too long");
     conn->state = FAILED;
     return (ECONNREFUSED);
   }
+  conn->datalen =
+      sizeof(struct sockreq) + (user == NULL ? 0 : strlen(user->pw_name)) + 1;
+  thisreq = (struct sockreq *)conn->buffer;
 
   /* Create the request */
   thisreq->version = 4;
@@ -969,6 +4166,11 @@ static int send_socksv5_method(struct connreq *conn) {
                       0x00,  /* Null Auth       */
                       0x02}; /* User/Pass Auth  */
 
+  if (!(conn->options & REQUEST_WARMUP) &&
+      (__atomic_load_n(&(conn->path->flags), __ATOMIC_RELAXED) &
+       SERVER_PIPELINE))
+    return (send_socksv5_pipeline(conn));
+
   show_msg(MSGDEBUG, "Constructing V5 method negotiation\n");
   conn->state = SENDING;
   conn->nextstate = SENTV5METHOD;
@@ -980,52 +4182,206 @@ static int send_socksv5_method(struct connreq *conn) {
 }
 
 static int send_socksv5_connect(struct connreq *conn) {
-  char constring[] = {0x05,  /* Version 5 SOCKS */
-                      0x01,  /* Connect request */
-                      0x00,  /* Reserved        */
-                      0x01}; /* IP Version 4    */
+
+  /* A socket for the pool is ready once we're authenticated */
+  if (conn->options & REQUEST_WARMUP) {
+    conn->state = DONE;
+    return (0);
+  }
 
   show_msg(MSGDEBUG, "Constructing V5 connect request\n");
   conn->datadone = 0;
   conn->state = SENDING;
   conn->nextstate = SENTV5CONNECT;
-  memcpy(conn->buffer, constring, sizeof(constring));
-  conn->datalen = sizeof(constring);
+  conn->datalen = 0;
+  add_socksv5_connect(conn);
+
+  return (0);
+}
+
+/* Build the method selection, the authentication and the connect */
+/* request in one buffer to go out together. Only the method we'll */
+/* use is offered, username/password if we have a password and no  */
+/* authentication if not                                           */
+static int send_socksv5_pipeline(struct connreq *conn) {
+  struct passwd pwent;
+  char *uname = NULL, *upass;
+  char pwbuf[1024];
+
+  show_msg(MSGDEBUG, "Constructing pipelined V5 requests\n");
+
+  if ((upass = socks_password(conn)) != NULL)
+    uname = socks_username(conn, &pwent, pwbuf, sizeof(pwbuf));
+
+  conn->buffer[0] = 0x05; /* Version 5 SOCKS */
+  conn->buffer[1] = 0x01; /* No. Methods     */
+  conn->buffer[2] = (uname == NULL ? 0x00 : 0x02);
+  conn->datalen = 3;
+  if ((uname != NULL) && add_socksv5_auth(conn, uname, upass))
+    return (ECONNREFUSED);
+  if (size_buffer(conn, conn->datalen + 10)) {
+    conn->state = FAILED;
+    return (ENOMEM);
+  }
+  add_socksv5_connect(conn);
+
+  conn->datadone = 0;
+  conn->state = SENDING;
+  conn->nextstate = (uname == NULL ? SENTV5PIPE : SENTV5PIPEAUTH);
+
+  return (0);
+}
+
+/* Add a username/password authentication request to the buffer */
+static int add_socksv5_auth(struct connreq *conn, char *uname, char *upass) {
+
+  /* Check that the username / pass specified will */
+  /* fit into the buffer                           */
+  if ((strlen(uname) > 255) || (strlen(upass) > 255) ||
+      size_buffer(conn, conn->datalen + 3 + strlen(uname) + strlen(upass))) {
+    show_msg(MSGERR, "The supplied socks username or "
+                     "password is too long");
+    conn->state = FAILED;
+    return (ECONNREFUSED);
+  }
+
+  conn->buffer[conn->datalen] = '\x01';
+  conn->datalen++;
+  conn->buffer[conn->datalen] = (int8_t)strlen(uname);
+  conn->datalen++;
+  memcpy(&(conn->buffer[conn->datalen]), uname, strlen(uname));
+  conn->datalen = conn->datalen + strlen(uname);
+  conn->buffer[conn->datalen] = (int8_t)strlen(upass);
+  conn->datalen++;
+  memcpy(&(conn->buffer[conn->datalen]), upass, strlen(upass));
+  conn->datalen = conn->datalen + strlen(upass);
+
+  return (0);
+}
+
+/* Add a connect request to the buffer, which has room for it */
+static void add_socksv5_connect(struct connreq *conn) {
+  char constring[] = {0x05,  /* Version 5 SOCKS */
+                      0x01,  /* Connect request */
+                      0x00,  /* Reserved        */
+                      0x01}; /* IP Version 4    */
+
+  memcpy(&conn->buffer[conn->datalen], constring, sizeof(constring));
+  conn->datalen += sizeof(constring);
   memcpy(&conn->buffer[conn->datalen], &(conn->connaddr.sin_addr.s_addr),
          sizeof(conn->connaddr.sin_addr.s_addr));
   conn->datalen += sizeof(conn->connaddr.sin_addr.s_addr);
   memcpy(&conn->buffer[conn->datalen], &(conn->connaddr.sin_port),
          sizeof(conn->connaddr.sin_port));
   conn->datalen += sizeof(conn->connaddr.sin_port);
+}
 
-  return (0);
+/* The username to authenticate with, from tsocks.conf, then */
+/* $TSOCKS_USERNAME, then the local passwd file              */
+static char *socks_username(struct connreq *conn, struct passwd *pwent,
+                            char *pwbuf, size_t pwbuflen) {
+  struct passwd *nixuser;
+  char *uname;
+
+  if (((uname = conn->path->defuser) == NULL) &&
+      ((uname = getenv("TSOCKS_USERNAME")) == NULL)) {
+    /* Determine the current *nix username */
+    if (getpwuid_r(getuid(), pwent, pwbuf, pwbuflen, &nixuser))
+      nixuser = NULL;
+    uname = (nixuser == NULL ? NULL : nixuser->pw_name);
+  }
+
+  return (uname);
+}
+
+/* The password to authenticate with, from $TSOCKS_PASSWORD */
+/* or tsocks.conf                                           */
+static char *socks_password(struct connreq *conn) {
+  char *upass;
+
+  if ((upass = getenv("TSOCKS_PASSWORD")) == NULL)
+    upass = conn->path->defpass;
+
+  return (upass);
 }
 
 static int send_buffer(struct connreq *conn) {
   int rc = 0;
 
-  show_msg(MSGDEBUG, "Writing to server (sending %d bytes)\n", conn->datalen);
-  while ((rc == 0) && (conn->datadone != conn->datalen)) {
-    rc = send(conn->sockid, conn->buffer + conn->datadone,
-              conn->datalen - conn->datadone, 0);
+  int total = conn->datalen + extra_length(conn);
+
+  show_msg(MSGDEBUG, "Writing to server (sending %d bytes)\n", total);
+  while ((rc == 0) && (conn->datadone != total)) {
+    rc = send_request(conn, 0, NULL);
     if (rc > 0) {
       conn->datadone += rc;
       rc = 0;
+    } else if ((rc == -1) && ((errno == EWOULDBLOCK) || (errno == EAGAIN))) {
+      rc = wait_request(conn, POLLOUT);
+    } else if ((rc == -1) && (errno == EINTR)) {
+      rc = 0;
     } else {
-      if (errno != EWOULDBLOCK)
-        show_msg(MSGDEBUG, "Write failed, %s\n", strerror(errno));
+      show_msg(MSGDEBUG, "Write failed, %s\n", strerror(errno));
       rc = errno;
     }
   }
 
-  if (conn->datadone == conn->datalen)
+  if (conn->datadone == total)
     conn->state = conn->nextstate;
 
   show_msg(MSGDEBUG, "Sent %d bytes of %d bytes in buffer, return code is %d\n",
-           conn->datadone, conn->datalen, rc);
+           conn->datadone, total, rc);
   return (rc);
 }
 
+/* How much of the application's data goes with the message in the */
+/* buffer, all of it with the connect request and none otherwise    */
+static int extra_length(struct connreq *conn) {
+  if (connect_sent(conn->nextstate))
+    return (conn->extralen);
+
+  return (0);
+}
+
+/* Whether a state is the one reached once the connect request is sent */
+static int connect_sent(int state) {
+  return ((state == SENTV4REQ) || (state == SENTV5CONNECT) ||
+          (state == SENTV5PIPE) || (state == SENTV5PIPEAUTH));
+}
+
+/* Send what's left of the message in the buffer and any of the */
+/* application's data that goes with it, to the address given   */
+/* if there is one                                              */
+static ssize_t send_request(struct connreq *conn, int flags,
+                            struct sockaddr_in *to) {
+  struct msghdr msg;
+  struct iovec iov[2];
+  int extra = extra_length(conn);
+  char *tail = conn->buffer + CONNREQ_MAXBUF - extra;
+
+  memset(&msg, 0x0, sizeof(msg));
+  msg.msg_name = to;
+  msg.msg_namelen = (to ? sizeof(*to) : 0);
+  msg.msg_iov = iov;
+  if (conn->datadone < conn->datalen) {
+    iov[0].iov_base = conn->buffer + conn->datadone;
+    iov[0].iov_len = conn->datalen - conn->datadone;
+    iov[1].iov_base = tail;
+    iov[1].iov_len = extra;
+    msg.msg_iovlen = (extra ? 2 : 1);
+  } else {
+    iov[0].iov_base = tail + conn->datadone - conn->datalen;
+    iov[0].iov_len = extra - (conn->datadone - conn->datalen);
+    msg.msg_iovlen = 1;
+  }
+
+#ifdef USE_SENDMSG
+  return (realsendmsg(conn->sockid, &msg, flags));
+#else
+  return (sendmsg(conn->sockid, &msg, flags));
+#endif
+}
+
 static int recv_buffer(struct connreq *conn) {
   int rc = 0;
 
@@ -1035,11 +4391,19 @@ static int recv_buffer(struct connreq *conn) {
     rc = recv(conn->sockid, conn->buffer + conn->datadone,
               conn->datalen - conn->datadone, 0);
     if (rc > 0) {
+      if (conn->options & REQUEST_FASTOPEN)
+        check_fastopen(conn);
       conn->datadone += rc;
       rc = 0;
+    } else if ((rc == -1) && ((errno == EWOULDBLOCK) || (errno == EAGAIN))) {
+      rc = wait_request(conn, POLLIN);
+    } else if ((rc == -1) && (errno == EINTR)) {
+      rc = 0;
+    } else if (rc == 0) {
+      show_msg(MSGDEBUG, "SOCKS server closed the connection\n");
+      rc = ECONNRESET;
     } else {
-      if (errno != EWOULDBLOCK)
-        show_msg(MSGDEBUG, "Read failed, %s\n", strerror(errno));
+      show_msg(MSGDEBUG, "Read failed, %s\n", strerror(errno));
       rc = errno;
     }
   }
@@ -1054,8 +4418,9 @@ static int recv_buffer(struct connreq *conn) {
 }
 
 static int read_socksv5_method(struct connreq *conn) {
-  struct passwd *nixuser;
+  struct passwd pwent;
   char *uname, *upass;
+  char pwbuf[1024];
 
   /* See if we offered an acceptable method */
   if (conn->buffer[1] == '\xff') {
@@ -1070,12 +4435,8 @@ static int read_socksv5_method(struct connreq *conn) {
     show_msg(MSGDEBUG,
              "SOCKS V5 server chose username/password authentication\n");
 
-    /* Determine the current *nix username */
-    nixuser = getpwuid(getuid());
-
-    if (((uname = conn->path->defuser) == NULL) &&
-        ((uname = getenv("TSOCKS_USERNAME")) == NULL) &&
-        ((uname = (nixuser == NULL ? NULL : nixuser->pw_name)) == NULL)) {
+    if ((uname = socks_username(conn, &pwent, pwbuf, sizeof(pwbuf))) ==
+        NULL) {
       show_msg(MSGERR, "Could not get SOCKS username from "
                        "local passwd file, tsocks.conf "
                        "or $TSOCKS_USERNAME to authenticate "
@@ -1084,34 +4445,16 @@ static int read_socksv5_method(struct connreq *conn) {
       return (ECONNREFUSED);
     }
 
-    if (((upass = getenv("TSOCKS_PASSWORD")) == NULL) &&
-        ((upass = conn->path->defpass) == NULL)) {
+    if ((upass = socks_password(conn)) == NULL) {
       show_msg(MSGERR, "Need a password in tsocks.conf or "
                        "$TSOCKS_PASSWORD to authenticate with");
       conn->state = FAILED;
       return (ECONNREFUSED);
     }
 
-    /* Check that the username / pass specified will */
-    /* fit into the buffer				                */
-    if ((3 + strlen(uname) + strlen(upass)) >= sizeof(conn->buffer)) {
-      show_msg(MSGERR, "The supplied socks username or "
-                       "password is too long");
-      conn->state = FAILED;
-      return (ECONNREFUSED);
-    }
-
     conn->datalen = 0;
-    conn->buffer[conn->datalen] = '\x01';
-    conn->datalen++;
-    conn->buffer[conn->datalen] = (int8_t)strlen(uname);
-    conn->datalen++;
-    memcpy(&(conn->buffer[conn->datalen]), uname, strlen(uname));
-    conn->datalen = conn->datalen + strlen(uname);
-    conn->buffer[conn->datalen] = (int8_t)strlen(upass);
-    conn->datalen++;
-    memcpy(&(conn->buffer[conn->datalen]), upass, strlen(upass));
-    conn->datalen = conn->datalen + strlen(upass);
+    if (add_socksv5_auth(conn, uname, upass))
+      return (ECONNREFUSED);
 
     conn->state = SENDING;
     conn->nextstate = SENTV5AUTH;
@@ -1135,6 +4478,44 @@ static int read_socksv5_auth(struct connreq *conn) {
   return (send_socksv5_connect(conn));
 }
 
+/* Read the replies to pipelined requests up to the connect reply, */
+/* which is read as usual. A server that doesn't go along with      */
+/* pipelining chooses some other method (or hangs up), and we start */
+/* again without it                                                 */
+static int read_socksv5_pipeline(struct connreq *conn) {
+  char method = (conn->state == GOTV5PIPEAUTHMETHOD ? 0x02 : 0x00);
+
+  if (conn->state == GOTV5PIPEAUTH) {
+    if (conn->buffer[1] != '\x00') {
+      show_msg(MSGERR,
+               "SOCKS authentication failed, check username and password\n");
+      conn->state = FAILED;
+      return (ECONNREFUSED);
+    }
+    conn->state = SENTV5CONNECT;
+    return (0);
+  }
+
+  if ((conn->buffer[0] != 0x05) || (conn->buffer[1] != method)) {
+    show_msg(MSGDEBUG, "SOCKS V5 server chose method %d for pipelined "
+                       "requests\n",
+             (unsigned char)conn->buffer[1]);
+    return (ECONNREFUSED);
+  }
+
+  if (conn->state == GOTV5PIPEAUTHMETHOD) {
+    show_msg(MSGDEBUG, "Receiving reply to pipelined SOCKS V5 "
+                       "authentication\n");
+    conn->datalen = 2;
+    conn->datadone = 0;
+    conn->state = RECEIVING;
+    conn->nextstate = GOTV5PIPEAUTH;
+  } else
+    conn->state = SENTV5CONNECT;
+
+  return (0);
+}
+
 static int read_socksv5_connect(struct connreq *conn) {
 
   /* See if the connection succeeded */
@@ -5,6 +5,56 @@
 #define _TSOCKS_H 1
 
 #include <parser.h>
+#include <pthread.h>
+
+#if defined(EPOLL_CTL_SIGNATURE) && defined(EPOLL_WAIT_SIGNATURE)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+/* sendto() and sendmsg() are only intercepted for connections the */
+/* application opens itself with TCP Fast Open                     */
+#include <sys/socket.h>
+#if defined(MSG_FASTOPEN) && defined(SENDTO_SIGNATURE)
+#define USE_SENDTO 1
+#endif
+#if defined(MSG_FASTOPEN) && defined(SENDMSG_SIGNATURE)
+#define USE_SENDMSG 1
+#endif
+
+/* Optimistic paths need every way of reading a socket intercepted, */
+/* the SOCKS server's reply has to be read before the application's */
+/* so they're only supported where all of read(), readv(), recv(),  */
+/* recvfrom(), recvmsg() and recvmmsg() can be. The C library's     */
+/* __read_chk(), __recv_chk() and __recvfrom_chk(), which programs  */
+/* built with _FORTIFY_SOURCE call, are intercepted if it has them  */
+#if defined(READ_SIGNATURE) && defined(READV_SIGNATURE) && \
+    defined(RECV_SIGNATURE) && defined(RECVFROM_SIGNATURE) && \
+    defined(RECVMSG_SIGNATURE) && defined(RECVMMSG_SIGNATURE)
+#define USE_OPTIMISTIC 1
+#endif
+
+/* Size of the buffer inside each request, enough for everything but */
+/* long usernames and passwords, and the most we'll ever send. Data  */
+/* the application sends with the connection (MSG_FASTOPEN) is kept  */
+/* at the end of the buffer, up to CONNREQ_MAXEXTRA bytes of it      */
+#define CONNREQ_INLINE 20
+#define CONNREQ_MAXBUF 2048
+#define CONNREQ_MAXEXTRA 1400
+
+/* Requests are allocated this many at a time, aligned to a cache line */
+#define CONNREQ_SLAB 64
+#define CONNREQ_ALIGN 64
+
+/* Most servers a request tries at once besides its own socket's, */
+/* and the milliseconds between looks at the racers while waiting */
+/* for events, since only the application's socket is waited on   */
+#define RACE_MAX 3
+#define RACE_TICK 10
+
+/* Seconds a finished request is kept for the caller to collect its */
+/* status with connect() before it's thrown away                    */
+#define CONNREQ_GRACE 10
 
 /* Structure representing a socks connection request */
 struct sockreq {
@@ -23,38 +73,274 @@ struct sockrep {
   int32_t ignore2;
 };
 
-/* Structure representing a socket which we are currently proxying */
+/* Structure representing a socket which we are currently proxying. */
+/* The first cache line holds everything select(), poll() and the    */
+/* state machine look at, the rest is only needed while messages are */
+/* built. Requests come from slabs of CONNREQ_SLAB and are recycled   */
 struct connreq {
-  /* Information about the socket and target */
   int sockid;
+
+  /* When connections fail but an error number cannot be reported
+   * because the socket is non blocking we keep the connreq struct until
+   * the status is queried with connect() again, we then return
+   * this value */
+  int16_t err;
+
+  /* REQUEST_BUSY and REQUEST_DEAD, only changed with the shard locked */
+  uint8_t flags;
+
+  /* Current state of this proxied socket, and the next state to go */
+  /* to when the send or receive is finished                        */
+  uint8_t state;
+  uint8_t nextstate;
+
+  /* REQUEST_ options below, only changed by the thread working on it */
+  uint8_t options;
+
+  /* Buffer for sending and receiving on the socket, either inlinebuf */
+  /* or, for messages too big for it, CONNREQ_MAXBUF from the heap.   */
+  /* The last extralen bytes are the application's data, sent after   */
+  /* the connect request                                              */
+  uint16_t datalen;
+  uint16_t datadone;
+  uint16_t extralen;
+  char *buffer;
+
+  /* Pointer to the config entry for the socks server, and the */
+  /* configuration it belongs to (kept alive until we're done)  */
+  struct serverent *path;
+  struct parsedfile *config;
+
+  /* Finished requests wait on a queue to be reaped if the caller */
+  /* never comes back for them, reaptime is 0 when not queued      */
+  time_t reaptime;
+  struct connreq *next; /* Also links the free list */
+  struct connreq *prev;
+
+  /* The path's other servers being tried, if it has any */
+  struct serverrace *race;
+
+  /* Information about the target and SOCKS server */
   struct sockaddr_in connaddr;
   struct sockaddr_in serveraddr;
 
-  /* Pointer to the config entry for the socks server */
+  /* The connection to the broker while the request is BROKERING */
+  int broker;
+  char inlinebuf[CONNREQ_INLINE];
+};
+
+/* A thread working on a request marks it busy so it can drop the  */
+/* shard lock, other threads leave it alone and anyone killing it   */
+/* marks it dead for the busy thread to free                        */
+#define REQUEST_BUSY (1 << 0)
+#define REQUEST_DEAD (1 << 1)
+
+/* The connection to the SOCKS server was opened with TCP Fast Open, */
+/* we haven't yet checked whether the server took the data in the SYN */
+#define REQUEST_FASTOPEN (1 << 0)
+
+/* The request was started by sendto() or sendmsg() rather than by */
+/* connect(), nobody will ask for its status so if it fails the    */
+/* socket is shut down for the application to notice               */
+#define REQUEST_NOCONNECT (1 << 1)
+
+/* The application was told the connection was made as soon as the  */
+/* connect request was sent. While the reply is still to be read    */
+/* REQUEST_REPLYDUE is set too and the request is parked as DONE,   */
+/* with the state to carry on from in nextstate                     */
+#define REQUEST_OPTIMISTIC (1 << 2)
+#define REQUEST_REPLYDUE (1 << 3)
+
+/* The request is warming up a socket for a pool, it stops once the */
+/* socket is ready for a connect request                            */
+#define REQUEST_WARMUP (1 << 4)
+
+/* The request took its socket from a pool, if the server turns out */
+/* to have dropped it the request starts again on a new connection  */
+#define REQUEST_POOLED (1 << 5)
+
+/* The request is a racer, trying another of its path's servers      */
+/* on a socket of its own. Racers are never in the table of requests */
+#define REQUEST_RACER (1 << 6)
+
+/* The request connects to the server itself, a pooled or brokered */
+/* socket failed it or the broker had none to give                 */
+#define REQUEST_NOREADY (1 << 7)
+
+/* Requests are kept in a table indexed by socket, made of pages of  */
+/* REQUEST_PAGESIZE sockets each with a bitmap of the sockets that   */
+/* have a request. The pages are found through directories of        */
+/* REQUEST_DIRSIZE pages, enough of them for any socket number. Both */
+/* are allocated as needed and never move, so finding out whether a  */
+/* socket has a request takes no lock                                */
+#define REQUEST_PAGEBITS 10
+#define REQUEST_PAGESIZE (1 << REQUEST_PAGEBITS)
+#define REQUEST_DIRBITS 10
+#define REQUEST_DIRSIZE (1 << REQUEST_DIRBITS)
+#define REQUEST_DIRS (1 << (31 - REQUEST_PAGEBITS - REQUEST_DIRBITS))
+#define REQUEST_WORDBITS (8 * sizeof(unsigned long))
+#define REQUEST_BIT(sockid) (1UL << ((sockid) % REQUEST_WORDBITS))
+
+struct requestpage {
+  unsigned long bits[REQUEST_PAGESIZE / REQUEST_WORDBITS];
+  struct connreq *conns[REQUEST_PAGESIZE];
+};
+
+/* select(), pselect(), poll() and ppoll() all hand their arguments  */
+/* to one loop as a struct eventwait. The sockets the caller passed   */
+/* that have unfinished requests are noted once per call, with the    */
+/* events the caller asked for (as poll() events) so they can be put  */
+/* back. index is the socket for select() and the entry for poll(),   */
+/* up to POLL_MAPSIZE of them are kept in the struct itself. poll()   */
+/* waits on the broker's descriptor in place of a socket waiting for  */
+/* the broker, sockid is the socket to put back                       */
+struct pollentry {
+  int index;
+  int sockid;
+  short events;
+  short watching;
+};
+
+#define POLL_MAPSIZE 64
+
+#define WAIT_SELECT 0
+#define WAIT_PSELECT 1
+#define WAIT_POLL 2
+#define WAIT_PPOLL 3
+#define WAIT_POLLING(wait) ((wait)->type >= WAIT_POLL)
+
+struct eventwait {
+  int type;
+
+  /* The calls take relative timeouts, we keep to an absolute */
+  /* CLOCK_MONOTONIC deadline however often we go round       */
+  int forever;
+  struct timespec deadline;
+  int ticked; /* The last wait was cut to RACE_TICK to see to races */
+  const sigset_t *sigmask;
+
+  /* select() and pselect(), only the words of the fd_sets up */
+  /* to n are ever copied                                     */
+  int n;
+  fd_set *callerfds[3];
+  fd_set fds[3];
+  struct timeval *selecttimeout;
+
+  /* poll() and ppoll() */
+  struct pollfd *ufds;
+  unsigned long nfds;
+
+  int nmapped;
+  int mapsize;
+  struct pollentry *map;
+  struct pollentry stackmap[POLL_MAPSIZE];
+};
+
+/* Bytes of an fd_set covering sockets below n */
+#define FDSET_BYTES(n) ((((n) + NFDBITS - 1) / NFDBITS) * sizeof(fd_mask))
+
+/* Sockets are spread over REQUEST_SHARDS shards by number. Each has */
+/* a lock for its sockets' requests, its own pool of free requests   */
+/* and reap queue, and counts the threads routing a connection for   */
+/* one of its sockets so a replaced configuration is only released   */
+/* once none of them can still be looking at it. The epoll           */
+/* registrations we've taken over for its sockets are kept with it   */
+#define REQUEST_SHARDS 64
+
+struct requestshard {
+  pthread_mutex_t lock;
+  struct connreq *free;
+  struct connreq *reaphead; /* Finished, oldest first */
+  struct connreq *reaptail;
+  struct epollwatch *watches;
+  int readers;
+} __attribute__((aligned(CONNREQ_ALIGN)));
+
+#ifdef USE_EPOLL
+/* While a socket's request is unfinished we hold its registration   */
+/* with each epoll instance it's added to, asking for the events the */
+/* negotiation needs as one shot events tagged with EPOLL_TAG and    */
+/* the socket. What the application asked for is put back once the   */
+/* request finishes, so it hears about the socket from the kernel.   */
+/* Registrations of IPv4 stream sockets that aren't connected yet    */
+/* are noted too, to be taken over if the socket gets a request      */
+struct epollwatch {
+  int epfd;
+  int sockid;
+  struct epoll_event event; /* As the application registered it */
+  struct epollwatch *next;
+};
+
+#define EPOLL_TAG 0x74736f6300000000ULL
+#define EPOLL_TAGMASK 0xffffffff00000000ULL
+#endif
+
+/* Structure representing a cached routing decision for a destination */
+struct routecache {
+  unsigned int seq;  /* Odd while the slot is being written */
+  unsigned int generation; /* Configuration the decision was made under */
+  uint32_t ip;       /* Destination address (network byte order) */
+  uint16_t port;     /* Destination port (network byte order) */
+  uint16_t verdict;  /* CACHE_EMPTY, CACHE_LOCAL or CACHE_PROXY */
   struct serverent *path;
+  struct sockaddr_in serveraddr;
+};
 
-  /* Current state of this proxied socket */
-  int state;
+/* Size of the route cache, must be a power of two */
+#define ROUTECACHE_BITS 9
+#define ROUTECACHE_SIZE (1 << ROUTECACHE_BITS)
 
-  /* Next state to go to when the send or receive is finished */
-  int nextstate;
+/* Route cache verdicts */
+#define CACHE_EMPTY 0
+#define CACHE_LOCAL 1
+#define CACHE_PROXY 2
+#define CACHE_INVALID 3 /* Never stored, no usable server */
 
-  /* When connections fail but an error number cannot be reported
-   * because the socket is non blocking we keep the connreq struct until
-   * the status is queried with connect() again, we then return
-   * this value */
-  int err;
+/* Structure identifying a version of a configuration file, if any */
+/* of these change the file is read again                           */
+struct confstamp {
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+};
+
+/* Minimum number of seconds between checks for a changed config */
+#define CONF_CHECK_INTERVAL 1
 
-  /* Events that were set for this socket upon call to select() or
-   * poll() */
-  int selectevents;
+/* Idle sockets to a path's SOCKS server, connected (and for version  */
+/* 5 authenticated) and waiting for a connect request. A pool belongs */
+/* to the configuration that was current when it was made, the thread */
+/* that fills the pools throws it away once that's replaced           */
+struct serverpool {
+  struct serverpool *next;
+  struct serverent *path;
+  struct parsedfile *config; /* Holds a reference */
+  struct sockaddr_in serveraddr;
+  int count;    /* Sockets in sockets[], oldest first */
+  int refill;   /* Fill the pool up again */
+  int failures; /* Attempts to fill it that failed in a row */
+  time_t retry; /* Don't try again before this after a failure */
+  int sockets[POOL_MAX];
+  time_t idlesince[POOL_MAX];
+};
 
-  /* Buffer for sending and receiving on the socket */
-  int datalen;
-  int datadone;
-  char buffer[1024];
+/* Seconds the pool thread gives the SOCKS server to get a socket ready, */
+/* and the most it waits before trying again after failures              */
+#define POOL_TIMEOUT 10
+#define POOL_BACKOFF 60
 
-  struct connreq *next;
+/* A request on a path with more than one server starts with the   */
+/* first, and if it hasn't finished within the path's failover     */
+/* delay the next is tried as well by a racer, and so on. The      */
+/* first to finish is moved onto the application's socket and the  */
+/* rest are closed. A blocking socket can't wait for more than one */
+/* server so all of its servers are tried by racers                */
+struct serverrace {
+  char *next;             /* Servers still to try, from the path's */
+                          /* failover list, NULL once all are      */
+  struct timespec start;  /* CLOCK_MONOTONIC time the next is tried */
+  int err;                /* Why the last racer that failed did */
+  struct connreq racers[RACE_MAX]; /* sockid is -1 for a free slot */
 };
 
 /* Connection statuses */
@@ -74,11 +360,18 @@ struct connreq {
 #define DONE 13
 #define FAILED 14
 
-/* Flags to indicate what events a socket was select()ed for */
-#define READ (1 << 0)
-#define WRITE (1 << 1)
-#define EXCEPT (1 << 2)
-#define READWRITE (READ | WRITE)
-#define READWRITEEXCEPT (READ | WRITE | EXCEPT)
+/* Pipelined SOCKS V5 negotiation, the method selection (and the */
+/* authentication if we have a password) and the connect request */
+/* go out together and the replies are read one after the other  */
+#define SENTV5PIPE 15
+#define GOTV5PIPEMETHOD 16
+#define SENTV5PIPEAUTH 17
+#define GOTV5PIPEAUTHMETHOD 18
+#define GOTV5PIPEAUTH 19
+
+/* A non blocking socket waiting for the broker's reply, which comes */
+/* on the request's broker descriptor. The socket itself is left     */
+/* alone until a SOCKS connection from the broker takes its place    */
+#define BROKERING 20
 
 #endif
@@ -0,0 +1,706 @@
+/*
+
+    TSOCKSD - Part of the tsocks package
+              This daemon keeps connections to the SOCKS servers in the
+              configuration made and authenticated, and hands them to
+              programs running under tsocks so that even short lived
+              ones don't wait for the SOCKS negotiation
+
+    Copyright (C) 2000 Shaun Clowes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Global configuration variables */
+char *progname = "tsocksd"; /* Name for error msgs      */
+
+/* Header Files */
+#include <arpa/inet.h>
+#include <common.h>
+#include <config.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "parser.h"
+#include "broker.h"
+
+/* Seconds a SOCKS server gets to make a connection ready, and the */
+/* most waited before trying it again after failures               */
+#define WARM_TIMEOUT 10
+#define WARM_BACKOFF 60
+
+/* Clients served at once, the rest wait to be accepted */
+#define MAXCLIENTS 64
+
+/* Structure representing one SOCKS server in the configuration */
+struct brokerserver {
+  struct serverent *path;
+  struct sockaddr_in serveraddr;
+  struct brokerserver *next;
+};
+
+/* Structure representing a client whose request is being read */
+struct brokerclient {
+  int sock;
+  int got;         /* Bytes of the request read so far */
+  time_t deadline; /* Given up on after this */
+  struct brokerrequest request;
+};
+
+/* Structure representing the idle connections to one server made */
+/* with one set of credentials, oldest first                      */
+struct brokerpool {
+  struct brokerpool *next;
+  struct brokerserver *server;
+  char user[256];
+  char pass[256];
+  int count;      /* Sockets in sockets[] */
+  int refill;     /* Fill the pool up again */
+  int failures;   /* Attempts to fill it that failed in a row */
+  int configured; /* Made for the configuration's credentials */
+  time_t retry;   /* Don't try again before this after a failure */
+  time_t used;    /* Last asked for */
+  int sockets[POOL_MAX];
+  time_t idlesince[POOL_MAX];
+};
+
+static struct parsedfile config;
+static struct brokerserver *servers = NULL;
+static struct brokerpool *pools = NULL;
+static int npools = 0;
+static int newpools = 0;    /* Pools made for programs since */
+static time_t newsince = 0; /* this time                      */
+static struct brokerclient clients[MAXCLIENTS];
+static int nclients = 0;
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolcond = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t stopping = 0;
+
+int find_servers(void);
+void add_server(struct serverent *path);
+int open_listener(char *socketname);
+void stop(int signum);
+void serve_clients(int listener);
+void accept_client(int listener, time_t now);
+int read_client(struct brokerclient *client);
+void serve_client(int client, struct brokerrequest *request);
+int take_socket(struct brokerrequest *request, int *status);
+struct brokerpool *find_pool(struct brokerserver *server, char *user,
+                             char *pass, int configured);
+void *fill_pools(void *arg);
+struct brokerpool *tend_pool(struct brokerpool *pool, time_t now,
+                             time_t *next);
+int stale_pool(struct brokerpool *pool, time_t now);
+void drop_pool(struct brokerpool **poolp);
+int warm_socket(struct brokerpool *pool);
+int negotiate_socksv5(int sock, struct brokerpool *pool);
+int pool_size(struct brokerpool *pool);
+int pool_idle(struct brokerpool *pool);
+
+int main(int argc, char *argv[]) {
+  char *usage = "Usage: [-f conf file] [-s socket] [-d]";
+  char *filename = NULL;
+  char *socketname = BROKER_SOCKET;
+  struct sigaction action;
+  struct brokerserver *server;
+  pthread_t thread;
+  sigset_t all, old;
+  int i, debug = 0, listener;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-d")) {
+      debug = 1;
+    } else if (!strcmp(argv[i], "-f") && (i + 1 < argc)) {
+      filename = argv[++i];
+    } else if (!strcmp(argv[i], "-s") && (i + 1 < argc)) {
+      socketname = argv[++i];
+    } else {
+      show_msg(MSGERR, "%s\n", usage);
+      exit(1);
+    }
+  }
+
+  /* With -d we stay in the foreground and say what we're doing */
+  set_log_options((debug ? MSGDEBUG : MSGERR), NULL, 1);
+
+  if (load_config(filename, &config) != 0)
+    exit(1);
+  if (!find_servers()) {
+    show_msg(MSGERR, "No SOCKS servers in the configuration use the "
+                     "broker\n");
+    exit(1);
+  }
+  if ((listener = open_listener(socketname)) == -1)
+    exit(1);
+
+  if (!debug && daemon(0, 0)) {
+    show_msg(MSGERR, "Could not run in the background (%s)\n",
+             strerror(errno));
+    unlink(socketname);
+    exit(1);
+  }
+
+  memset(&action, 0x0, sizeof(action));
+  action.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &action, NULL);
+  action.sa_handler = stop;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGHUP, &action, NULL);
+
+  /* Pools whose credentials the configuration settles are filled */
+  /* straight away, others once a program has asked for them      */
+  for (server = servers; server; server = server->next) {
+    if (server->path->type == 4)
+      find_pool(server, "", "", 1);
+    else if (server->path->defpass == NULL)
+      find_pool(server, "", "", 1);
+    else if (server->path->defuser)
+      find_pool(server, server->path->defuser, server->path->defpass, 1);
+  }
+
+  /* Signals are left to the main thread, they stop the poll() */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&thread, NULL, fill_pools, NULL)) {
+    show_msg(MSGERR, "Could not start the thread to fill pools\n");
+    unlink(socketname);
+    exit(1);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  while (!stopping)
+    serve_clients(listener);
+
+  unlink(socketname);
+  return (0);
+}
+
+/* Make a list of the SOCKS servers in the configuration whose paths */
+/* use the broker, returning how many there are                      */
+int find_servers(void) {
+  struct serverent *path;
+  int count = 0;
+
+  if (config.defaultserver.address &&
+      (config.defaultserver.flags & SERVER_BROKER)) {
+    add_server(&(config.defaultserver));
+    count++;
+  }
+  for (path = config.paths; path; path = path->next) {
+    if (path->address && (path->flags & SERVER_BROKER)) {
+      add_server(path);
+      count++;
+    }
+  }
+
+  return (count);
+}
+
+void add_server(struct serverent *path) {
+  struct brokerserver *server;
+  unsigned int res;
+
+  if ((res = resolve_ip(path->address, 0, HOSTNAMES)) == (unsigned int)-1) {
+    show_msg(MSGERR, "Could not resolve SOCKS server %s from line %d\n",
+             path->address, path->lineno);
+    return;
+  }
+  if ((server = calloc(1, sizeof(*server))) == NULL) {
+    show_msg(MSGERR, "Could not allocate memory for server\n");
+    exit(1);
+  }
+  server->path = path;
+  server->serveraddr.sin_family = AF_INET;
+  server->serveraddr.sin_addr.s_addr = res;
+  server->serveraddr.sin_port = htons(path->port);
+  server->next = servers;
+  servers = server;
+}
+
+/* Listen on the named socket, any user may connect to it since each */
+/* program brings its own credentials                                */
+int open_listener(char *socketname) {
+  struct sockaddr_un addr;
+  int sock;
+
+  memset(&addr, 0x0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketname) >= sizeof(addr.sun_path)) {
+    show_msg(MSGERR, "Socket name %s is too long\n", socketname);
+    return (-1);
+  }
+  strcpy(addr.sun_path, socketname);
+
+  /* Don't take over the socket of a broker that's still running */
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    show_msg(MSGERR, "Could not create socket (%s)\n", strerror(errno));
+    return (-1);
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    show_msg(MSGERR, "A broker is already listening on %s\n", socketname);
+    close(sock);
+    return (-1);
+  }
+  close(sock);
+  unlink(socketname);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                     0)) == -1) {
+    show_msg(MSGERR, "Could not create socket (%s)\n", strerror(errno));
+    return (-1);
+  }
+  if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+      (chmod(socketname, 0666) == -1) || (listen(sock, SOMAXCONN) == -1)) {
+    show_msg(MSGERR, "Could not listen on %s (%s)\n", socketname,
+             strerror(errno));
+    close(sock);
+    return (-1);
+  }
+
+  show_msg(MSGDEBUG, "Listening on %s\n", socketname);
+  return (sock);
+}
+
+void stop(int signum) { stopping = 1; }
+
+/* Wait for new clients and for the requests of those we have, a */
+/* client gets BROKER_TIMEOUT seconds to send its request         */
+void serve_clients(int listener) {
+  struct pollfd ufds[MAXCLIENTS + 1];
+  time_t now;
+  int i, done;
+
+  for (i = 0; i < nclients; i++) {
+    ufds[i].fd = clients[i].sock;
+    ufds[i].events = POLLIN;
+    ufds[i].revents = 0;
+  }
+  ufds[nclients].fd = (nclients < MAXCLIENTS ? listener : -1);
+  ufds[nclients].events = POLLIN;
+  ufds[nclients].revents = 0;
+
+  if (poll(ufds, nclients + 1, (nclients ? 1000 : -1)) == -1) {
+    if (errno != EINTR)
+      show_msg(MSGERR, "Could not wait for clients (%s)\n", strerror(errno));
+    return;
+  }
+
+  /* A finished client is replaced by the last, which has been seen to */
+  now = time(NULL);
+  for (i = nclients - 1; i >= 0; i--) {
+    done = (ufds[i].revents && !read_client(&(clients[i])));
+    if (!done && (clients[i].deadline <= now)) {
+      show_msg(MSGDEBUG, "Gave up waiting for a client's request\n");
+      done = 1;
+    }
+    if (done) {
+      close(clients[i].sock);
+      clients[i] = clients[--nclients];
+    }
+  }
+
+  if (ufds[nclients].revents & POLLIN)
+    accept_client(listener, now);
+}
+
+void accept_client(int listener, time_t now) {
+  int client;
+
+  if ((client = accept(listener, NULL, NULL)) == -1) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) &&
+        (errno != ECONNABORTED))
+      show_msg(MSGERR, "Could not accept a client (%s)\n", strerror(errno));
+    return;
+  }
+
+  memset(&(clients[nclients]), 0x0, sizeof(clients[nclients]));
+  clients[nclients].sock = client;
+  clients[nclients++].deadline = now + BROKER_TIMEOUT;
+}
+
+/* Read what a client has sent of its request, answering it once it's */
+/* all here. Returns 1 if there's more to come, 0 when we're done     */
+int read_client(struct brokerclient *client) {
+  int rc;
+
+  rc = recv(client->sock, (char *)&(client->request) + client->got,
+            sizeof(client->request) - client->got, MSG_DONTWAIT);
+  if ((rc == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                     (errno == EINTR)))
+    return (1);
+  if (rc <= 0)
+    return (0);
+
+  client->got += rc;
+  if (client->got < sizeof(client->request))
+    return (1);
+
+  serve_client(client->sock, &(client->request));
+  return (0);
+}
+
+/* Answer one request, passing the connection if there's one ready */
+void serve_client(int client, struct brokerrequest *request) {
+  struct brokerreply reply;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  int sock = -1;
+
+  memset(&reply, 0x0, sizeof(reply));
+  reply.version = BROKER_VERSION;
+  if (request->version != BROKER_VERSION) {
+    reply.status = EINVAL;
+  } else {
+    request->user[sizeof(request->user) - 1] = '\0';
+    request->pass[sizeof(request->pass) - 1] = '\0';
+    sock = take_socket(request, &(reply.status));
+  }
+
+  memset(&msg, 0x0, sizeof(msg));
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof(reply);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (sock != -1) {
+    memset(control, 0x0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+  }
+  if (sendmsg(client, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(reply))
+    show_msg(MSGDEBUG, "Could not reply to client (%s)\n", strerror(errno));
+
+  if (sock != -1)
+    close(sock);
+}
+
+/* Take the newest idle connection from the pool the request is for, */
+/* returning -1 with an errno value in status if there isn't one     */
+int take_socket(struct brokerrequest *request, int *status) {
+  struct brokerserver *server;
+  struct brokerpool *pool;
+  struct pollfd ufd;
+  int sock = -1;
+  time_t now = time(NULL);
+
+  for (server = servers; server; server = server->next)
+    if ((server->path->type == request->type) &&
+        (server->serveraddr.sin_addr.s_addr ==
+         request->serveraddr.sin_addr.s_addr) &&
+        (server->serveraddr.sin_port == request->serveraddr.sin_port))
+      break;
+  if (server == NULL) {
+    show_msg(MSGDEBUG, "Asked for a connection to unknown server %s\n",
+             inet_ntoa(request->serveraddr.sin_addr));
+    *status = EACCES;
+    return (-1);
+  }
+
+  pthread_mutex_lock(&poollock);
+  if ((pool = find_pool(server, request->user, request->pass, 0))) {
+    /* Anything to read on an idle socket means the server closed it */
+    while ((sock == -1) && pool->count) {
+      sock = pool->sockets[--(pool->count)];
+      ufd.fd = sock;
+      ufd.events = POLLIN;
+      ufd.revents = 0;
+      if ((pool->idlesince[pool->count] + pool_idle(pool) <= now) ||
+          poll(&ufd, 1, 0)) {
+        close(sock);
+        sock = -1;
+      }
+    }
+    pool->refill = 1;
+    pthread_cond_signal(&poolcond);
+  }
+  pthread_mutex_unlock(&poollock);
+
+  *status = (pool == NULL ? ENOMEM : (sock == -1 ? ENOENT : 0));
+  show_msg(MSGDEBUG, "%s connection to %s\n",
+           (sock == -1 ? "No idle" : "Handing out"),
+           inet_ntoa(request->serveraddr.sin_addr));
+  return (sock);
+}
+
+/* Find the pool for a server and credentials, making it if there */
+/* is room. Programs only get BROKER_NEWPOOLS new pools a minute, */
+/* the configuration's are always made. The pool lock must be     */
+/* held unless the thread filling the pools hasn't been started   */
+struct brokerpool *find_pool(struct brokerserver *server, char *user,
+                             char *pass, int configured) {
+  struct brokerpool *pool;
+  time_t now = time(NULL);
+
+  for (pool = pools; pool; pool = pool->next)
+    if ((pool->server == server) && !strcmp(pool->user, user) &&
+        !strcmp(pool->pass, pass)) {
+      pool->used = now;
+      return (pool);
+    }
+
+  if (!configured) {
+    if (newsince + 60 <= now) {
+      newsince = now;
+      newpools = 0;
+    }
+    if (newpools >= BROKER_NEWPOOLS) {
+      show_msg(MSGDEBUG, "Not making another pool for %s this minute\n",
+               inet_ntoa(server->serveraddr.sin_addr));
+      return (NULL);
+    }
+  }
+  if ((npools >= BROKER_MAXPOOLS) ||
+      ((pool = calloc(1, sizeof(*pool))) == NULL))
+    return (NULL);
+  if (!configured)
+    newpools++;
+
+  show_msg(MSGDEBUG, "Making a pool of %d connections to %s for user '%s'\n",
+           (server->path->poolsize ? server->path->poolsize : BROKER_POOL),
+           inet_ntoa(server->serveraddr.sin_addr), user);
+  pool->server = server;
+  strncpy(pool->user, user, sizeof(pool->user) - 1);
+  strncpy(pool->pass, pass, sizeof(pool->pass) - 1);
+  pool->refill = 1;
+  pool->configured = configured;
+  pool->used = now;
+  pool->next = pools;
+  pools = pool;
+  npools++;
+
+  return (pool);
+}
+
+/* Keep the pools filled, one connection at a time, closing those */
+/* that have been idle too long and dropping stale pools. Only    */
+/* this thread drops pools, and the lock is only let go while a   */
+/* connection is being made                                       */
+void *fill_pools(void *arg) {
+  struct brokerpool *pool, *fill, **poolp;
+  struct timespec until;
+  time_t now, next;
+  int sock, backoff;
+
+  pthread_mutex_lock(&poollock);
+  for (;;) {
+    now = time(NULL);
+    next = 0;
+    fill = NULL;
+    for (poolp = &pools; (pool = *poolp);) {
+      if (stale_pool(pool, now)) {
+        drop_pool(poolp);
+        continue;
+      }
+      if (tend_pool(pool, now, &next) && !fill)
+        fill = pool;
+      poolp = &(pool->next);
+    }
+
+    if (fill) {
+      pthread_mutex_unlock(&poollock);
+      sock = warm_socket(fill);
+      pthread_mutex_lock(&poollock);
+      now = time(NULL);
+      if (sock == -1) {
+        fill->failures++;
+        backoff = (fill->failures < 6 ? 1 << fill->failures : WARM_BACKOFF);
+        fill->retry = now + (backoff < WARM_BACKOFF ? backoff : WARM_BACKOFF);
+      } else if (fill->count < pool_size(fill)) {
+        fill->failures = 0;
+        fill->sockets[fill->count] = sock;
+        fill->idlesince[fill->count++] = now;
+      } else
+        close(sock);
+      continue;
+    }
+
+    if (next) {
+      until.tv_sec = next;
+      until.tv_nsec = 0;
+      pthread_cond_timedwait(&poolcond, &poollock, &until);
+    } else
+      pthread_cond_wait(&poolcond, &poollock);
+  }
+
+  return (arg);
+}
+
+/* Close a pool's connections that have been idle too long and work */
+/* out when it next needs looking at, returns the pool if it should */
+/* have a connection added to it now                                */
+struct brokerpool *tend_pool(struct brokerpool *pool, time_t now,
+                             time_t *next) {
+  time_t when;
+
+  while (pool->count && (pool->idlesince[0] + pool_idle(pool) <= now)) {
+    close(pool->sockets[0]);
+    pool->count--;
+    memmove(pool->sockets, pool->sockets + 1,
+            pool->count * sizeof(pool->sockets[0]));
+    memmove(pool->idlesince, pool->idlesince + 1,
+            pool->count * sizeof(pool->idlesince[0]));
+    if (pool->server->path->flags & SERVER_POOLALWAYS)
+      pool->refill = 1;
+  }
+  if (pool->count) {
+    when = pool->idlesince[0] + pool_idle(pool);
+    if (!*next || (when < *next))
+      *next = when;
+  }
+  if (!pool->configured) {
+    when = pool->used + BROKER_UNUSED;
+    if (!*next || (when < *next))
+      *next = when;
+  }
+
+  if (pool->count >= pool_size(pool))
+    pool->refill = 0;
+  if (!pool->refill)
+    return (NULL);
+  if (pool->retry <= now)
+    return (pool);
+
+  if (!*next || (pool->retry < *next))
+    *next = pool->retry;
+  return (NULL);
+}
+
+/* A pool made for a program is stale once filling it has failed   */
+/* BROKER_FAILURES times in a row, say because the credentials     */
+/* are wrong, or nobody has asked for it for BROKER_UNUSED seconds */
+int stale_pool(struct brokerpool *pool, time_t now) {
+  return (!pool->configured && ((pool->failures >= BROKER_FAILURES) ||
+                                (pool->used + BROKER_UNUSED <= now)));
+}
+
+/* Close a pool's connections and take it out of the list */
+void drop_pool(struct brokerpool **poolp) {
+  struct brokerpool *pool = *poolp;
+
+  show_msg(MSGDEBUG, "Dropping the pool of connections to %s for user "
+                     "'%s'\n",
+           inet_ntoa(pool->server->serveraddr.sin_addr), pool->user);
+  while (pool->count)
+    close(pool->sockets[--(pool->count)]);
+  *poolp = pool->next;
+  npools--;
+  free(pool);
+}
+
+/* Connect to a pool's server and take the connection as far as the */
+/* connect request, returning the socket or -1                      */
+int warm_socket(struct brokerpool *pool) {
+  struct brokerserver *server = pool->server;
+  struct timeval timeout;
+  int sock;
+
+  if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    return (-1);
+
+  /* The send timeout covers the connect() too */
+  timeout.tv_sec = WARM_TIMEOUT;
+  timeout.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  show_msg(MSGDEBUG, "Opening an idle connection to %s\n",
+           inet_ntoa(server->serveraddr.sin_addr));
+  if ((connect(sock, (struct sockaddr *)&(server->serveraddr),
+               sizeof(server->serveraddr)) == -1) ||
+      ((server->path->type == 5) && (negotiate_socksv5(sock, pool) == -1))) {
+    show_msg(MSGDEBUG, "Could not open an idle connection to %s (%s)\n",
+             inet_ntoa(server->serveraddr.sin_addr),
+             (errno ? strerror(errno) : "refused"));
+    close(sock);
+    return (-1);
+  }
+
+  /* The programs get the connection without our timeouts */
+  timeout.tv_sec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  return (sock);
+}
+
+/* Select the authentication method and authenticate, only offering */
+/* username and password authentication if we have a password       */
+int negotiate_socksv5(int sock, struct brokerpool *pool) {
+  unsigned char buffer[515];
+  int ulen = strlen(pool->user), plen = strlen(pool->pass);
+  int len;
+
+  buffer[0] = 0x05;
+  buffer[1] = (plen ? 2 : 1);
+  buffer[2] = 0x00;
+  buffer[3] = 0x02;
+  if (send(sock, buffer, buffer[1] + 2, MSG_NOSIGNAL) != buffer[1] + 2)
+    return (-1);
+
+  errno = 0;
+  if ((recv(sock, buffer, 2, MSG_WAITALL) != 2) || (buffer[0] != 0x05))
+    return (-1);
+  if (buffer[1] == 0x00)
+    return (0);
+  if ((buffer[1] != 0x02) || !plen || (ulen > 255) || (plen > 255))
+    return (-1);
+
+  buffer[0] = 0x01;
+  buffer[1] = ulen;
+  memcpy(buffer + 2, pool->user, ulen);
+  buffer[2 + ulen] = plen;
+  memcpy(buffer + 3 + ulen, pool->pass, plen);
+  len = 3 + ulen + plen;
+  if (send(sock, buffer, len, MSG_NOSIGNAL) != len)
+    return (-1);
+
+  errno = 0;
+  if ((recv(sock, buffer, 2, MSG_WAITALL) != 2) || (buffer[1] != 0x00))
+    return (-1);
+
+  return (0);
+}
+
+/* A pool holds as many connections as its path's pool directive */
+/* says, or BROKER_POOL if it has none                           */
+int pool_size(struct brokerpool *pool) {
+  return (pool->server->path->poolsize ? pool->server->path->poolsize
+                                       : BROKER_POOL);
+}
+
+int pool_idle(struct brokerpool *pool) {
+  return (pool->server->path->poolidle ? pool->server->path->poolidle
+                                       : POOL_IDLE);
+}
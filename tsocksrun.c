@@ -0,0 +1,120 @@
+/*
+
+    TSOCKSRUN - Part of the tsocks package
+                This utility runs a program under tsocks, reading the
+                configuration once and handing the compiled result to
+                the program and all of its children
+
+    Copyright (C) 2000 Shaun Clowes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Global configuration variables */
+char *progname = "tsocksrun"; /* Name for error msgs      */
+
+/* Header Files */
+#include <common.h>
+#include <config.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "parser.h"
+
+#ifndef LIBTSOCKS
+#define LIBTSOCKS "/usr/lib/libtsocks.so"
+#endif
+
+void set_preload(char *);
+
+int main(int argc, char *argv[]) {
+  char *usage = "Usage: [-f conf file] [program [program arguments...]]";
+  char *filename = NULL;
+  char *shell[2];
+  char fdstr[16];
+  struct parsedfile config;
+  int i = 1, fd = -1;
+
+  if ((argc > 1) && !strcmp(argv[1], "-f")) {
+    if (argc < 3) {
+      show_msg(MSGERR, "%s\n", usage);
+      exit(1);
+    }
+    filename = argv[2];
+    i = 3;
+  } else if ((argc > 1) && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "-?"))) {
+    show_msg(MSGERR, "%s\n", usage);
+    exit(0);
+  }
+
+  /* The programs we run need to watch the same file we read */
+  if (filename)
+    setenv("TSOCKS_CONF_FILE", filename, 1);
+  else
+    filename = getenv("TSOCKS_CONF_FILE");
+
+  /* Compile the configuration into a sealed memfd, if that isn't */
+  /* possible the programs just read the configuration themselves */
+  if (load_config(filename, &config) == 0)
+    fd = write_config_memfd(filename, &config);
+  if (fd != -1) {
+    sprintf(fdstr, "%d", fd);
+    setenv(IMAGE_FD_ENV, fdstr, 1);
+  } else {
+    unsetenv(IMAGE_FD_ENV);
+  }
+
+  set_preload(LIBTSOCKS);
+
+  /* With no program to run start a shell like the tsocks script */
+  if (i >= argc) {
+    shell[0] = getenv("SHELL");
+    if ((shell[0] == NULL) || (*shell[0] == '\0'))
+      shell[0] = "/bin/sh";
+    shell[1] = NULL;
+    execv(shell[0], shell);
+    show_msg(MSGERR, "Could not run %s (%s)\n", shell[0], strerror(errno));
+  } else {
+    execvp(argv[i], &(argv[i]));
+    show_msg(MSGERR, "Could not run %s (%s)\n", argv[i], strerror(errno));
+  }
+
+  return (1);
+}
+
+/* Put libtsocks at the front of LD_PRELOAD unless it's already there */
+void set_preload(char *lib) {
+  char *preload, *newpreload;
+
+  preload = getenv("LD_PRELOAD");
+  if ((preload == NULL) || (*preload == '\0')) {
+    setenv("LD_PRELOAD", lib, 1);
+    return;
+  }
+  if (strstr(preload, lib))
+    return;
+
+  if ((newpreload = malloc(strlen(lib) + strlen(preload) + 2)) == NULL)
+    exit(1);
+  sprintf(newpreload, "%s %s", lib, preload);
+  setenv("LD_PRELOAD", newpreload, 1);
+  free(newpreload);
+}
@@ -36,21 +36,79 @@ char *progname = "validateconf"; /* Name for error msgs      */
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "parser.h"
+#include "route.h"
+#include "classify.h"
+
+/* Maximum length of a line in a file of destinations for -b */
+#define MAXLINE BUFSIZ
+
+/* The optimizer ranks networks by the group they put a destination */
+/* in, paths by number ahead of local networks ahead of no match    */
+#define OPT_LOCAL (ROUTE_NONE - 1)
+#define OPT_DEFAULT ROUTE_NONE
+
+/* Structure representing one network while the optimizer works */
+struct optrule {
+  uint32_t start; /* First and last address covered (host byte */
+  uint32_t end;   /* order), only bounds if irregular            */
+  uint32_t mask;
+  uint32_t startport;
+  uint32_t endport;
+  uint32_t group;           /* Path number, or OPT_LOCAL */
+  struct serverent *server; /* Path it belongs to, NULL if local */
+  int irregular;            /* Netmask isn't a prefix, left alone */
+  int fixed;                /* Loopback network the parser adds */
+  int removed;
+};
 
 void show_server(struct parsedfile *, struct serverent *, int);
 void show_conf(struct parsedfile *config);
 void test_host(struct parsedfile *config, char *);
+void bulk_test(struct parsedfile *config, char *);
+int read_destinations(char *, struct in_addr **, unsigned int **);
+double elapsed_ns(struct timespec *, struct timespec *);
+int write_source(struct parsedfile *config, char *, char *);
+void write_node(FILE *, struct routeindex *, uint32_t, int);
+void write_server(FILE *, struct serverent *, char *, char *);
+void write_string(FILE *, char *);
+int optimize_conf(struct parsedfile *config, char *, char *);
+int collect_rules(struct parsedfile *config, struct optrule **);
+struct optrule *grow_rules(struct optrule **, int *, int *);
+int remove_redundant(struct optrule *, int, int);
+int rule_decides(struct optrule *, int, int, uint32_t *, int, uint32_t *, int,
+                 int);
+uint32_t best_group(struct optrule *, int, int, uint32_t, uint32_t, int);
+uint32_t *rule_breaks(struct optrule *, int, struct optrule *, int, int,
+                      int *);
+int aggregate_rules(struct optrule **, int);
+int verify_rules(struct optrule *, int, struct optrule *, int);
+void write_optimized(FILE *, struct parsedfile *config, char *,
+                     struct optrule *, int, uint32_t *);
+void write_settings(FILE *, struct serverent *, char *);
+void write_rule(FILE *, char *, struct optrule *, char *);
+void show_rule(struct optrule *, char *);
+int compare_uint32(const void *, const void *);
+int compare_optrules(const void *, const void *);
+int compare_keys(const void *, const void *);
+int compare_sizes(const void *, const void *);
 
 int main(int argc, char *argv[]) {
-  char *usage = "Usage: [-f conf file] [-t hostname/ip[:port]]";
+  char *usage = "Usage: [-f conf file] [-t hostname/ip[:port]] "
+                "[-b file of hostnames/ips[:port] or -] [-o image file] "
+                "[-g C source file] [-O optimized conf file]";
   char *filename = NULL;
   char *testhost = NULL;
+  char *bulkfile = NULL;
+  char *imagefile = NULL;
+  char *sourcefile = NULL;
+  char *optfile = NULL;
   struct parsedfile config;
   int i;
 
-  if ((argc > 5) || (((argc - 1) % 2) != 0)) {
+  if ((argc > 13) || (((argc - 1) % 2) != 0)) {
     show_msg(MSGERR, "Invalid number of arguments\n");
     show_msg(MSGERR, "%s\n", usage);
     exit(1);
@@ -61,6 +119,14 @@ int main(int argc, char *argv[]) {
       filename = argv[(i + 1)];
     } else if (!strcmp(argv[i], "-t")) {
       testhost = argv[(i + 1)];
+    } else if (!strcmp(argv[i], "-b")) {
+      bulkfile = argv[(i + 1)];
+    } else if (!strcmp(argv[i], "-o")) {
+      imagefile = argv[(i + 1)];
+    } else if (!strcmp(argv[i], "-g")) {
+      sourcefile = argv[(i + 1)];
+    } else if (!strcmp(argv[i], "-O")) {
+      optfile = argv[(i + 1)];
     } else {
       show_msg(MSGERR, "Unknown option %s\n", argv[i]);
       show_msg(MSGERR, "%s\n", usage);
@@ -77,9 +143,37 @@ int main(int argc, char *argv[]) {
   else
     exit(1);
 
-  /* If they specified a test host, test it, otherwise */
-  /* dump the configuration                            */
-  if (!testhost)
+  /* If they asked for a compiled image write it out */
+  if (imagefile) {
+    printf("Writing configuration image %s...\n", imagefile);
+    if (write_config_image(imagefile, filename, &config) == 0)
+      printf("... Write complete\n\n");
+    else
+      exit(1);
+  }
+
+  /* If they asked for C source for libtsocks-static write it out */
+  if (sourcefile) {
+    printf("Writing configuration source %s...\n", sourcefile);
+    if (write_source(&config, filename, sourcefile) == 0)
+      printf("... Write complete\n\n");
+    else
+      exit(1);
+  }
+
+  /* If they asked for an optimized configuration report on the */
+  /* networks that aren't needed and write it out                 */
+  if (optfile) {
+    if (optimize_conf(&config, filename, optfile))
+      exit(1);
+    return (0);
+  }
+
+  /* If they specified a test host (or a file of them), test it, */
+  /* otherwise dump the configuration                             */
+  if (bulkfile)
+    bulk_test(&config, bulkfile);
+  else if (!testhost)
     show_conf(&config);
   else
     test_host(&config, testhost);
@@ -125,8 +219,200 @@ void test_host(struct parsedfile *config, char *host) {
   return;
 }
 
+/* Classify every destination in a file (one IP[:port] per line) the */
+/* way libtsocks would and report where they went and how long it    */
+/* took, so a configuration can be sized against real traffic        */
+void bulk_test(struct parsedfile *config, char *bulkfile) {
+  struct routeindex *index = config->index;
+  struct serverent *server, *path;
+  struct netent *net;
+  struct in_addr *addrs;
+  struct timespec start, end;
+  unsigned int *ports;
+  unsigned long verdicts[3] = {0, 0, 0};
+  unsigned long *pathhits, *rulehits;
+  double single, batch;
+  uint32_t pathno, rule, n;
+  int count, i, verdict;
+
+  if ((count = read_destinations(bulkfile, &addrs, &ports)) < 0)
+    return;
+  if (count == 0) {
+    printf("No destinations to classify\n");
+    return;
+  }
+
+  /* Time the lookups libtsocks makes for each connect() */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++) {
+    if (is_local(config, &(addrs[i]), ports[i]))
+      pick_server(config, &path, &(addrs[i]), ports[i]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  single = elapsed_ns(&start, &end);
+
+  /* And the same destinations as one batch through classify_batch() */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  classify_batch(config, addrs, ports, count, 0, NULL, NULL, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  batch = elapsed_ns(&start, &end);
+
+  /* Now work out which rule decided each destination, making the */
+  /* same pair of lookups as is_local() and pick_server()         */
+  if (((pathhits = calloc(index->npaths + 1, sizeof(*pathhits))) == NULL) ||
+      ((rulehits = calloc(index->nrules + index->nfiles + 1,
+                          sizeof(*rulehits))) == NULL)) {
+    fprintf(stderr, "Error: Out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < count; i++) {
+    verdict = route_lookup(index, &(addrs[i]), ports[i], !ports[i], &pathno,
+                           &rule);
+    if (verdict != ROUTE_LOCAL)
+      verdict = route_lookup(index, &(addrs[i]), ports[i], 0, &pathno, &rule);
+    if (verdict == ROUTE_LOCAL) {
+      verdicts[ROUTE_LOCAL]++;
+      rulehits[rule]++;
+    } else if (verdict == ROUTE_PATH) {
+      verdicts[ROUTE_PATH]++;
+      pathhits[pathno]++;
+      rulehits[rule]++;
+    } else {
+      verdicts[ROUTE_DEFAULT]++;
+    }
+  }
+
+  printf("Classified %d destinations\n", count);
+  printf("Local:              %10lu (%5.1f%%)\n", verdicts[ROUTE_LOCAL],
+         100.0 * verdicts[ROUTE_LOCAL] / count);
+  printf("Via a path:         %10lu (%5.1f%%)\n", verdicts[ROUTE_PATH],
+         100.0 * verdicts[ROUTE_PATH] / count);
+  printf("Via default server: %10lu (%5.1f%%)\n", verdicts[ROUTE_DEFAULT],
+         100.0 * verdicts[ROUTE_DEFAULT] / count);
+  printf("is_local()/pick_server(): %8.1f ns per lookup\n", single / count);
+  printf("classify_batch() (%s):  %8.1f ns per lookup\n",
+         index->classifier->name, batch / count);
+  printf("\n");
+
+  /* Rules are numbered by path and then local networks, the */
+  /* order build_route_index() gives them                    */
+  printf("=== Hits by path and network ===\n");
+  rule = 0;
+  for (server = config->paths, n = 0; server != NULL;
+       server = server->next, n++) {
+    printf("Path (line no %d in configuration file): %lu\n", server->lineno,
+           pathhits[n]);
+    for (net = server->reachnets; net != NULL; net = net->next, rule++) {
+      printf("  Network: %15s ", inet_ntoa(net->localip));
+      printf("NetMask: %15s ", inet_ntoa(net->localnet));
+      if (net->startport)
+        printf("Ports: %5lu - %5lu ", net->startport, net->endport);
+      printf("%10lu\n", rulehits[rule]);
+    }
+    for (i = 0; i < index->nfiles; i++)
+      if (index->files[i].path == n)
+        printf("  Networks in file: %s %lu\n", index->files[i].filename,
+               rulehits[index->nrules + i]);
+  }
+  printf("Local networks: %lu\n", verdicts[ROUTE_LOCAL]);
+  for (net = config->localnets; net != NULL; net = net->next, rule++) {
+    printf("  Network: %15s ", inet_ntoa(net->localip));
+    printf("NetMask: %15s ", inet_ntoa(net->localnet));
+    if (net->startport)
+      printf("Ports: %5lu - %5lu ", net->startport, net->endport);
+    printf("%10lu\n", rulehits[rule]);
+  }
+  for (i = 0; i < index->nfiles; i++)
+    if (index->files[i].path == ROUTE_NONE)
+      printf("  Networks in file: %s %lu\n", index->files[i].filename,
+             rulehits[index->nrules + i]);
+  printf("Default server: %lu\n", verdicts[ROUTE_DEFAULT]);
+
+  free(pathhits);
+  free(rulehits);
+  free(addrs);
+  free(ports);
+}
+
+/* Read a file of destinations for bulk_test(), "-" is standard */
+/* input. Names aren't resolved, there may be millions of them, */
+/* so lines that aren't an IP address are counted and skipped.  */
+/* Returns the number of destinations or -1 on error            */
+int read_destinations(char *bulkfile, struct in_addr **addrs,
+                      unsigned int **ports) {
+  char line[MAXLINE];
+  char *text, *host, *port, *end;
+  char separator;
+  int count = 0, space = 0, skipped = 0;
+  long portnum;
+  FILE *in;
+
+  if (!strcmp(bulkfile, "-")) {
+    in = stdin;
+  } else if ((in = fopen(bulkfile, "r")) == NULL) {
+    fprintf(stderr, "Error: Could not open %s (%s)\n", bulkfile,
+            strerror(errno));
+    return (-1);
+  }
+
+  *addrs = NULL;
+  *ports = NULL;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if ((text = strchr(line, '#')) != NULL)
+      *text = '\0';
+    text = line + strspn(line, " \t\r\n");
+    if (*text == '\0')
+      continue;
+
+    if (count == space) {
+      space = (space ? space * 2 : 4096);
+      if (((*addrs = realloc(*addrs, space * sizeof(**addrs))) == NULL) ||
+          ((*ports = realloc(*ports, space * sizeof(**ports))) == NULL)) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+      }
+    }
+
+    /* A port, if there is one, must be a decimal number from 1 */
+    /* to 65535, 0 would mean any port                          */
+    host = strsplit(&separator, &text, ": \t\r\n");
+    (*ports)[count] = 0;
+    portnum = 0;
+    if (separator == ':') {
+      port = strsplit(NULL, &text, " \t\r\n");
+      errno = 0;
+      portnum = (port ? strtol(port, &end, 10) : -1);
+      if (!port || (errno != 0) || (end == port) || (*end != '\0'))
+        portnum = -1;
+      (*ports)[count] = portnum;
+    }
+    if (!inet_aton(host, &((*addrs)[count])) ||
+        ((separator == ':') && ((portnum < 1) || (portnum > 65535)))) {
+      skipped++;
+      continue;
+    }
+    count++;
+  }
+
+  if (in != stdin)
+    fclose(in);
+  if (skipped)
+    fprintf(stderr, "Warning: Skipped %d lines which weren't an "
+                    "IP address with an optional port\n",
+            skipped);
+
+  return (count);
+}
+
+/* Nanoseconds between two readings of CLOCK_MONOTONIC */
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+  return ((end->tv_sec - start->tv_sec) * 1e9 +
+          (end->tv_nsec - start->tv_nsec));
+}
+
 void show_conf(struct parsedfile *config) {
   struct netent *net;
+  struct fileent *file;
   struct serverent *server;
 
   /* Show the local networks */
@@ -137,6 +423,8 @@ void show_conf(struct parsedfile *config) {
     printf("NetMask: %15s\n", inet_ntoa(net->localnet));
     net = net->next;
   }
+  for (file = config->localfiles; file != NULL; file = file->next)
+    printf("Networks in file: %s\n", file->filename);
   printf("\n");
 
   /* If we have a default server configuration show it */
@@ -168,6 +456,7 @@ void show_conf(struct parsedfile *config) {
 void show_server(struct parsedfile *config, struct serverent *server, int def) {
   struct in_addr res;
   struct netent *net;
+  struct fileent *file;
 
   /* Show address */
   if (server->address != NULL)
@@ -184,12 +473,29 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
     fprintf(stderr, "Error: Server is not on a network "
                     "specified as local\n");
 
+  /* Show the servers tried if that one is slow or down */
+  if (server->failover)
+    printf("Failover:     %s (after %d ms each)\n", server->failover,
+           (server->failoverdelay ? server->failoverdelay : FAILOVER_DELAY));
+
   /* Show port */
   printf("Port:         %d\n", server->port);
 
   /* Show SOCKS type */
   printf("SOCKS type:   %d\n", server->type);
 
+  printf("Fast open:    %s\n",
+         (server->flags & SERVER_FASTOPEN) ? "Yes" : "No");
+  printf("Optimistic:   %s\n",
+         (server->flags & SERVER_OPTIMISTIC) ? "Yes" : "No");
+  if (server->poolsize)
+    printf("Pool:         %d sockets, kept %d seconds, refilled %s\n",
+           server->poolsize,
+           (server->poolidle ? server->poolidle : POOL_IDLE),
+           (server->flags & SERVER_POOLALWAYS) ? "always" : "when used");
+  else
+    printf("Pool:         None\n");
+
   /* Show default username and password info */
   if (server->type == 5) {
     /* Show the default user info */
@@ -200,6 +506,8 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
     if ((server->defuser == NULL) && (server->defpass != NULL))
       fprintf(stderr, "Error: Default user must be specified "
                       "if default pass is specified\n");
+    printf("Pipelining:   %s\n",
+           (server->flags & SERVER_PIPELINE) ? "Yes" : "No");
   } else {
     if (server->defuser)
       printf("Default user: %s\n", server->defuser);
@@ -209,6 +517,9 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
       fprintf(stderr, "Error: Default user and password "
                       "may only be specified for version 5 "
                       "servers\n");
+    if (server->flags & SERVER_PIPELINE)
+      fprintf(stderr, "Error: Pipelining may only be turned on for "
+                      "version 5 servers\n");
   }
 
   /* If this is the default servers and it has reachnets, thats stupid */
@@ -221,7 +532,7 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
                       "which is not specified in a reach statement "
                       "for other servers\n");
     }
-  } else if (server->reachnets == NULL) {
+  } else if ((server->reachnets == NULL) && (server->reachfiles == NULL)) {
     fprintf(stderr, "Error: No reach statements specified for "
                     "server, this server will never be used\n");
   } else {
@@ -235,5 +546,809 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
       printf("\n");
       net = net->next;
     }
+    for (file = server->reachfiles; file != NULL; file = file->next)
+      printf("Networks in file: %s\n", file->filename);
+  }
+}
+
+/* Write the configuration out as C source for libtsocks-static. The */
+/* servers become static data and the routing trie is unrolled into  */
+/* a decision tree of nested prefix tests                            */
+int write_source(struct parsedfile *config, char *filename,
+                 char *sourcefile) {
+  struct routeindex *index = config->index;
+  struct routeirreg *irreg;
+  char next[64];
+  uint32_t i;
+  FILE *out;
+
+  if ((out = fopen(sourcefile, "w")) == NULL) {
+    fprintf(stderr, "Error: Could not open %s for writing (%s)\n", sourcefile,
+            strerror(errno));
+    return (1);
+  }
+
+  fprintf(out, "/* Generated by validateconf from %s, do not edit */\n\n",
+          filename);
+  fprintf(out, "#include <config.h>\n"
+               "#include <arpa/inet.h>\n"
+               "#include <netinet/in.h>\n"
+               "#include <stdlib.h>\n"
+               "#include <string.h>\n"
+               "#include \"parser.h\"\n"
+               "#include \"route.h\"\n\n");
+
+  /* The servers, in path number order */
+  if (index->npaths) {
+    fprintf(out, "static struct serverent static_paths[%u] = {\n",
+            index->npaths);
+    for (i = 0; i < index->npaths; i++) {
+      if (i + 1 < index->npaths)
+        sprintf(next, "&(static_paths[%u])", i + 1);
+      else
+        strcpy(next, "NULL");
+      write_server(out, index->paths[i], next, ",");
+    }
+    fprintf(out, "};\n\n");
+  }
+
+  fprintf(out, "static struct serverent static_default =\n");
+  write_server(out, &(config->defaultserver), "NULL", ";");
+  fprintf(out, "\n");
+
+  fprintf(out, "static struct serverent *static_pathtab[%u] = {\n",
+          index->npaths + 1);
+  for (i = 0; i < index->npaths; i++)
+    fprintf(out, "    &(static_paths[%u]),\n", i);
+  fprintf(out, "    NULL};\n\n");
+
+  /* Prefix files are still read at run time, when first needed */
+  if (index->nfiles) {
+    fprintf(out, "static struct prefixfile static_files[%u] = {\n",
+            index->nfiles);
+    for (i = 0; i < index->nfiles; i++) {
+      fprintf(out, "    {.filename = ");
+      write_string(out, index->files[i].filename);
+      if (index->files[i].path == ROUTE_NONE)
+        fprintf(out, ", .path = ROUTE_NONE}");
+      else
+        fprintf(out, ", .path = %u}", index->files[i].path);
+      fprintf(out, "%s\n", (i + 1 < index->nfiles ? "," : "};\n"));
+    }
+  }
+
+  /* The matcher itself */
+  fprintf(out,
+          "static int static_route_lookup(struct in_addr *addr, "
+          "unsigned int port,\n"
+          "                               int anyport, uint32_t *path, "
+          "uint32_t *rule) {\n"
+          "  uint32_t ip = ntohl(addr->s_addr);\n"
+          "  uint32_t best = ROUTE_NONE;\n"
+          "  uint32_t bestrule = 0;\n"
+          "  uint32_t local = 0;\n\n");
+  write_node(out, index, 0, 1);
+
+  for (i = 0; i < index->nirreg; i++) {
+    irreg = &(index->irreg[i]);
+    fprintf(out, "  if ((ip & 0x%08xU) == 0x%08xU) {\n", irreg->mask,
+            irreg->net);
+    if (irreg->ent.path == ROUTE_NONE)
+      fprintf(out, "    if (!local)\n      local = %u;\n",
+              irreg->ent.rule + 1);
+    else if (irreg->ent.startport)
+      fprintf(out,
+              "    if ((best > %u) && (anyport || ((port >= %u) && "
+              "(port <= %u)))) {\n"
+              "      best = %u;\n      bestrule = %u;\n    }\n",
+              irreg->ent.path, irreg->ent.startport, irreg->ent.endport,
+              irreg->ent.path, irreg->ent.rule);
+    else
+      fprintf(out,
+              "    if (best > %u) {\n"
+              "      best = %u;\n      bestrule = %u;\n    }\n",
+              irreg->ent.path, irreg->ent.path, irreg->ent.rule);
+    fprintf(out, "  }\n");
+  }
+
+  fprintf(out, "\n"
+               "  if (best != ROUTE_NONE) {\n"
+               "    if (path)\n"
+               "      *path = best;\n"
+               "    if (rule)\n"
+               "      *rule = bestrule;\n"
+               "    return (ROUTE_PATH);\n"
+               "  } else if (local) {\n"
+               "    if (rule)\n"
+               "      *rule = local - 1;\n"
+               "    return (ROUTE_LOCAL);\n"
+               "  }\n\n"
+               "  return (ROUTE_DEFAULT);\n"
+               "}\n\n");
+
+  fprintf(out,
+          "static struct routeindex static_index = {\n"
+          "    .npaths = %u,\n"
+          "    .nrules = %u,\n"
+          "    .paths = static_pathtab,\n"
+          "    .nfiles = %u,\n"
+          "    .files = %s,\n"
+          "    .compiled = static_route_lookup};\n\n",
+          index->npaths, index->nrules, index->nfiles,
+          (index->nfiles ? "static_files" : "NULL"));
+
+  fprintf(out, "int load_static_config(struct parsedfile *config) {\n\n"
+               "  memset(config, 0x0, sizeof(*config));\n"
+               "  memcpy(&(config->defaultserver), &static_default,\n"
+               "         sizeof(config->defaultserver));\n");
+  fprintf(out, "  config->paths = %s;\n",
+          (index->npaths ? "&(static_paths[0])" : "NULL"));
+  fprintf(out, "  config->index = &static_index;\n\n"
+               "  return (0);\n"
+               "}\n");
+
+  if (ferror(out) | fclose(out)) {
+    fprintf(stderr, "Error: Could not write %s (%s)\n", sourcefile,
+            strerror(errno));
+    return (1);
+  }
+
+  return (0);
+}
+
+/* Write the tests for one trie node and everything below it */
+void write_node(FILE *out, struct routeindex *index, uint32_t n, int depth) {
+  struct routenode *node = &(index->nodes[n]);
+  struct routeent *ent;
+  uint32_t bit, i;
+  int indent = depth * 2;
+
+  if (node->plen) {
+    fprintf(out, "%*sif ((ip & 0x%08xU) == 0x%08xU) {\n", indent, "",
+            (0xffffffffU << (32 - node->plen)), node->prefix);
+    indent += 2;
+  }
+
+  if (node->local)
+    fprintf(out, "%*sif (!local)\n%*slocal = %u;\n", indent, "", indent + 2,
+            "", node->local);
+
+  /* Entries are in path order so only the first match counts */
+  for (i = 0; i < node->nents; i++) {
+    ent = &(index->ents[node->firstent + i]);
+    fprintf(out, "%*s%sif (", (i ? 1 : indent), "", (i ? "else " : ""));
+    if (ent->startport)
+      fprintf(out,
+              "(best > %u) && (anyport || ((port >= %u) && (port <= %u)))",
+              ent->path, ent->startport, ent->endport);
+    else
+      fprintf(out, "best > %u", ent->path);
+    fprintf(out, ") {\n%*sbest = %u;\n%*sbestrule = %u;\n%*s}", indent + 2,
+            "", ent->path, indent + 2, "", ent->rule, indent, "");
+    if (i + 1 == node->nents)
+      fprintf(out, "\n");
+  }
+
+  if (node->plen < 32) {
+    bit = 1U << (31 - node->plen);
+    if (node->child[0] && node->child[1]) {
+      fprintf(out, "%*sif (ip & 0x%08xU) {\n", indent, "", bit);
+      write_node(out, index, node->child[1], (indent / 2) + 1);
+      fprintf(out, "%*s} else {\n", indent, "");
+      write_node(out, index, node->child[0], (indent / 2) + 1);
+      fprintf(out, "%*s}\n", indent, "");
+    } else if (node->child[0] || node->child[1]) {
+      write_node(out, index,
+                 (node->child[0] ? node->child[0] : node->child[1]),
+                 indent / 2);
+    }
+  }
+
+  if (node->plen)
+    fprintf(out, "%*s}\n", indent - 2, "");
+}
+
+void write_server(FILE *out, struct serverent *server, char *next,
+                  char *term) {
+
+  fprintf(out, "    {.lineno = %d,\n     .address = ", server->lineno);
+  write_string(out, server->address);
+  fprintf(out, ",\n     .port = %d,\n     .type = %d,\n     .defuser = ",
+          server->port, server->type);
+  write_string(out, server->defuser);
+  fprintf(out, ",\n     .defpass = ");
+  write_string(out, server->defpass);
+  fprintf(out,
+          ",\n     .flags = %d,\n     .poolsize = %d,\n     .poolidle = %d,"
+          "\n     .failover = ",
+          server->flags, server->poolsize, server->poolidle);
+  write_string(out, server->failover);
+  fprintf(out, ",\n     .failoverdelay = %d,\n     .next = %s}%s\n",
+          server->failoverdelay, next, term);
+}
+
+void write_string(FILE *out, char *value) {
+
+  if (value == NULL) {
+    fprintf(out, "NULL");
+    return;
+  }
+
+  fputc('"', out);
+  for (; *value; value++) {
+    if ((*value == '"') || (*value == '\\'))
+      fprintf(out, "\\%c", *value);
+    else if ((*value < ' ') || (*value > '~'))
+      fprintf(out, "\\%03o", (unsigned char)*value);
+    else
+      fputc(*value, out);
+  }
+  fputc('"', out);
+}
+
+/* Find the networks in a configuration that never make a difference, */
+/* merge the rest where they can be and write out the result. Before  */
+/* the new file replaces optfile it is read back in and checked to    */
+/* classify every destination and port exactly as the original does  */
+int optimize_conf(struct parsedfile *config, char *filename, char *optfile) {
+  struct parsedfile newconfig;
+  struct serverent *server;
+  struct optrule *orig, *work, *reread;
+  uint32_t *pathmap, path, kept;
+  char tmpname[MAXLINE];
+  int norig, nwork, nreread, before = 0, after = 0, i, rc = 0;
+  FILE *out;
+
+  norig = collect_rules(config, &orig);
+  if (((work = malloc((norig + 1) * sizeof(*work))) == NULL) ||
+      ((pathmap = malloc((config->index->npaths + 1) * sizeof(*pathmap))) ==
+       NULL)) {
+    fprintf(stderr, "Error: Out of memory\n");
+    exit(1);
+  }
+  memcpy(work, orig, norig * sizeof(*work));
+  nwork = norig;
+
+  printf("=== Networks that make no difference ===\n");
+  if (remove_redundant(work, nwork, 1) == 0)
+    printf("None\n");
+  printf("\n");
+
+  /* Merging can leave pieces that are hidden in turn */
+  nwork = aggregate_rules(&work, nwork);
+  remove_redundant(work, nwork, 0);
+
+  /* Paths left with nothing to reach are dropped, the rest keep */
+  /* their order so they're renumbered from the front            */
+  for (server = config->paths, path = 0, kept = 0; server != NULL;
+       server = server->next, path++) {
+    for (i = 0; i < nwork; i++)
+      if (!work[i].removed && (work[i].group == path))
+        break;
+    if ((i == nwork) && (server->reachfiles == NULL)) {
+      printf("Path at line %d is never used and has been removed\n",
+             server->lineno);
+      pathmap[path] = ROUTE_NONE;
+    } else {
+      pathmap[path] = kept++;
+    }
+  }
+
+  for (i = 0; i < norig; i++)
+    before += !orig[i].fixed;
+  for (i = 0; i < nwork; i++)
+    after += !(work[i].removed || work[i].fixed);
+  printf("%d networks reduced to %d\n\n", before, after);
+
+  if (strlen(optfile) + 5 > sizeof(tmpname)) {
+    fprintf(stderr, "Error: File name %s is too long\n", optfile);
+    return (1);
+  }
+  strcpy(tmpname, optfile);
+  strcat(tmpname, ".tmp");
+
+  printf("Writing optimized configuration %s...\n", optfile);
+  if ((out = fopen(tmpname, "w")) == NULL) {
+    fprintf(stderr, "Error: Could not open %s for writing (%s)\n", tmpname,
+            strerror(errno));
+    return (1);
+  }
+  write_optimized(out, config, filename, work, nwork, pathmap);
+  if (ferror(out) | fclose(out)) {
+    fprintf(stderr, "Error: Could not write %s (%s)\n", tmpname,
+            strerror(errno));
+    unlink(tmpname);
+    return (1);
+  }
+
+  /* Read it back and put its paths back into the original numbering */
+  read_config(tmpname, &newconfig);
+  nreread = collect_rules(&newconfig, &reread);
+  for (i = 0; i < nreread; i++) {
+    if (reread[i].group == OPT_LOCAL)
+      continue;
+    for (path = 0; (path < config->index->npaths) &&
+                   (pathmap[path] != reread[i].group);
+         path++)
+      ;
+    reread[i].group = path;
   }
+
+  if (verify_rules(orig, norig, reread, nreread)) {
+    fprintf(stderr, "Error: The optimized configuration doesn't behave like "
+                    "the original, it has not been written\n");
+    unlink(tmpname);
+    rc = 1;
+  } else if (rename(tmpname, optfile) != 0) {
+    fprintf(stderr, "Error: Could not rename %s to %s (%s)\n", tmpname,
+            optfile, strerror(errno));
+    unlink(tmpname);
+    rc = 1;
+  } else {
+    printf("... Write complete, checked equivalent to %s\n", filename);
+  }
+
+  free_config(&newconfig);
+  free(orig);
+  free(work);
+  free(reread);
+  free(pathmap);
+
+  return (rc);
+}
+
+/* Flatten the networks of a configuration into an array of rules, */
+/* returns the number of rules                                     */
+int collect_rules(struct parsedfile *config, struct optrule **rules) {
+  struct serverent *server;
+  struct netent *net;
+  struct optrule *rule;
+  uint32_t path = 0, mask;
+  int count = 0, space = 0, first = 1;
+
+  *rules = NULL;
+  for (server = config->paths; server != NULL; server = server->next) {
+    for (net = server->reachnets; net != NULL; net = net->next) {
+      rule = grow_rules(rules, &count, &space);
+      rule->group = path;
+      rule->server = server;
+      rule->startport = net->startport;
+      rule->endport = net->endport;
+      rule->start = ntohl(net->localip.s_addr);
+      rule->mask = ntohl(net->localnet.s_addr);
+    }
+    path++;
+  }
+  /* The parser adds the loopback network once the file has been */
+  /* read, so it's at the head of the list                       */
+  for (net = config->localnets; net != NULL; net = net->next, first = 0) {
+    rule = grow_rules(rules, &count, &space);
+    rule->group = OPT_LOCAL;
+    rule->fixed = first;
+    rule->start = ntohl(net->localip.s_addr);
+    rule->mask = ntohl(net->localnet.s_addr);
+  }
+
+  for (rule = *rules; rule < *rules + count; rule++) {
+    mask = rule->mask;
+    rule->start &= mask;
+    rule->end = rule->start | ~mask;
+    rule->irregular = ((~mask & (~mask + 1)) != 0);
+  }
+
+  return (count);
+}
+
+/* Add an empty rule to the end of an array of rules */
+struct optrule *grow_rules(struct optrule **rules, int *count, int *space) {
+
+  if (*count == *space) {
+    *space = (*space ? *space * 2 : 64);
+    if ((*rules = realloc(*rules, *space * sizeof(**rules))) == NULL) {
+      fprintf(stderr, "Error: Out of memory\n");
+      exit(1);
+    }
+  }
+  memset(&((*rules)[*count]), 0x0, sizeof(**rules));
+
+  return (&((*rules)[(*count)++]));
+}
+
+/* Mark every rule whose removal wouldn't change the outcome for any  */
+/* destination, one at a time so that of two identical rules only one */
+/* goes. The smallest networks are tried first since they're the ones */
+/* most likely to be covered by others. Returns the number removed    */
+int remove_redundant(struct optrule *rules, int count, int report) {
+  struct optrule **order;
+  uint32_t *ipbreaks, *portbreaks;
+  int nip, nport, removed = 0, i, j, hidden;
+
+  ipbreaks = rule_breaks(rules, count, NULL, 0, 0, &nip);
+  portbreaks = rule_breaks(rules, count, NULL, 0, 1, &nport);
+  if ((order = malloc((count + 1) * sizeof(*order))) == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < count; i++)
+    order[i] = &(rules[i]);
+  qsort(order, count, sizeof(*order), compare_sizes);
+
+  for (i = 0; i < count; i++) {
+    j = order[i] - rules;
+    if (rules[j].removed || rules[j].irregular || rules[j].fixed)
+      continue;
+    if (rule_decides(rules, count, j, ipbreaks, nip, portbreaks, nport, 0))
+      continue;
+    if (report) {
+      hidden = !rule_decides(rules, count, j, ipbreaks, nip, portbreaks,
+                             nport, 1);
+      show_rule(&(rules[j]),
+                (!hidden ? "doesn't change the outcome, other networks "
+                           "already cover it"
+                 : (rules[j].group == OPT_LOCAL)
+                     ? "can never match, paths reach all of it"
+                     : "can never match, paths later in the file take "
+                       "precedence"));
+    }
+    rules[j].removed = 1;
+    removed++;
+  }
+
+  free(order);
+  free(ipbreaks);
+  free(portbreaks);
+
+  return (removed);
+}
+
+/* Work out whether a rule decides the outcome for any destination, */
+/* i.e without it some destination would be classified by a group   */
+/* that sorts after it (or with orequal, after or alongside it)     */
+int rule_decides(struct optrule *rules, int count, int r, uint32_t *ipbreaks,
+                 int nip, uint32_t *portbreaks, int nport, int orequal) {
+  struct optrule *rule = &(rules[r]);
+  uint32_t best;
+  int lo = 0, hi = nip, mid, i, p;
+
+  /* Every rule starts on a break, find it */
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (ipbreaks[mid] < rule->start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (i = lo; (i < nip) && (ipbreaks[i] <= rule->end); i++) {
+    best = best_group(rules, count, r, ipbreaks[i], 0, 1);
+    if ((best > rule->group) || (orequal && (best == rule->group)))
+      return (1);
+    for (p = 0; p < nport; p++) {
+      if ((rule->group != OPT_LOCAL) && rule->startport &&
+          ((portbreaks[p] < rule->startport) ||
+           (portbreaks[p] > rule->endport)))
+        continue;
+      best = best_group(rules, count, r, ipbreaks[i], portbreaks[p], 0);
+      if ((best > rule->group) || (orequal && (best == rule->group)))
+        return (1);
+    }
+  }
+
+  return (0);
+}
+
+/* Find the group that classifies a destination, ignoring rule skip. */
+/* Irregular netmasks are left out, the optimizer never touches them */
+/* so they behave the same before and after                          */
+uint32_t best_group(struct optrule *rules, int count, int skip, uint32_t ip,
+                    uint32_t port, int anyport) {
+  uint32_t best = OPT_DEFAULT;
+  struct optrule *rule;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    rule = &(rules[i]);
+    if ((i == skip) || rule->removed || rule->irregular ||
+        (rule->group >= best) || (ip < rule->start) || (ip > rule->end))
+      continue;
+    if ((rule->group != OPT_LOCAL) && !anyport && rule->startport &&
+        ((port < rule->startport) || (port > rule->endport)))
+      continue;
+    best = rule->group;
+  }
+
+  return (best);
+}
+
+/* Collect the sorted addresses (or ports) at which some rule starts */
+/* or stops matching, every destination between two of them is       */
+/* classified the same way                                           */
+uint32_t *rule_breaks(struct optrule *a, int na, struct optrule *b, int nb,
+                      int ports, int *count) {
+  struct optrule *rule;
+  uint32_t *breaks;
+  int n = 0, i, j;
+
+  if ((breaks = malloc((2 * (na + nb) + 2) * sizeof(*breaks))) == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    exit(1);
+  }
+  breaks[n++] = 0;
+  if (ports)
+    breaks[n++] = 1;
+  for (i = 0; i < na + nb; i++) {
+    rule = (i < na ? &(a[i]) : &(b[i - na]));
+    if (rule->removed || rule->irregular)
+      continue;
+    if (!ports) {
+      breaks[n++] = rule->start;
+      if (rule->end != 0xffffffffU)
+        breaks[n++] = rule->end + 1;
+    } else if ((rule->group != OPT_LOCAL) && rule->startport) {
+      breaks[n++] = rule->startport;
+      if (rule->endport < 65535)
+        breaks[n++] = rule->endport + 1;
+    }
+  }
+
+  qsort(breaks, n, sizeof(*breaks), compare_uint32);
+  for (i = 1, j = 1; i < n; i++)
+    if (breaks[i] != breaks[j - 1])
+      breaks[j++] = breaks[i];
+  *count = j;
+
+  return (breaks);
+}
+
+/* Merge overlapping and adjacent networks that have the same group */
+/* and ports into the fewest prefixes that cover them. Removed rules */
+/* are dropped. Returns the new number of rules                      */
+int aggregate_rules(struct optrule **rules, int count) {
+  struct optrule *in = *rules, *out = NULL, *rule;
+  uint64_t lo, hi, size;
+  int n = 0, space = 0, i, j, k, mark;
+
+  qsort(in, count, sizeof(*in), compare_optrules);
+
+  for (i = 0; i < count; i = j) {
+    for (j = i + 1; (j < count) && !compare_keys(&(in[i]), &(in[j])); j++)
+      ;
+    if (in[i].removed)
+      continue;
+    if (in[i].irregular || in[i].fixed) {
+      for (k = i; k < j; k++)
+        *grow_rules(&out, &n, &space) = in[k];
+      continue;
+    }
+
+    mark = n;
+    for (k = i; k < j;) {
+      lo = in[k].start;
+      hi = in[k].end;
+      for (k++; (k < j) && ((uint64_t)in[k].start <= hi + 1); k++)
+        if (in[k].end > hi)
+          hi = in[k].end;
+      while (lo <= hi) {
+        size = (lo ? (lo & -lo) : (1ULL << 32));
+        while (lo + size - 1 > hi)
+          size >>= 1;
+        rule = grow_rules(&out, &n, &space);
+        *rule = in[i];
+        rule->start = lo;
+        rule->end = lo + size - 1;
+        rule->mask = ~(uint32_t)(size - 1);
+        lo += size;
+      }
+    }
+
+    /* Keep the rules as written unless merging saved something */
+    if (n - mark >= j - i) {
+      n = mark;
+      for (k = i; k < j; k++)
+        *grow_rules(&out, &n, &space) = in[k];
+    }
+  }
+
+  free(in);
+  *rules = out;
+
+  return (n);
+}
+
+/* Check two sets of rules classify every destination, with and */
+/* without a port, the same way. Returns 0 if they do           */
+int verify_rules(struct optrule *a, int na, struct optrule *b, int nb) {
+  uint32_t *ipbreaks, *portbreaks;
+  int nip, nport, i, p, rc = 0;
+
+  /* Irregular networks are compared as they stand */
+  qsort(a, na, sizeof(*a), compare_optrules);
+  qsort(b, nb, sizeof(*b), compare_optrules);
+  for (i = 0, p = 0;; i++, p++) {
+    while ((i < na) && !a[i].irregular)
+      i++;
+    while ((p < nb) && !b[p].irregular)
+      p++;
+    if ((i == na) || (p == nb)) {
+      rc = ((i != na) || (p != nb));
+      break;
+    }
+    if (compare_optrules(&(a[i]), &(b[p]))) {
+      rc = 1;
+      break;
+    }
+  }
+
+  ipbreaks = rule_breaks(a, na, b, nb, 0, &nip);
+  portbreaks = rule_breaks(a, na, b, nb, 1, &nport);
+  for (i = 0; !rc && (i < nip); i++) {
+    if (best_group(a, na, -1, ipbreaks[i], 0, 1) !=
+        best_group(b, nb, -1, ipbreaks[i], 0, 1))
+      rc = 1;
+    for (p = 0; !rc && (p < nport); p++)
+      if (best_group(a, na, -1, ipbreaks[i], portbreaks[p], 0) !=
+          best_group(b, nb, -1, ipbreaks[i], portbreaks[p], 0))
+        rc = 1;
+  }
+
+  free(ipbreaks);
+  free(portbreaks);
+
+  return (rc);
+}
+
+/* Write out a configuration with the networks given in rules. Paths */
+/* are written in reverse list order so they come out in the order   */
+/* of the original file                                              */
+void write_optimized(FILE *out, struct parsedfile *config, char *filename,
+                     struct optrule *rules, int count, uint32_t *pathmap) {
+  struct serverent **paths, *server;
+  struct fileent *file;
+  uint32_t npaths = config->index->npaths, path;
+  int i;
+
+  fprintf(out,
+          "# Generated by validateconf from %s, networks which made no\n"
+          "# difference have been removed and the rest merged\n\n",
+          filename);
+
+  write_settings(out, &(config->defaultserver), "");
+  for (i = 0; i < count; i++)
+    if (!rules[i].removed && !rules[i].fixed && (rules[i].group == OPT_LOCAL))
+      write_rule(out, "local", &(rules[i]), "");
+  for (file = config->localfiles; file != NULL; file = file->next)
+    fprintf(out, "local_file = %s\n", file->filename);
+
+  if ((paths = malloc((npaths + 1) * sizeof(*paths))) == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    exit(1);
+  }
+  for (server = config->paths, path = 0; server != NULL;
+       server = server->next, path++)
+    paths[path] = server;
+
+  for (path = npaths; path-- > 0;) {
+    if (pathmap[path] == ROUTE_NONE)
+      continue;
+    fprintf(out, "\npath {\n");
+    write_settings(out, paths[path], "  ");
+    for (i = 0; i < count; i++)
+      if (!rules[i].removed && (rules[i].group == path))
+        write_rule(out, "reaches", &(rules[i]), "  ");
+    for (file = paths[path]->reachfiles; file != NULL; file = file->next)
+      fprintf(out, "  reaches_file = %s\n", file->filename);
+    fprintf(out, "}\n");
+  }
+
+  free(paths);
+}
+
+void write_settings(FILE *out, struct serverent *server, char *indent) {
+  char *failover;
+  size_t len;
+
+  if (server->address == NULL)
+    return;
+  fprintf(out, "%sserver = %s\n", indent, server->address);
+  if (server->failover) {
+    failover = server->failover;
+    while ((len = strcspn(failover, " ")) > 0) {
+      fprintf(out, "%sserver = %.*s\n", indent, (int)len, failover);
+      failover += len + strspn(failover + len, " ");
+    }
+  }
+  if (server->failoverdelay)
+    fprintf(out, "%sfailover_delay = %d\n", indent, server->failoverdelay);
+  fprintf(out, "%sserver_port = %d\n", indent, server->port);
+  fprintf(out, "%sserver_type = %d\n", indent, server->type);
+  if (server->defuser)
+    fprintf(out, "%sdefault_user = %s\n", indent, server->defuser);
+  if (server->defpass)
+    fprintf(out, "%sdefault_pass = %s\n", indent, server->defpass);
+  if (server->flags & SERVER_PIPELINE)
+    fprintf(out, "%spipeline = yes\n", indent);
+  if (server->flags & SERVER_FASTOPEN)
+    fprintf(out, "%sfastopen = yes\n", indent);
+  if (server->flags & SERVER_OPTIMISTIC)
+    fprintf(out, "%soptimistic = yes\n", indent);
+  if (server->poolsize)
+    fprintf(out, "%spool = %d\n", indent, server->poolsize);
+  if (server->poolidle)
+    fprintf(out, "%spool_idle = %d\n", indent, server->poolidle);
+  if (server->flags & SERVER_POOLALWAYS)
+    fprintf(out, "%spool_refill = always\n", indent);
+}
+
+void write_rule(FILE *out, char *directive, struct optrule *rule,
+                char *indent) {
+  struct in_addr addr;
+
+  addr.s_addr = htonl(rule->start);
+  fprintf(out, "%s%s = %s", indent, directive, inet_ntoa(addr));
+  if (rule->startport) {
+    fprintf(out, ":%u", rule->startport);
+    if (rule->endport != rule->startport)
+      fprintf(out, "-%u", rule->endport);
+  }
+  addr.s_addr = htonl(rule->mask);
+  fprintf(out, "/%s\n", inet_ntoa(addr));
+}
+
+void show_rule(struct optrule *rule, char *why) {
+
+  if (rule->server)
+    printf("Path at line %d: ", rule->server->lineno);
+  write_rule(stdout, (rule->server ? "reaches" : "local"), rule, "");
+  printf("    %s\n", why);
+}
+
+int compare_uint32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return ((x > y) - (x < y));
+}
+
+/* Order rules so those that could be merged sit together, sorted */
+/* by address                                                      */
+int compare_optrules(const void *a, const void *b) {
+  const struct optrule *x = a, *y = b;
+  int rc;
+
+  if ((rc = compare_keys(a, b)))
+    return (rc);
+  if (x->start != y->start)
+    return (x->start < y->start ? -1 : 1);
+  if (x->mask != y->mask)
+    return (x->mask < y->mask ? -1 : 1);
+
+  return (0);
+}
+
+/* Rules compare equal here if they could be merged */
+int compare_keys(const void *a, const void *b) {
+  const struct optrule *x = a, *y = b;
+
+#define COMPARE_FIELD(field)                                                   \
+  if (x->field != y->field)                                                    \
+    return (x->field < y->field ? -1 : 1);
+
+  COMPARE_FIELD(removed);
+  COMPARE_FIELD(fixed);
+  COMPARE_FIELD(irregular);
+  COMPARE_FIELD(group);
+  COMPARE_FIELD(startport);
+  COMPARE_FIELD(endport);
+
+#undef COMPARE_FIELD
+
+  return (0);
+}
+
+/* Order pointers to rules by the number of addresses they cover */
+int compare_sizes(const void *a, const void *b) {
+  const struct optrule *x = *(struct optrule *const *)a;
+  const struct optrule *y = *(struct optrule *const *)b;
+  uint32_t xsize = x->end - x->start, ysize = y->end - y->start;
+
+  return ((xsize > ysize) - (xsize < ysize));
 }